@@ -0,0 +1,255 @@
+/**
+ * buf_pool.c
+ *
+ * Every buffer has a 16-byte header in front of it that gives its
+ * usable size, and while the buffer is free, the next free one.
+ * A thread caches up to BP_CACHE_BYTES of each class (between
+ * BP_CACHE_MIN and BP_CACHE_MAX buffers); a full cache moves half
+ * of itself to the class's depot, and an empty one takes a batch
+ * back, so the depot's lock is taken once a batch, not once a
+ * buffer.  A depot past BP_DEPOT_BYTES hands the excess back to
+ * the heap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "buf_pool.h"
+
+#define BP_MIN_SHIFT   6                  // the smallest class: 64 bytes
+#define BP_CLASSES     17                 // and the largest: 4MB
+#define BP_CACHE_BYTES (256 * 1024)       // a thread's cache, per class
+#define BP_CACHE_MIN   2
+#define BP_CACHE_MAX   64
+#define BP_DEPOT_BYTES (16 * 1024 * 1024) // a depot, likewise
+
+typedef struct bp_hdr_st {
+  size_t size;                  // usable bytes
+  struct bp_hdr_st *next;       // while free
+} bp_hdr;
+
+typedef struct bp_list_st {
+  bp_hdr *head;
+  int count;
+} bp_list;
+
+typedef struct bp_depot_st {
+  pthread_mutex_t lock;
+  bp_list free;
+} bp_depot;
+
+static bp_depot depot[BP_CLASSES];
+static pthread_key_t cache_key;         // flushes a cache at thread exit
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static __thread bp_list cache[BP_CLASSES];
+static __thread int cache_ready;
+
+static atomic_ulong held, peak, heap_allocs, big_allocs;
+
+/* the class a buffer of "size" bytes comes from, or -1: too big */
+static int size_class(size_t size) {
+  int cls;
+
+  if (size <= (1UL << BP_MIN_SHIFT))
+    return 0;
+  cls = (int) (sizeof(long) * 8) - __builtin_clzl(size - 1) - BP_MIN_SHIFT;
+  return cls < BP_CLASSES ? cls : -1;
+}
+
+static size_t class_size(int cls) {
+  return 1UL << (cls + BP_MIN_SHIFT);
+}
+
+static int cache_limit(int cls) {
+  int n = (int) (BP_CACHE_BYTES / class_size(cls));
+
+  return n < BP_CACHE_MIN ? BP_CACHE_MIN : n > BP_CACHE_MAX ? BP_CACHE_MAX : n;
+}
+
+static int depot_limit(int cls) {
+  int n = (int) (BP_DEPOT_BYTES / class_size(cls));
+
+  return n < BP_CACHE_MIN ? BP_CACHE_MIN : n;
+}
+
+static bp_hdr *heap_get(size_t size) {
+  bp_hdr *h = (bp_hdr *) malloc(sizeof(bp_hdr) + size);
+  unsigned long now, top;
+
+  if (h == NULL)
+    return NULL;
+  h->size = size;
+  atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+  now = atomic_fetch_add_explicit(&held, sizeof(bp_hdr) + size,
+                                  memory_order_relaxed) + sizeof(bp_hdr) + size;
+  top = atomic_load_explicit(&peak, memory_order_relaxed);
+  while (now > top && !atomic_compare_exchange_weak(&peak, &top, now))
+    ;
+  return h;
+}
+
+static void heap_put(bp_hdr *h) {
+  atomic_fetch_sub_explicit(&held, sizeof(bp_hdr) + h->size, memory_order_relaxed);
+  free(h);
+}
+
+/* give buffers to their depot, and what it has no room for to the heap */
+static void to_depot(int cls, bp_hdr *h) {
+  bp_hdr *next, *excess = NULL;
+
+  pthread_mutex_lock(&depot[cls].lock);
+  for (; h != NULL; h = next) {
+    next = h->next;
+    if (depot[cls].free.count < depot_limit(cls)) {
+      h->next = depot[cls].free.head;
+      depot[cls].free.head = h;
+      depot[cls].free.count++;
+    } else {
+      h->next = excess;
+      excess = h;
+    }
+  }
+  pthread_mutex_unlock(&depot[cls].lock);
+  while ((h = excess) != NULL) {
+    excess = h->next;
+    heap_put(h);
+  }
+}
+
+/* a thread is exiting: move its whole cache to the depots */
+static void flush_cache(void *unused) {
+  int cls;
+
+  for (cls = 0; cls < BP_CLASSES; cls++) {
+    to_depot(cls, cache[cls].head);
+    cache[cls].head = NULL;
+    cache[cls].count = 0;
+  }
+  cache_ready = 0;    // a later destructor's buffers start it again
+}
+
+static void init_pool(void) {
+  int cls;
+
+  for (cls = 0; cls < BP_CLASSES; cls++) {
+    pthread_mutex_init(&depot[cls].lock, NULL);
+    depot[cls].free.head = NULL;
+    depot[cls].free.count = 0;
+  }
+  pthread_key_create(&cache_key, flush_cache);
+}
+
+/* the first use on a thread: arrange for its cache to be flushed */
+static void init_cache(void) {
+  pthread_once(&once, init_pool);
+  pthread_setspecific(cache_key, cache);
+  cache_ready = 1;
+}
+
+/* the cache is empty: take up to half a cache's worth back */
+static void refill(int cls) {
+  bp_list *c = &cache[cls];
+  bp_hdr *h;
+  int n = cache_limit(cls) / 2;
+
+  pthread_mutex_lock(&depot[cls].lock);
+  while (n-- > 0 && (h = depot[cls].free.head) != NULL) {
+    depot[cls].free.head = h->next;
+    depot[cls].free.count--;
+    h->next = c->head;
+    c->head = h;
+    c->count++;
+  }
+  pthread_mutex_unlock(&depot[cls].lock);
+}
+
+/* the cache is full: keep its newest half, the likeliest to be hot */
+static void spill(int cls) {
+  bp_list *c = &cache[cls];
+  bp_hdr *last = c->head, *rest;
+  int keep = c->count / 2, i;
+
+  for (i = 1; i < keep; i++)
+    last = last->next;
+  rest = last->next;
+  last->next = NULL;
+  c->count = keep;
+  to_depot(cls, rest);
+}
+
+void *bp_alloc(size_t size) {
+  int cls = size_class(size);
+  bp_list *c;
+  bp_hdr *h;
+
+  if (cls < 0) {
+    if ((h = heap_get(size)) == NULL)
+      return NULL;
+    atomic_fetch_add_explicit(&big_allocs, 1, memory_order_relaxed);
+    return h + 1;
+  }
+
+  if (!cache_ready)
+    init_cache();
+  c = &cache[cls];
+  if (c->head == NULL)
+    refill(cls);
+  if ((h = c->head) != NULL) {
+    c->head = h->next;
+    c->count--;
+    return h + 1;
+  }
+  if ((h = heap_get(class_size(cls))) == NULL)
+    return NULL;
+  return h + 1;
+}
+
+void bp_free(void *buf) {
+  bp_hdr *h;
+  bp_list *c;
+  int cls;
+
+  if (buf == NULL)
+    return;
+  h = (bp_hdr *) buf - 1;
+  if ((cls = size_class(h->size)) < 0) {
+    heap_put(h);
+    return;
+  }
+
+  if (!cache_ready)
+    init_cache();
+  c = &cache[cls];
+  if (c->count >= cache_limit(cls))
+    spill(cls);
+  h->next = c->head;
+  c->head = h;
+  c->count++;
+}
+
+void *bp_grow(void *buf, size_t keep, size_t size) {
+  void *grown;
+
+  if (buf != NULL && bp_size(buf) >= size)
+    return buf;
+  if ((grown = bp_alloc(size)) == NULL)
+    return NULL;
+  if (keep > 0)
+    memcpy(grown, buf, keep);
+  bp_free(buf);
+  return grown;
+}
+
+size_t bp_size(void *buf) {
+  return ((bp_hdr *) buf - 1)->size;
+}
+
+void bp_get_stats(bp_stats *st) {
+  st->held = atomic_load_explicit(&held, memory_order_relaxed);
+  st->peak = atomic_load_explicit(&peak, memory_order_relaxed);
+  st->heap_allocs = atomic_load_explicit(&heap_allocs, memory_order_relaxed);
+  st->big_allocs = atomic_load_explicit(&big_allocs, memory_order_relaxed);
+}
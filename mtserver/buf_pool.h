@@ -0,0 +1,45 @@
+/**
+ * buf_pool.h
+ *
+ * A size-classed buffer pool for request and response memory.
+ * Buffers come in powers of two from 64 bytes to 4MB; a freed
+ * buffer goes into a small cache belonging to the thread that
+ * freed it, and past that into a shared depot for its size, so
+ * once a server has warmed up, taking and giving back buffers
+ * goes nowhere near the heap.  Bigger buffers come straight from
+ * malloc.  Any thread may free a buffer any thread took.
+ */
+
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+/**
+ * bp_alloc returns a buffer of at least "size" bytes, or NULL if
+ * there is no memory for one; bp_free gives it back.
+ */
+void *bp_alloc(size_t size);
+void  bp_free(void *buf);
+
+/**
+ * bp_grow returns a buffer of at least "size" bytes that starts
+ * with the first "keep" bytes of "buf", which it frees unless it
+ * is big enough already (then it returns "buf" itself).  On
+ * failure it returns NULL and leaves "buf" alone.
+ */
+void *bp_grow(void *buf, size_t keep, size_t size);
+
+/* bp_size returns how many bytes "buf" really has room for */
+size_t bp_size(void *buf);
+
+typedef struct bp_stats_st {
+  unsigned long held;         // bytes taken from the heap, in use or cached
+  unsigned long peak;         // the most "held" has ever been
+  unsigned long heap_allocs;  // buffers malloc()ed; flat once warmed up
+  unsigned long big_allocs;   // of those, too big for a size class
+} bp_stats;
+
+void bp_get_stats(bp_stats *st);
+
+#endif
@@ -3,7 +3,8 @@
  *
  * The client is a single-threaded program; it sits in a tight
  * loop, and in each iteration, it opens a TCP connection to
- * the server, sends a request, and reads back a response.
+ * the server, says HELLO, sends requests, and reads back the
+ * responses.
  */
 
 #include <stdlib.h>
@@ -13,49 +14,352 @@
 #include <sys/types.h>
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include "lib/socklib.h"
 #include "common.h"
 
+#define MAX_PIPELINE 64
+#define CLIENT_BODY 10      // default -b
+#define CLIENT_BUF 65536    // bytes written, or read, at once
+
+static int body = CLIENT_BODY;  // -b: bytes in each request
+static int chunk = 0;           // -c: stream bodies this much at a time
+static int offer = PROTO_MAX;   // -V: highest version we ask for
+static int depth = 1;           // -p: requests outstanding at once
+static long keys = 1;           // -K: distinct requests to send
+
+// one connection, and how far through its requests it has got
+typedef struct session_st {
+  int fd;
+  int total;            // requests to send
+  int sent;             // requests written out
+  int answered;         // requests whose last response is in
+  int wait;             // send no request until the server's HELLO
+  int hello;            // which is in
+  int shut;             // we've half-closed
+  int nchunks;          // frames in a request
+  char *frames[2];      // a chunk flagged FRAME_MORE, and the last one
+  int flen[2];
+  int k;                // frames of the current request queued
+  int foff;             // bytes of the current frame queued
+  char out[CLIENT_BUF];
+  int olen, ooff;       // bytes queued, and of those, written
+  char hdr[FRAME_HEADER];
+  int hlen;             // bytes of the next response's header in
+  frame f;
+  uint32_t left;        // bytes of its payload still to come
+  char msg[256];        // a HELLO's or ERROR's payload
+  int mlen;
+} session;
+
 /**
  * This program should be invoked as "./client hostname portnumber",
- * for example, "./client spinlock 4342".
+ * for example, "./client spinlock 4342".  Options, which go before
+ * the hostname:
+ *
+ *   -n requests   requests sent over each connection before it is
+ *                 closed (default 1, a connection per request)
+ *   -p depth      requests sent before waiting for the oldest one's
+ *                 response (default 1, at most 64)
+ *   -b bytes      the size of each request (default 10)
+ *   -c bytes      stream each request in chunks of this size (it
+ *                 takes protocol version 2); by default a request
+ *                 goes in one frame, unless the server's frames are
+ *                 smaller
+ *   -V version    the highest protocol version to ask for
+ *                 (default 2)
+ *   -K keys       send this many different requests, picked at
+ *                 random, by writing a number into each one's first
+ *                 bytes (default 1: every request is the same), to
+ *                 see what a server's response cache does
  */
 
+static void build_frames(session *s, int size);
+static void start(session *s, int fd, int total);
+static int  run(session *s);
+
 int main(int argc, char **argv) {
-  int  socket_talk, i;
-  char request[REQUEST_SIZE];
-  char response[RESPONSE_SIZE];
+  static session s;
+  int  socket_talk, opt;
+  int  per_conn = 1;
 
-  if (argc != 3) {
-    fprintf(stderr,
-	    "(CLIENT): Invoke as  'client machine.name.address socknum'\n");
-    exit(1);
+  while ((opt = getopt(argc, argv, "n:p:b:c:V:K:")) != -1) {
+    switch (opt) {
+    case 'n':
+      per_conn = atoi(optarg);
+      break;
+    case 'p':
+      depth = atoi(optarg);
+      break;
+    case 'b':
+      body = atoi(optarg);
+      break;
+    case 'c':
+      chunk = atoi(optarg);
+      break;
+    case 'V':
+      offer = atoi(optarg);
+      break;
+    case 'K':
+      keys = atol(optarg);
+      break;
+    default:
+      argc = 0;   // fall into the usage message
+    }
   }
 
-  // initialize request to some silly data
-  for (i=0; i<REQUEST_SIZE; i++) {
-    request[i] = (char) i%255;
+  if (argc - optind != 2 || per_conn < 1 || depth < 1 || depth > MAX_PIPELINE ||
+      body < 0 || chunk < 0 || offer < PROTO_MIN || offer > PROTO_MAX ||
+      keys < 1) {
+    fprintf(stderr,
+	    "(CLIENT): Invoke as  'client [-n requests] [-p depth] [-b bytes] [-c chunk] [-V version]\n"
+	    "(CLIENT):   [-K keys] machine.name.address socknum'\n");
+    exit(1);
   }
 
   // spin forever, opening connections, and pushing requests
   while(1) {
-    int result;
-
     // open up a connection to the server
-    if ((socket_talk = sconnect(argv[1], argv[2])) < 0) {
+    if ((socket_talk = sconnect(argv[optind], argv[optind + 1])) < 0) {
       perror("(CLIENT): sconnect");
       exit(1);
     }
 
-    // write the request
-    result = correct_write(socket_talk, request, REQUEST_SIZE);
-    if (result == REQUEST_SIZE) {
-      // read the response
-      result = correct_read(socket_talk, response, RESPONSE_SIZE);
-    }
+    start(&s, socket_talk, per_conn);
+    run(&s);
     close(socket_talk);
+    free(s.frames[0]);
+    free(s.frames[1]);
+  }
+
+  return 0;
+}
+
+/**
+ * Build the frames a request goes out in: as many chunks of "size"
+ * bytes as it takes, and what is left over in the last one.
+ */
+static void build_frames(session *s, int size) {
+  int i, k, len;
+
+  s->nchunks = body > size ? (body + size - 1) / size : 1;
+  for (k = 0; k < 2; k++) {
+    len = k == 0 ? size : body - (s->nchunks - 1) * size;
+    if ((s->frames[k] = (char *) malloc(FRAME_HEADER + len)) == NULL) {
+      fprintf(stderr, "(CLIENT): out of memory!\n");
+      exit(1);
+    }
+    frame_pack(s->frames[k], FRAME_REQUEST, k == 0 ? FRAME_MORE : 0, len);
+    // initialize requests to some silly data
+    for (i = 0; i < len; i++)
+      s->frames[k][FRAME_HEADER + i] = (char) (i%10)%255;
+    s->flen[k] = FRAME_HEADER + len;
+  }
+}
+
+/**
+ * Get ready to send "total" requests over "fd", and queue the HELLO.
+ * Unless they have to wait for the server's HELLO, to see how it
+ * wants them cut up, the requests go straight after it.
+ */
+static void start(session *s, int fd, int total) {
+  s->fd = fd;
+  s->total = total;
+  s->sent = s->answered = 0;
+  s->hello = s->shut = 0;
+  s->k = s->foff = 0;
+  s->hlen = 0;
+  s->frames[0] = s->frames[1] = NULL;
+
+  frame_pack(s->out, FRAME_HELLO, 0, HELLO_SIZE);
+  hello_pack(s->out + FRAME_HEADER, PROTO_MIN, offer);
+  s->olen = FRAME_HEADER + HELLO_SIZE;
+  s->ooff = 0;
+
+  s->wait = (chunk > 0 && chunk < body) || body > FRAME_SMALL;
+  if (!s->wait)
+    build_frames(s, body);
+}
+
+/* the server's HELLO is in: cut requests up the way it can take them */
+static void got_hello(session *s) {
+  uint32_t max_frame;
+  int version, size;
+
+  if (s->mlen != HELLO_REPLY_SIZE) {
+    fprintf(stderr, "(CLIENT): bad HELLO from the server\n");
+    exit(1);
   }
+  hello_reply_unpack(s->msg, &version, &max_frame);
+  s->hello = 1;
+  if (!s->wait)
+    return;
 
+  size = chunk > 0 && chunk < body ? chunk : body;
+  if (version < PROTO_CHUNKED)
+    size = body;
+  if ((uint32_t) size > max_frame) {
+    if (version < PROTO_CHUNKED) {
+      fprintf(stderr, "(CLIENT): the server takes %u bytes a frame, "
+              "and version %d can't stream\n", max_frame, version);
+      exit(1);
+    }
+    size = max_frame;
+  }
+  build_frames(s, size);
+}
+
+/* a whole response frame is in */
+static void frame_done(session *s) {
+  switch (s->f.type) {
+  case FRAME_HELLO:
+    if (!s->hello) {
+      got_hello(s);
+      return;
+    }
+    break;
+  case FRAME_RESPONSE:
+    if (s->hello) {
+      if (!(s->f.flags & FRAME_MORE))
+        s->answered++;
+      return;
+    }
+    break;
+  case FRAME_ERROR:
+    fprintf(stderr, "(CLIENT): the server says: %.*s\n", s->mlen, s->msg);
+    exit(1);
+  }
+  fprintf(stderr, "(CLIENT): unexpected frame type %d\n", s->f.type);
+  exit(1);
+}
+
+/* take "len" bytes of the server's frames */
+static void take(session *s, char *buf, int len) {
+  int m;
+
+  while (len > 0) {
+    if (s->hlen < FRAME_HEADER) {
+      m = FRAME_HEADER - s->hlen < len ? FRAME_HEADER - s->hlen : len;
+      memcpy(s->hdr + s->hlen, buf, m);
+      s->hlen += m;
+      buf += m;
+      len -= m;
+      if (s->hlen < FRAME_HEADER)
+        return;
+      frame_unpack(s->hdr, &s->f);
+      s->left = s->f.length;
+      s->mlen = 0;
+    } else {
+      // responses are only counted; keep what else comes
+      m = s->left < (uint32_t) len ? (int) s->left : len;
+      if (s->f.type != FRAME_RESPONSE && s->mlen < (int) sizeof(s->msg)) {
+        int keep = m < (int) sizeof(s->msg) - s->mlen ? m : (int) sizeof(s->msg) - s->mlen;
+
+        memcpy(s->msg + s->mlen, buf, keep);
+        s->mlen += keep;
+      }
+      s->left -= m;
+      buf += m;
+      len -= m;
+    }
+    if (s->left == 0) {
+      s->hlen = 0;
+      frame_done(s);
+    }
+  }
+}
+
+/* make the next request one of "keys" different ones */
+static void pick_key(session *s) {
+  char *p = s->frames[s->nchunks > 1 ? 0 : 1] + FRAME_HEADER;
+  unsigned long key = (unsigned long) random() % keys;
+  int i, len = s->flen[s->nchunks > 1 ? 0 : 1] - FRAME_HEADER;
+
+  for (i = 0; i < 4 && i < len; i++, key >>= 8)
+    p[i] = (char) key;
+}
+
+/**
+ * Queue as much of the requests as fits, keeping at most "depth"
+ * of them unanswered.
+ */
+static void fill(session *s) {
+  int m, last;
+
+  if (s->ooff > 0) {
+    memmove(s->out, s->out + s->ooff, s->olen - s->ooff);
+    s->olen -= s->ooff;
+    s->ooff = 0;
+  }
+  while (s->olen < CLIENT_BUF && s->sent < s->total) {
+    if (s->k == 0 && s->foff == 0 && s->sent - s->answered >= depth)
+      break;
+    if (s->k == 0 && s->foff == 0 && keys > 1)
+      pick_key(s);
+    last = s->k == s->nchunks - 1;
+    m = s->flen[last] - s->foff;
+    if (m > CLIENT_BUF - s->olen)
+      m = CLIENT_BUF - s->olen;
+    memcpy(s->out + s->olen, s->frames[last] + s->foff, m);
+    s->olen += m;
+    s->foff += m;
+    if (s->foff == s->flen[last]) {
+      s->foff = 0;
+      if (++s->k == s->nchunks) {
+        s->k = 0;
+        s->sent++;
+      }
+    }
+  }
+}
+
+/**
+ * Send the requests and read their responses, both as the socket
+ * allows, so a big body streams without either side waiting for
+ * the other to finish.  Returns 0 once every request is answered,
+ * or -1 if the connection failed first.
+ */
+static int run(session *s) {
+  char in[CLIENT_BUF];
+  struct pollfd pfd;
+  int ret;
+
+  while (s->answered < s->total) {
+    if (s->hello || !s->wait)
+      fill(s);
+    // after the last one, tell the server we're done, so it
+    // closes first and the TIME_WAIT (and port) is its, not ours
+    if (s->sent == s->total && s->ooff == s->olen && !s->shut) {
+      shutdown(s->fd, SHUT_WR);
+      s->shut = 1;
+    }
+
+    pfd.fd = s->fd;
+    pfd.events = POLLIN | (s->ooff < s->olen ? POLLOUT : 0);
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (pfd.revents & POLLOUT) {
+      ret = send(s->fd, s->out + s->ooff, s->olen - s->ooff,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (ret < 0 && errno != EAGAIN && errno != EINTR)
+        return -1;
+      if (ret > 0)
+        s->ooff += ret;
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      ret = recv(s->fd, in, sizeof(in), MSG_DONTWAIT);
+      if (ret == 0)
+        return -1;
+      if (ret < 0 && errno != EAGAIN && errno != EINTR)
+        return -1;
+      if (ret > 0)
+        take(s, in, ret);
+    }
+  }
   return 0;
 }
@@ -0,0 +1,166 @@
+/**
+ * coalesce.c
+ *
+ * The first request of a kind registers a flight, pointing at its
+ * own bytes, and computes outside the lock.  Duplicates find the
+ * flight, count themselves in and sleep on it.  When the response
+ * is ready the flight comes out of the table, so later arrivals
+ * start afresh, and if anyone is waiting the first request leaves
+ * them a copy; the last waiter to take its own copy frees it all.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "coalesce.h"
+#include "common.h"
+#include "buf_pool.h"
+
+#define CO_SHARDS     64        // a power of two
+#define CO_BUCKETS    16        // per shard; flights are few and short
+#define CO_CACHE_LINE 64
+
+typedef struct flight_st {
+  uint64_t hash;
+  struct flight_st *chain;      // the next in its bucket
+  char *request;                // the first request's bytes
+  int length;
+  int done;
+  char *response;               // the waiters' copy, once done
+  int response_length;
+  int waiters;                  // still to take theirs
+  pthread_cond_t landed;
+} flight;
+
+typedef struct co_shard_st {
+  _Alignas(CO_CACHE_LINE) pthread_mutex_t lock;
+  flight *buckets[CO_BUCKETS];
+  unsigned long computed, shared;
+} co_shard;
+
+struct coalescer_st {
+  co_shard shards[CO_SHARDS];
+};
+
+coalescer *co_create(void) {
+  coalescer *co;
+  int i;
+
+  // shards sit on cache lines of their own
+  if (posix_memalign((void **) &co, CO_CACHE_LINE, sizeof(coalescer)))
+    return NULL;
+  memset(co, 0, sizeof(coalescer));
+  for (i = 0; i < CO_SHARDS; i++)
+    pthread_mutex_init(&co->shards[i].lock, NULL);
+  return co;
+}
+
+/* wait for "f" to land, and take a copy of what it brought */
+static char *join(co_shard *sh, flight *f, int *response_length) {
+  char *response = NULL;
+  int last;
+
+  f->waiters++;
+  sh->shared++;
+  while (!f->done)
+    pthread_cond_wait(&f->landed, &sh->lock);
+  pthread_mutex_unlock(&sh->lock);
+
+  // nothing changes it now, so copy without the lock
+  if (f->response != NULL &&
+      (response = (char *) bp_alloc(f->response_length)) != NULL) {
+    memcpy(response, f->response, f->response_length);
+    *response_length = f->response_length;
+  }
+
+  pthread_mutex_lock(&sh->lock);
+  last = --f->waiters == 0;
+  pthread_mutex_unlock(&sh->lock);
+  if (last) {
+    bp_free(f->response);
+    pthread_cond_destroy(&f->landed);
+    bp_free(f);
+  }
+  return response;
+}
+
+char *co_run(coalescer *co, char *request, int length, int *response_length,
+             co_compute compute) {
+  uint64_t hash = hash_bytes(request, length);
+  co_shard *sh = &co->shards[(hash >> 58) & (CO_SHARDS - 1)];
+  flight **bucket = &sh->buckets[hash & (CO_BUCKETS - 1)], **pp, *f;
+  char *out;
+  int len, waiters;
+
+  pthread_mutex_lock(&sh->lock);
+  for (f = *bucket; f != NULL; f = f->chain)
+    if (f->hash == hash && f->length == length &&
+        memcmp(f->request, request, length) == 0)
+      return join(sh, f, response_length);
+
+  sh->computed++;
+  if ((f = (flight *) bp_alloc(sizeof(flight))) == NULL) {
+    // no room to share it: just work it out
+    pthread_mutex_unlock(&sh->lock);
+    return compute(request, length, response_length);
+  }
+  f->hash = hash;
+  f->request = request;
+  f->length = length;
+  f->done = 0;
+  f->response = NULL;
+  f->waiters = 0;
+  pthread_cond_init(&f->landed, NULL);
+  f->chain = *bucket;
+  *bucket = f;
+  pthread_mutex_unlock(&sh->lock);
+
+  out = compute(request, length, &len);
+
+  pthread_mutex_lock(&sh->lock);
+  for (pp = bucket; *pp != f; pp = &(*pp)->chain)
+    ;
+  *pp = f->chain;
+  f->done = 1;
+  if ((waiters = f->waiters) > 0) {
+    if (out != NULL && (f->response = (char *) bp_alloc(len)) != NULL) {
+      memcpy(f->response, out, len);
+      f->response_length = len;
+    }
+    pthread_cond_broadcast(&f->landed);
+  }
+  pthread_mutex_unlock(&sh->lock);
+  // with no one waiting, no one else can find it now
+  if (waiters == 0) {
+    pthread_cond_destroy(&f->landed);
+    bp_free(f);
+  }
+
+  if (out != NULL)
+    *response_length = len;
+  return out;
+}
+
+void co_get_stats(coalescer *co, co_stats *st) {
+  co_shard *sh;
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  for (i = 0; i < CO_SHARDS; i++) {
+    sh = &co->shards[i];
+    pthread_mutex_lock(&sh->lock);
+    st->computed += sh->computed;
+    st->shared += sh->shared;
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+void co_destroy(coalescer *co) {
+  int i;
+
+  for (i = 0; i < CO_SHARDS; i++)
+    pthread_mutex_destroy(&co->shards[i].lock);
+  free(co);
+}
@@ -0,0 +1,45 @@
+/**
+ * coalesce.h
+ *
+ * Singleflight for process_request.  When a request arrives while
+ * an identical one is still being worked on, it doesn't start a
+ * second computation: it waits for the first to finish, and is
+ * answered with a copy of its response.  So a burst of the same
+ * request costs one munging, however many workers it lands on.
+ * Requests in flight are kept in shards by hash, each with its
+ * own lock, and are compared in full.
+ */
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+typedef struct coalescer_st coalescer;
+
+// works out a response, from bp_alloc, or returns NULL
+typedef char *(*co_compute)(char *request, int length, int *response_length);
+
+coalescer *co_create(void);
+
+/**
+ * co_run answers the "length" bytes at "request" with "compute",
+ * unless an identical request is already being answered, in which
+ * case it waits for that one and returns a copy of its response.
+ * Either way the response is from bp_alloc (see buf_pool.h), with
+ * its length in "*response_length"; NULL means the computation
+ * failed.  It is thread-safe, and compute must never itself wait
+ * on the coalescer.
+ */
+char *co_run(coalescer *co, char *request, int length, int *response_length,
+             co_compute compute);
+
+typedef struct co_stats_st {
+  unsigned long computed;       // requests that did the work
+  unsigned long shared;         // and that waited for another's
+} co_stats;
+
+void co_get_stats(coalescer *co, co_stats *st);
+
+// every co_run must have returned
+void co_destroy(coalescer *co);
+
+#endif
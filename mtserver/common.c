@@ -12,6 +12,7 @@
 #include <errno.h>
 
 #include "common.h"
+#include "buf_pool.h"
 
 /**
  * This function writes back a response over the socket
@@ -68,3 +69,153 @@ int correct_write(int s, char *data, int len)
   }
   return len;
 }
+
+/* big-endian integers, for frame headers and HELLOs */
+static void put16(char *p, unsigned int v)
+{
+  p[0] = (char) (v >> 8);
+  p[1] = (char) v;
+}
+
+static void put32(char *p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(p + 2, v & 0xffff);
+}
+
+static unsigned int get16(const char *p)
+{
+  return ((unsigned char) p[0] << 8) | (unsigned char) p[1];
+}
+
+static uint32_t get32(const char *p)
+{
+  return ((uint32_t) get16(p) << 16) | get16(p + 2);
+}
+
+/**
+ * These functions write a frame header into, and read one out of,
+ * the FRAME_HEADER bytes at "header".  They are thread safe.
+ */
+void frame_pack(char *header, int type, int flags, uint32_t length)
+{
+  header[0] = (char) type;
+  header[1] = (char) flags;
+  put16(header + 2, 0);
+  put32(header + 4, length);
+}
+
+void frame_unpack(const char *header, frame *f)
+{
+  f->type = (unsigned char) header[0];
+  f->flags = (unsigned char) header[1];
+  f->length = get32(header + 4);
+}
+
+/**
+ * This function finds the whole frames, at most "max" of them, at
+ * the start of the "len" bytes at "buf", and returns how many it
+ * found.  "*used" gets the bytes they span, and "*need" how many
+ * bytes from there the next frame takes, or -1 if its payload is
+ * over "max_frame" bytes.  This function is thread safe.
+ */
+int frame_scan(const char *buf, int len, int max, int max_frame,
+               int *used, int *need)
+{
+  frame f;
+  int n = 0, off = 0;
+
+  *need = FRAME_HEADER;
+  while (n < max && len - off >= FRAME_HEADER) {
+    frame_unpack(buf + off, &f);
+    if (f.length > (uint32_t) max_frame) {
+      *need = -1;
+      break;
+    }
+    if (len - off - FRAME_HEADER < (int) f.length) {
+      *need = FRAME_HEADER + (int) f.length;
+      break;
+    }
+    off += FRAME_HEADER + (int) f.length;
+    n++;
+  }
+  *used = off;
+  return n;
+}
+
+/**
+ * This function fills in "reply" as an ERROR saying "why", and
+ * returns its payload, from bp_alloc, or NULL if there is no
+ * memory for it.  This function is thread safe.
+ */
+char *frame_error(frame *reply, const char *why)
+{
+  int len = strlen(why);
+  char *msg = (char *) bp_alloc(len);
+
+  reply->type = FRAME_ERROR;
+  reply->flags = 0;
+  reply->length = len;
+  if (msg != NULL)
+    memcpy(msg, why, len);
+  return msg;
+}
+
+/**
+ * The client's HELLO offers the versions min_version..max_version;
+ * hello_choose returns the highest of them the server speaks too,
+ * or -1 if there is none.  These functions are thread safe.
+ */
+void hello_pack(char *payload, int min_version, int max_version)
+{
+  put16(payload, min_version);
+  put16(payload + 2, max_version);
+}
+
+int hello_choose(const char *payload)
+{
+  int lo = get16(payload), hi = get16(payload + 2);
+
+  if (hi > PROTO_MAX)
+    hi = PROTO_MAX;
+  if (lo < PROTO_MIN)
+    lo = PROTO_MIN;
+  return lo <= hi ? hi : -1;
+}
+
+/**
+ * The server's HELLO: the version it picked, and the largest
+ * payload it takes in a frame.  These functions are thread safe.
+ */
+void hello_reply_pack(char *payload, int version, uint32_t max_frame)
+{
+  put16(payload, version);
+  put32(payload + 2, max_frame);
+}
+
+void hello_reply_unpack(const char *payload, int *version, uint32_t *max_frame)
+{
+  *version = get16(payload);
+  *max_frame = get32(payload + 2);
+}
+
+/**
+ * A 64-bit hash of "len" bytes, a word at a time: the server keys
+ * its response cache and its in-flight requests with it, and it
+ * shouldn't cost more than the munging.  This function is thread
+ * safe.
+ */
+uint64_t hash_bytes(const char *p, int len)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) len, w;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  w = 0;
+  memcpy(&w, p, len);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 29);
+}
@@ -5,8 +5,70 @@
  * to both the client and server.
  */
 
-#define REQUEST_SIZE 10
-#define RESPONSE_SIZE 10
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <stdint.h>
+
+/**
+ * Everything on a connection is a frame: an 8-byte header and then
+ * "length" bytes of payload.
+ *
+ *   byte 0      type, FRAME_*
+ *   byte 1      flags, FRAME_MORE or 0
+ *   bytes 2-3   zero
+ *   bytes 4-7   length, big-endian
+ *
+ * The client opens with a HELLO whose payload is the lowest and
+ * highest protocol versions it speaks (16 bits each, big-endian).
+ * The server answers with a HELLO holding the version it picked
+ * (16 bits) and the largest payload it takes in a frame (32 bits),
+ * or with an ERROR, whose payload is a message, and hangs up; it
+ * hangs up after any ERROR.  After that, each REQUEST is answered
+ * by a RESPONSE, in order.  From version 2, a body may be streamed
+ * as a run of REQUESTs, all but the last flagged FRAME_MORE; each
+ * is processed as it arrives and answered with a RESPONSE flagged
+ * the same way.
+ */
+#define FRAME_HEADER 8
+
+#define FRAME_HELLO    1
+#define FRAME_REQUEST  2
+#define FRAME_RESPONSE 3
+#define FRAME_ERROR    4
+
+#define FRAME_MORE 0x01     // another chunk of this body follows
+
+#define PROTO_MIN 1
+#define PROTO_MAX 2
+#define PROTO_CHUNKED 2     // the first version with FRAME_MORE
+
+#define HELLO_SIZE 4        // the client's HELLO payload
+#define HELLO_REPLY_SIZE 6  // and the server's
+
+// every server takes frames this big, so a client may send them
+// before it has the server's HELLO
+#define FRAME_SMALL 4096
+
+typedef struct frame_st {
+  int type;
+  int flags;
+  uint32_t length;
+} frame;
+
+void frame_pack(char *header, int type, int flags, uint32_t length);
+void frame_unpack(const char *header, frame *f);
+int  frame_scan(const char *buf, int len, int max, int max_frame,
+                int *used, int *need);
+char *frame_error(frame *reply, const char *why);
+void hello_pack(char *payload, int min_version, int max_version);
+int  hello_choose(const char *payload);
+void hello_reply_pack(char *payload, int version, uint32_t max_frame);
+void hello_reply_unpack(const char *payload, int *version, uint32_t *max_frame);
+
+uint64_t hash_bytes(const char *p, int len);
 
 int correct_read(int s, char *data, int len);
 int correct_write(int s, char *data, int len);
+
+#endif
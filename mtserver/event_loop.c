@@ -0,0 +1,1137 @@
+/**
+ * event_loop.c
+ *
+ * A connection alternates READING -> PROCESSING -> WRITING ->
+ * READING until the client closes it or it idles out.  Clients
+ * may pipeline: every whole frame in the input buffer when one
+ * finishes arriving goes to the pool as one batch, is processed
+ * in order, and is answered with one write.  A connection keeps
+ * its input and output buffers, from the buffer pool, from one
+ * batch to the next; they grow to fit the frames going through
+ * them, up to the loop's max_frame, and shrink back between
+ * batches.
+ *
+ * Only the loop thread touches a connection, except while it is
+ * PROCESSING: then it belongs to the pool task, which pushes it
+ * onto the loop's "done" stack and writes the eventfd if the
+ * stack was empty.  The loop reads the eventfd before taking the
+ * whole stack, so a push it missed always leaves the eventfd
+ * readable.
+ *
+ * Connections are registered once, edge-triggered, so switching
+ * states costs no epoll_ctl; the price is that every return to
+ * READING tries a read, since an edge may have passed while the
+ * pool had the connection.
+ *
+ * Under io_uring the states are the same, but a connection has at
+ * most one operation in the ring, a recv while READING or a send
+ * while WRITING, and it is that operation's completion, not a
+ * readiness event, that moves it on.  A recv takes a provided
+ * buffer, whose bytes are copied into the input buffer and the
+ * buffer handed straight back, except while a frame too big for
+ * one is arriving: then it lands in the input buffer directly.  A
+ * send is MSG_WAITALL, so the kernel finishes it however many
+ * goes it takes, and the last one carries the close with it,
+ * which the kernel skips if the send fails; then we close the fd
+ * ourselves.  Since the kernel may still be reading into, or out
+ * of, a connection's buffers, one closed with an operation in
+ * flight has it cancelled and is freed only once it completes.
+ */
+
+#define _GNU_SOURCE     // for accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "event_loop.h"
+#include "buf_pool.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+#define EV_EVENTS   256   // epoll events taken per wait
+#define EV_ACCEPTS  64    // connections accepted per wakeup
+#define EV_PIPELINE 64    // frames answered in a batch
+#define EV_ROUNDS   4     // without a pool, batches a connection gets a turn
+#define EV_IN_MIN   1024  // a connection's input buffer, to start
+#define EV_IN_KEEP  65536 // the most either buffer keeps between batches
+#define EV_TICK_MS  10    // idle timer resolution
+#define EV_RING     1024  // io_uring SQEs
+#define EV_RBUFS    256   // provided buffers, for io_uring reads
+#define EV_RBUF_SIZE 4096 // and their size
+
+#define EV_READING    0
+#define EV_PROCESSING 1
+#define EV_WRITING    2
+#define EV_CLOSED     3     // waiting to be freed
+
+typedef struct ev_conn_st {
+  tw_timer idle;                // first: the wheel hands these back
+  long last_active;             // ms; the idle timer re-arms from here
+  int fd;
+  int state;                    // EV_*
+  int eof;                      // the client has sent all it will
+  int closing;                  // close once the batch is written
+  int failed;                   // the batch was dropped, or unanswered
+  int version;                  // the handler's, for this connection
+  int io;                       // io_uring: the EV_OP_*s in flight
+  int close_linked;             // a close is linked to the send
+  char *in;
+  int in_cap;
+  int rlen;                     // bytes in "in"
+  int nreq;                     // frames in the batch being processed
+  int used;                     // and the bytes they span
+  char *out;                    // the batch's responses, if any
+  int out_len;
+  int wlen;                     // bytes of "out" written so far
+  ev_loop *loop;
+  struct ev_conn_st *next;      // every open connection
+  struct ev_conn_st *prev;
+  struct ev_conn_st *next_done; // on the done stack, or dead list
+  int ready;                    // on the ready list
+  struct ev_conn_st *next_ready;
+} ev_conn;
+
+struct ev_loop_st {
+  int engine;                   // EV_EPOLL or EV_URING
+  int epfd;
+  int evfd;                     // the pool's wakeups
+  uring ring;                   // EV_URING only, down to "wakeups"
+  ur_bufs bufs;
+  int ops;                      // operations in the ring
+  int accepting;                // the multishot accept is armed
+  int waking;                   // and the eventfd read
+  uint64_t wakeups;             // the eventfd read lands here
+  int socket_listen;
+  int spare_fd;                 // given up to accept past EMFILE
+  threadpool tp;
+  ev_handler handler;
+  int idle_ms;                  // 0: never time out
+  int max_frame;
+  long now;                     // ms, as of this pass of the loop
+  long epoch;
+  timer_wheel wheel;            // idle timers, EV_TICK_MS a tick
+  ev_conn conns;                // list head
+  atomic_int nconns;
+  atomic_ulong served;          // requests answered
+  int processing;               // connections the pool has
+  int stopped;                  // ev_stop seen: no more dispatches
+  _Atomic(ev_conn *) done;      // finished by the pool
+  ev_conn *dead;                // closed, freed after this batch
+  ev_conn *ready;               // without a pool: turns to finish
+  atomic_int stopping;
+  pthread_mutex_t lock;         // ev_stop waits for "stopped"
+  pthread_cond_t quiet;
+};
+
+// epoll_event.data for the two fds that aren't connections, and
+// likewise an SQE's user_data
+#define EV_LISTEN ((void *) 1)
+#define EV_WAKEUP ((void *) 2)
+#define EV_OTHER  ((void *) 3)      // a close or cancel: only counted
+
+// a connection's operation is its address with one of these in
+// the low bits, which bp_alloc leaves clear
+#define EV_OP_RECV  1
+#define EV_OP_SEND  2
+#define EV_OP_CLOSE 4       // linked to a send
+#define EV_OP_MASK  7
+
+static long now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static unsigned long to_tick(ev_loop *loop, long ms) {
+  return (unsigned long) ((ms - loop->epoch + EV_TICK_MS - 1) / EV_TICK_MS);
+}
+
+static void wake(ev_loop *loop) {
+  uint64_t one = 1;
+
+  if (write(loop->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("(SERVER): eventfd write");
+}
+
+/* set up the ring, or return -1 to fall back to epoll */
+static int ur_setup(ev_loop *loop) {
+  if (ur_init(&loop->ring, EV_RING) < 0)
+    return -1;
+  // provided buffer rings came in 5.19, with multishot accept and
+  // everything else we use; the timeout on waiting, in 5.11
+  if (!(loop->ring.features & IORING_FEAT_EXT_ARG) ||
+      ur_bufs_init(&loop->ring, &loop->bufs, 0, EV_RBUFS, EV_RBUF_SIZE) < 0) {
+    ur_exit(&loop->ring);
+    return -1;
+  }
+  return 0;
+}
+
+ev_loop *ev_create(int socket_listen, threadpool tp, ev_handler handler,
+                   int idle_ms, int max_frame, int engine) {
+  ev_loop *loop = (ev_loop *) malloc(sizeof(ev_loop));
+  struct epoll_event ev;
+
+  if (loop == NULL)
+    return NULL;
+  loop->ring.fd = -1;
+  loop->bufs.ring = NULL;
+  loop->bufs.base = NULL;
+  loop->ops = loop->accepting = loop->waking = 0;
+  loop->engine = engine == EV_URING && ur_setup(loop) == 0 ? EV_URING : EV_EPOLL;
+  loop->socket_listen = socket_listen;
+  loop->tp = tp;
+  loop->handler = handler;
+  loop->idle_ms = idle_ms;
+  loop->max_frame = max_frame;
+  loop->now = loop->epoch = now_ms();
+  tw_init(&loop->wheel, 0);
+  loop->conns.next = loop->conns.prev = &loop->conns;
+  atomic_init(&loop->nconns, 0);
+  atomic_init(&loop->served, 0);
+  loop->processing = 0;
+  loop->stopped = 0;
+  atomic_init(&loop->done, NULL);
+  loop->dead = NULL;
+  loop->ready = NULL;
+  atomic_init(&loop->stopping, 0);
+  pthread_mutex_init(&loop->lock, NULL);
+  pthread_cond_init(&loop->quiet, NULL);
+  loop->spare_fd = open("/dev/null", O_RDONLY);
+  loop->epfd = -1;
+  fcntl(socket_listen, F_SETFL, fcntl(socket_listen, F_GETFL) | O_NONBLOCK);
+  if (loop->engine == EV_URING) {
+    // the ring reads the eventfd, and would get EAGAIN, not wait,
+    // from a non-blocking one
+    if ((loop->evfd = eventfd(0, EFD_CLOEXEC)) < 0)
+      goto fail;
+    return loop;
+  }
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->epfd < 0 || loop->evfd < 0)
+    goto fail;
+
+  // EPOLLEXCLUSIVE: a connection wakes one of the loops sharing
+  // the socket, not all of them
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = EV_LISTEN;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, socket_listen, &ev) < 0)
+    goto fail;
+  ev.events = EPOLLIN;
+  ev.data.ptr = EV_WAKEUP;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) < 0)
+    goto fail;
+  return loop;
+
+ fail:
+  perror("(SERVER): ev_create");
+  ev_destroy(loop);
+  return NULL;
+}
+
+static void ur_close(ev_conn *c);
+
+/**
+ * Close "c".  It is freed only once the current batch of epoll
+ * events is done, since a later event in the batch may name it,
+ * or under io_uring, once the operation it has in flight is.
+ */
+static void conn_close(ev_conn *c) {
+  ev_loop *loop = c->loop;
+
+  if (loop->engine == EV_URING)
+    ur_close(c);
+  else
+    close(c->fd);     // takes it out of the epoll set too
+  tw_del(&loop->wheel, &c->idle);
+  c->prev->next = c->next;
+  c->next->prev = c->prev;
+  atomic_fetch_sub(&loop->nconns, 1);
+  c->state = EV_CLOSED;
+  if (c->io == 0) {
+    c->next_done = loop->dead;
+    loop->dead = c;
+  }
+}
+
+static void free_dead(ev_loop *loop) {
+  ev_conn *c;
+
+  while ((c = loop->dead) != NULL) {
+    loop->dead = c->next_done;
+    bp_free(c->in);
+    bp_free(c->out);
+    bp_free(c);
+  }
+}
+
+/* add a reply to c->out; returns -1, with c->out gone, if it can't */
+static int add_reply(ev_conn *c, int *cap, frame *reply, char *payload) {
+  int len = FRAME_HEADER + reply->length;
+  char *out;
+
+  if (c->out_len + len > *cap) {
+    *cap = (c->out_len + len) * 2;
+    if ((out = (char *) bp_grow(c->out, c->out_len, *cap)) == NULL) {
+      bp_free(payload);
+      bp_free(c->out);
+      c->out = NULL;
+      return -1;
+    }
+    c->out = out;
+    *cap = bp_size(out);
+  }
+  frame_pack(c->out + c->out_len, reply->type, reply->flags, reply->length);
+  memcpy(c->out + c->out_len + FRAME_HEADER, payload, reply->length);
+  c->out_len += len;
+  bp_free(payload);
+  return 0;
+}
+
+/**
+ * Answer the batch's c->nreq frames, in order, into c->out.  An
+ * empty batch means the next frame is over max_frame.  Returns -1
+ * if the batch can't be answered, and the connection must close.
+ */
+static int run_batch(ev_conn *c) {
+  frame f, reply;
+  char *payload, *out, *p = c->in;
+  int i, cap = c->used + FRAME_HEADER + 64;
+
+  // the last batch's buffer will usually do
+  c->out_len = 0;
+  if ((out = (char *) bp_grow(c->out, 0, cap)) == NULL) {
+    bp_free(c->out);
+    c->out = NULL;
+    return -1;
+  }
+  c->out = out;
+  cap = bp_size(out);
+  if (c->nreq == 0) {
+    c->closing = 1;
+    if ((payload = frame_error(&reply, "frame too large")) == NULL)
+      return -1;
+    return add_reply(c, &cap, &reply, payload);
+  }
+  for (i = 0; i < c->nreq && !c->closing; i++) {
+    frame_unpack(p, &f);
+    payload = (c->loop->handler) (&c->version, &f, p + FRAME_HEADER, &reply);
+    p += FRAME_HEADER + f.length;
+    // no answer breaks the stream for every request behind it
+    if (payload == NULL || add_reply(c, &cap, &reply, payload) < 0)
+      break;
+    c->closing = reply.type == FRAME_ERROR;
+  }
+  atomic_fetch_add_explicit(&c->loop->served, i, memory_order_relaxed);
+  return i < c->nreq && !c->closing ? -1 : 0;
+}
+
+/* push "c" onto its loop's done stack, for the loop to respond */
+static void hand_back(ev_conn *c) {
+  ev_loop *loop = c->loop;
+  ev_conn *head = atomic_load(&loop->done);
+
+  do {
+    c->next_done = head;
+  } while (!atomic_compare_exchange_weak(&loop->done, &head, c));
+  if (head == NULL)
+    wake(loop);
+}
+
+/* runs on a worker: answer the batch and hand it back */
+static void ev_process(void *arg) {
+  ev_conn *c = (ev_conn *) arg;
+
+  c->failed = run_batch(c) < 0;
+  hand_back(c);
+}
+
+void ev_drop(void *arg) {
+  ev_conn *c = (ev_conn *) arg;
+
+  // c->out may still hold the last batch's responses: only this
+  // says there is nothing to send
+  c->failed = 1;
+  hand_back(c);
+}
+
+/* write what we can; returns 1 once the output is all out */
+static int conn_write(ev_conn *c) {
+  int ret;
+
+  while (c->wlen < c->out_len) {
+    ret = send(c->fd, c->out + c->wlen, c->out_len - c->wlen, MSG_NOSIGNAL);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return ret < 0 && errno == EAGAIN ? 0 : -1;
+    c->wlen += ret;
+    c->last_active = c->loop->now;
+  }
+  return 1;
+}
+
+/**
+ * The batch's responses are all out: drop it and get ready for the
+ * next one.  Returns 0 if that closed the connection instead.
+ */
+static int batch_done(ev_conn *c) {
+  char *in;
+
+  c->out_len = 0;
+  c->rlen -= c->used;
+  memmove(c->in, c->in + c->used, c->rlen);
+  if (c->closing || c->loop->stopped) {
+    conn_close(c);
+    return 0;
+  }
+  // big frames have gone: give back their room
+  if (bp_size(c->out) > EV_IN_KEEP) {
+    bp_free(c->out);
+    c->out = NULL;
+  }
+  if (c->in_cap > EV_IN_KEEP && c->rlen <= EV_IN_MIN &&
+      (in = (char *) bp_alloc(EV_IN_MIN)) != NULL) {
+    memcpy(in, c->in, c->rlen);
+    bp_free(c->in);
+    c->in = in;
+    c->in_cap = bp_size(in);
+  }
+  c->state = EV_READING;
+  return 1;
+}
+
+/* hand the batch to the pool */
+static void conn_dispatch(ev_conn *c) {
+  ev_loop *loop = c->loop;
+
+  c->state = EV_PROCESSING;
+  loop->processing++;
+  if (dispatch(loop->tp, ev_process, c) != TP_OK) {
+    // the pool won't take it: treat it as dropped
+    loop->processing--;
+    conn_close(c);
+  }
+}
+
+/**
+ * Without a pool, a connection that is still sending when its turn
+ * runs out finishes it once every other has had one.  Its edge has
+ * been and gone, so it goes on the ready list rather than waiting
+ * for epoll.
+ */
+static void conn_later(ev_conn *c) {
+  ev_loop *loop = c->loop;
+
+  if (c->ready)
+    return;
+  c->ready = 1;
+  c->next_ready = loop->ready;
+  loop->ready = c;
+}
+
+/**
+ * Read what has arrived, and once at least one whole frame has,
+ * hand every whole frame buffered to the pool.  Returns with the
+ * connection PROCESSING, still READING, or closed.  Without a pool
+ * the batch is answered here, and this goes round again, for up
+ * to EV_ROUNDS batches, as long as the client keeps up.
+ */
+static void conn_read(ev_conn *c) {
+  ev_loop *loop = c->loop;
+  int ret, need, rounds = 0;
+  char *in;
+
+ again:
+  while (!c->eof && c->rlen < c->in_cap) {
+    ret = read(c->fd, c->in + c->rlen, c->in_cap - c->rlen);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0 && errno == EAGAIN)
+      break;
+    if (ret < 0)
+      c->rlen = 0;    // reset: drop whatever was half read
+    if (ret <= 0) {
+      c->eof = 1;
+      break;
+    }
+    c->rlen += ret;
+    c->last_active = loop->now;
+  }
+
+  c->nreq = frame_scan(c->in, c->rlen, EV_PIPELINE, loop->max_frame,
+                       &c->used, &need);
+  if (c->nreq == 0 && need > 0) {
+    if (c->eof) {
+      conn_close(c);   // gone, with no whole frame left to answer
+      return;
+    }
+    if (need <= c->in_cap)
+      return;          // the rest is on its way
+    // the frame arriving is bigger than the buffer: make room, and
+    // read on into it
+    if ((in = (char *) bp_grow(c->in, c->rlen, need)) == NULL) {
+      conn_close(c);
+      return;
+    }
+    c->in = in;
+    c->in_cap = bp_size(in);
+    goto again;
+  }
+
+  if (loop->tp == NULL) {
+    c->state = EV_WRITING;
+    c->wlen = 0;
+    if (run_batch(c) < 0 || (ret = conn_write(c)) < 0)
+      conn_close(c);
+    else if (ret > 0 && batch_done(c) && ++rounds < EV_ROUNDS)
+      goto again;
+    else if (c->state == EV_READING)
+      conn_later(c);
+    return;
+  }
+
+  conn_dispatch(c);
+}
+
+/**
+ * Send what is left of the batch's responses.  Once they are all
+ * out, drop the batch and go back to reading the next one.
+ */
+static void conn_flush(ev_conn *c) {
+  int ret;
+
+  if ((ret = conn_write(c)) < 0) {
+    conn_close(c);
+    return;
+  }
+  if (ret == 0)
+    return;         // the socket buffer is full: EPOLLOUT finishes it
+  if (batch_done(c))
+    conn_read(c);
+}
+
+static void ur_send(ev_conn *c);
+
+/* the pool is done with "c": send the batch's responses */
+static void conn_respond(ev_conn *c) {
+  c->loop->processing--;
+  if (c->failed) {
+    conn_close(c);    // dropped, or the handler failed
+    return;
+  }
+  c->state = EV_WRITING;
+  c->wlen = 0;
+  if (c->loop->engine == EV_URING)
+    ur_send(c);
+  else
+    conn_flush(c);
+}
+
+/* take "fd" on as a new connection; NULL, with it closed, if we can't */
+static ev_conn *conn_new(ev_loop *loop, int fd) {
+  ev_conn *c;
+
+  if ((c = (ev_conn *) bp_alloc(sizeof(ev_conn))) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  if ((c->in = (char *) bp_alloc(EV_IN_MIN)) == NULL) {
+    bp_free(c);
+    close(fd);
+    return NULL;
+  }
+  c->in_cap = bp_size(c->in);
+  c->fd = fd;
+  c->state = EV_READING;
+  c->eof = c->closing = c->failed = c->version = 0;
+  c->io = c->close_linked = c->ready = 0;
+  c->rlen = c->wlen = c->nreq = c->used = 0;
+  c->out = NULL;
+  c->out_len = 0;
+  c->loop = loop;
+  c->next = loop->conns.next;
+  c->prev = &loop->conns;
+  c->next->prev = c;
+  loop->conns.next = c;
+  atomic_fetch_add(&loop->nconns, 1);
+  c->last_active = loop->now;
+  c->idle.prev = NULL;
+  if (loop->idle_ms > 0) {
+    c->idle.expires = to_tick(loop, loop->now + loop->idle_ms);
+    tw_add(&loop->wheel, &c->idle);
+  }
+  return c;
+}
+
+/* out of fds: accept and close one, or it stays readable and we
+   spin; the client sees the connection reset */
+static void shed_accept(ev_loop *loop) {
+  int fd;
+
+  close(loop->spare_fd);
+  fd = accept(loop->socket_listen, NULL, NULL);
+  if (fd >= 0)
+    close(fd);
+  loop->spare_fd = open("/dev/null", O_RDONLY);
+}
+
+static void conn_accept(ev_loop *loop) {
+  struct epoll_event ev;
+  ev_conn *c;
+  int fd, i;
+
+  for (i = 0; i < EV_ACCEPTS; i++) {
+    fd = accept4(loop->socket_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if ((errno == EMFILE || errno == ENFILE) && loop->spare_fd >= 0) {
+        shed_accept(loop);
+        continue;
+      }
+      return;   // EAGAIN: taken by another loop, or none left
+    }
+    if ((c = conn_new(loop, fd)) == NULL)
+      continue;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      conn_close(c);
+  }
+}
+
+/**
+ * Close connections that have been quiet for idle_ms.  Activity
+ * doesn't touch the wheel: a timer that fires early is re-armed
+ * from last_active, and one whose connection the pool has is
+ * given another full period.
+ */
+static void expire_idle(ev_loop *loop) {
+  tw_timer *t, *next;
+  ev_conn *c;
+  long deadline;
+
+  for (t = tw_advance(&loop->wheel, to_tick(loop, loop->now)); t != NULL; t = next) {
+    next = t->next;
+    c = (ev_conn *) t;
+    deadline = (c->state == EV_PROCESSING ? loop->now : c->last_active) + loop->idle_ms;
+    if (deadline > loop->now) {
+      c->idle.expires = to_tick(loop, deadline);
+      tw_add(&loop->wheel, &c->idle);
+    } else {
+      conn_close(c);
+    }
+  }
+}
+
+/* mark the loop done with the pool, and tell ev_stop so */
+static void set_stopped(ev_loop *loop) {
+  pthread_mutex_lock(&loop->lock);
+  loop->stopped = 1;
+  pthread_cond_broadcast(&loop->quiet);
+  pthread_mutex_unlock(&loop->lock);
+}
+
+/* ms until the next idle timer is due, or -1: none is */
+static long next_timeout(ev_loop *loop) {
+  long timeout;
+
+  if (loop->wheel.count == 0)
+    return -1;
+  timeout = (long) tw_next_tick(&loop->wheel) * EV_TICK_MS + loop->epoch - loop->now;
+  return timeout < 0 ? 0 : timeout;
+}
+
+/* give the connections whose turn ran out another */
+static void take_ready(ev_loop *loop) {
+  ev_conn *c, *ready = loop->ready;
+
+  // a connection that runs out again waits for the next pass
+  loop->ready = NULL;
+  while ((c = ready) != NULL) {
+    ready = c->next_ready;
+    c->ready = 0;
+    if (c->state == EV_READING)
+      conn_read(c);
+  }
+}
+
+/* send every connection the pool has finished with its responses */
+static void take_done(ev_loop *loop) {
+  ev_conn *c, *done;
+
+  done = atomic_exchange(&loop->done, NULL);
+  while ((c = done) != NULL) {
+    done = c->next_done;
+    conn_respond(c);
+  }
+}
+
+/* queue an operation that only has to be counted */
+static struct io_uring_sqe *ur_other(ev_loop *loop, int opcode) {
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ur_sqe(&loop->ring)) == NULL)
+    return NULL;
+  sqe->opcode = opcode;
+  sqe->user_data = (uintptr_t) EV_OTHER;
+  loop->ops++;
+  return sqe;
+}
+
+/* cancel the operation whose user_data is "data" */
+static int ur_cancel(ev_loop *loop, uint64_t data) {
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ur_other(loop, IORING_OP_ASYNC_CANCEL)) == NULL)
+    return -1;
+  sqe->fd = -1;
+  sqe->addr = data;
+  return 0;
+}
+
+static void ur_close(ev_conn *c) {
+  ev_loop *loop = c->loop;
+  struct io_uring_sqe *sqe;
+
+  // the op in flight holds the socket open until it completes
+  if ((c->io & (EV_OP_RECV | EV_OP_SEND)) &&
+      ur_cancel(loop, (uintptr_t) c | (c->io & (EV_OP_RECV | EV_OP_SEND))) < 0)
+    shutdown(c->fd, SHUT_RDWR);   // no room to cancel: this ends it as surely
+  if (c->close_linked)
+    return;                       // the send's close sees to it
+  if ((sqe = ur_other(loop, IORING_OP_CLOSE)) != NULL)
+    sqe->fd = c->fd;
+  else
+    close(c->fd);
+}
+
+/**
+ * Queue a recv: into a provided buffer, or when what is still to
+ * come of the frame arriving wouldn't fit in one, straight into
+ * the input buffer.
+ */
+static void ur_recv(ev_conn *c) {
+  ev_loop *loop = c->loop;
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ur_sqe(&loop->ring)) == NULL) {
+    conn_close(c);
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  if (c->in_cap - c->rlen > EV_RBUF_SIZE) {
+    sqe->addr = (uintptr_t) (c->in + c->rlen);
+    sqe->len = c->in_cap - c->rlen;
+  } else {
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = loop->bufs.bgid;
+  }
+  sqe->user_data = (uintptr_t) c | EV_OP_RECV;
+  c->io |= EV_OP_RECV;
+  loop->ops++;
+}
+
+/**
+ * conn_read's counterpart: the frames are in c->in, so hand every
+ * whole one to the pool, or answer them here, or else wait for the
+ * rest.
+ */
+static void ur_read(ev_conn *c) {
+  ev_loop *loop = c->loop;
+  int need;
+  char *in;
+
+  c->nreq = frame_scan(c->in, c->rlen, EV_PIPELINE, loop->max_frame,
+                       &c->used, &need);
+  if (c->nreq == 0 && need > 0) {
+    if (c->eof) {
+      conn_close(c);
+      return;
+    }
+    if (need > c->in_cap) {
+      if ((in = (char *) bp_grow(c->in, c->rlen, need)) == NULL) {
+        conn_close(c);
+        return;
+      }
+      c->in = in;
+      c->in_cap = bp_size(in);
+    }
+    ur_recv(c);
+    return;
+  }
+
+  if (loop->tp != NULL) {
+    conn_dispatch(c);
+    return;
+  }
+  if (run_batch(c) < 0) {
+    conn_close(c);
+    return;
+  }
+  c->state = EV_WRITING;
+  c->wlen = 0;
+  ur_send(c);
+}
+
+/* a recv is done: take what it brought, if anything */
+static void ur_received(ev_conn *c, struct io_uring_cqe *cqe) {
+  ev_loop *loop = c->loop;
+  int res = cqe->res, bid;
+  char *in;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (res > 0 && c->rlen + res > c->in_cap) {
+      if ((in = (char *) bp_grow(c->in, c->rlen, c->rlen + res)) == NULL) {
+        ur_buf_put(&loop->bufs, bid);
+        conn_close(c);
+        return;
+      }
+      c->in = in;
+      c->in_cap = bp_size(in);
+    }
+    if (res > 0)
+      memcpy(c->in + c->rlen, ur_buf(&loop->bufs, bid), res);
+    ur_buf_put(&loop->bufs, bid);
+  }
+
+  if (res == -ENOBUFS) {
+    // more reads finished at once than there are buffers; they
+    // are back now
+    ur_recv(c);
+    return;
+  }
+  if (res > 0) {
+    c->rlen += res;
+    c->last_active = loop->now;
+  } else {
+    if (res < 0)
+      c->rlen = 0;    // reset: drop whatever was half read
+    c->eof = 1;
+  }
+  ur_read(c);
+}
+
+/**
+ * Queue the batch's responses, and if it is the last batch, the
+ * close linked behind them, to happen only if they all went.
+ */
+static void ur_send(ev_conn *c) {
+  ev_loop *loop = c->loop;
+  struct io_uring_sqe *sqe, *close_sqe;
+  int last = c->closing || loop->stopped;
+
+  // the two must go to the kernel together
+  if (last && ur_room(&loop->ring) < 2)
+    ur_submit(&loop->ring);
+  if ((sqe = ur_sqe(&loop->ring)) == NULL) {
+    conn_close(c);
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->fd;
+  sqe->addr = (uintptr_t) c->out;
+  sqe->len = c->out_len;
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+  sqe->user_data = (uintptr_t) c | EV_OP_SEND;
+  c->io |= EV_OP_SEND;
+  loop->ops++;
+  if (last && (close_sqe = ur_sqe(&loop->ring)) != NULL) {
+    sqe->flags = IOSQE_IO_LINK;
+    close_sqe->opcode = IORING_OP_CLOSE;
+    close_sqe->fd = c->fd;
+    close_sqe->user_data = (uintptr_t) c | EV_OP_CLOSE;
+    c->io |= EV_OP_CLOSE;
+    c->close_linked = 1;
+    loop->ops++;
+  }
+}
+
+/* a send is done: on to the next batch, if there is one */
+static void ur_sent(ev_conn *c, int res) {
+  if (res < c->out_len) {
+    conn_close(c);
+    return;
+  }
+  c->wlen = res;
+  c->last_active = c->loop->now;
+  if (batch_done(c))
+    ur_read(c);
+}
+
+/* one multishot accept stands for every accept4 */
+static void ur_accept(ev_loop *loop) {
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ur_sqe(&loop->ring)) == NULL)
+    return;         // tried again after the next completion
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = loop->socket_listen;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = (uintptr_t) EV_LISTEN;
+  loop->accepting = 1;
+  loop->ops++;
+}
+
+static void ur_accepted(ev_loop *loop, struct io_uring_cqe *cqe) {
+  ev_conn *c;
+
+  // until it says otherwise, the accept stays armed
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    loop->accepting = 0;
+    loop->ops--;
+  }
+  if (cqe->res >= 0) {
+    if (loop->stopped)
+      close(cqe->res);
+    else if ((c = conn_new(loop, cqe->res)) != NULL)
+      ur_recv(c);
+  } else if ((cqe->res == -EMFILE || cqe->res == -ENFILE) && loop->spare_fd >= 0) {
+    shed_accept(loop);
+  }
+}
+
+/* wait for the pool to write the eventfd */
+static void ur_wakeup(ev_loop *loop) {
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = ur_sqe(&loop->ring)) == NULL)
+    return;         // tried again after the next completion
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = loop->evfd;
+  sqe->addr = (uintptr_t) &loop->wakeups;
+  sqe->len = sizeof(loop->wakeups);
+  sqe->user_data = (uintptr_t) EV_WAKEUP;
+  loop->waking = 1;
+  loop->ops++;
+}
+
+static void ur_complete(ev_loop *loop, struct io_uring_cqe *cqe) {
+  void *data = (void *) (uintptr_t) cqe->user_data;
+  ev_conn *c;
+  int op;
+
+  if (data == EV_LISTEN) {
+    ur_accepted(loop, cqe);
+  } else if (data == EV_WAKEUP) {
+    loop->waking = 0;
+    loop->ops--;
+    take_done(loop);
+  } else if (data == EV_OTHER) {
+    loop->ops--;
+  } else {
+    loop->ops--;
+    c = (ev_conn *) ((uintptr_t) data & ~(uintptr_t) EV_OP_MASK);
+    op = (int) ((uintptr_t) data & EV_OP_MASK);
+    c->io &= ~op;
+    if (op == EV_OP_CLOSE && cqe->res < 0)
+      close(c->fd);     // the send failed, and took its close with it
+    if (op == EV_OP_CLOSE || c->state == EV_CLOSED) {
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+        ur_buf_put(&loop->bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+      // a close may have been waiting for this
+      if (c->state == EV_CLOSED && c->io == 0) {
+        c->next_done = loop->dead;
+        loop->dead = c;
+      }
+    } else if (op == EV_OP_RECV) {
+      ur_received(c, cqe);
+    } else {
+      ur_sent(c, cqe->res);
+    }
+  }
+}
+
+/* take every completion there is */
+static void ur_reap(ev_loop *loop) {
+  struct io_uring_cqe *cqe;
+
+  while ((cqe = ur_peek(&loop->ring)) != NULL) {
+    ur_complete(loop, cqe);
+    ur_seen(&loop->ring);
+  }
+}
+
+/* stop accepting and close everything not waiting on the pool */
+static void quiesce(ev_loop *loop) {
+  ev_conn *c, *next;
+
+  set_stopped(loop);
+  if (loop->engine == EV_URING) {
+    if (loop->accepting)
+      ur_cancel(loop, (uintptr_t) EV_LISTEN);
+  } else {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->socket_listen, NULL);
+  }
+  for (c = loop->conns.next; c != &loop->conns; c = next) {
+    next = c->next;
+    if (c->state != EV_PROCESSING)
+      conn_close(c);
+  }
+}
+
+/**
+ * ev_run under io_uring: each pass hands the kernel everything the
+ * last one queued and waits for completions in one io_uring_enter.
+ * On the way out, it cancels what is left and waits for the ring
+ * to empty, so nothing still lands in memory about to be freed.
+ */
+static void ur_run(ev_loop *loop) {
+  if (ur_enable(&loop->ring) < 0) {
+    perror("(SERVER): io_uring enable");
+    set_stopped(loop);
+    return;
+  }
+  while (!loop->stopped || loop->processing > 0) {
+    if (!loop->accepting && !loop->stopped)
+      ur_accept(loop);
+    if (!loop->waking)
+      ur_wakeup(loop);
+    if (ur_enter(&loop->ring, next_timeout(loop)) < 0 &&
+        errno != EINTR && errno != ETIME && errno != EBUSY) {
+      perror("(SERVER): io_uring_enter");
+      break;
+    }
+    loop->now = now_ms();
+    ur_reap(loop);
+    if (loop->idle_ms > 0)
+      expire_idle(loop);
+    if (!loop->stopped && atomic_load(&loop->stopping))
+      quiesce(loop);
+    free_dead(loop);
+  }
+
+  set_stopped(loop);
+  while (loop->conns.next != &loop->conns)
+    conn_close(loop->conns.next);
+  if (loop->accepting)
+    ur_cancel(loop, (uintptr_t) EV_LISTEN);
+  if (loop->waking)
+    ur_cancel(loop, (uintptr_t) EV_WAKEUP);
+  while (loop->ops > 0) {
+    if (ur_enter(&loop->ring, -1) < 0 && errno != EINTR && errno != EBUSY) {
+      perror("(SERVER): io_uring_enter");
+      break;
+    }
+    ur_reap(loop);
+  }
+  free_dead(loop);
+}
+
+void *ev_run(void *arg) {
+  ev_loop *loop = (ev_loop *) arg;
+  struct epoll_event events[EV_EVENTS];
+  uint64_t count;
+  ev_conn *c;
+  long timeout;
+  int i, n;
+
+  if (loop->engine == EV_URING) {
+    ur_run(loop);
+    return NULL;
+  }
+
+  while (!loop->stopped || loop->processing > 0) {
+    // connections with a turn to finish only want to hear what
+    // else is ready
+    timeout = loop->ready != NULL ? 0 : next_timeout(loop);
+    n = epoll_wait(loop->epfd, events, EV_EVENTS, (int) timeout);
+    loop->now = now_ms();
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("(SERVER): epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == EV_LISTEN) {
+        conn_accept(loop);
+      } else if (events[i].data.ptr == EV_WAKEUP) {
+        if (read(loop->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+          perror("(SERVER): eventfd read");
+        take_done(loop);
+      } else {
+        // while PROCESSING, an edge is picked up by the read that
+        // follows the response; EPOLLOUT alone means nothing to a
+        // reader, and is reported as sends are acknowledged
+        c = (ev_conn *) events[i].data.ptr;
+        if (c->state == EV_READING &&
+            (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+          conn_read(c);
+        else if (c->state == EV_WRITING)
+          conn_flush(c);
+      }
+    }
+
+    if (loop->idle_ms > 0)
+      expire_idle(loop);
+    if (!loop->stopped && atomic_load(&loop->stopping))
+      quiesce(loop);
+    // before free_dead: the list may name connections closed since
+    take_ready(loop);
+    free_dead(loop);
+  }
+
+  // nothing is left with the pool; give up on unfinished writes
+  while (loop->conns.next != &loop->conns)
+    conn_close(loop->conns.next);
+  free_dead(loop);
+  set_stopped(loop);   // in case we got here on an error
+  return NULL;
+}
+
+void ev_stop(ev_loop *loop) {
+  atomic_store(&loop->stopping, 1);
+  wake(loop);
+  // once the loop has seen it, it won't touch the pool again
+  pthread_mutex_lock(&loop->lock);
+  while (!loop->stopped)
+    pthread_cond_wait(&loop->quiet, &loop->lock);
+  pthread_mutex_unlock(&loop->lock);
+}
+
+int ev_connections(ev_loop *loop) {
+  return atomic_load(&loop->nconns);
+}
+
+unsigned long ev_requests(ev_loop *loop) {
+  return atomic_load_explicit(&loop->served, memory_order_relaxed);
+}
+
+int ev_engine(ev_loop *loop) {
+  return loop->engine;
+}
+
+void ev_destroy(ev_loop *loop) {
+  if (loop->ring.fd >= 0)
+    ur_exit(&loop->ring);
+  ur_bufs_free(&loop->bufs);
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  if (loop->evfd >= 0)
+    close(loop->evfd);
+  if (loop->spare_fd >= 0)
+    close(loop->spare_fd);
+  pthread_mutex_destroy(&loop->lock);
+  pthread_cond_destroy(&loop->quiet);
+  free(loop);
+}
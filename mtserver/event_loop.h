@@ -0,0 +1,91 @@
+/**
+ * event_loop.h
+ *
+ * An epoll front end for the server.  One thread owns the
+ * listening socket and every connection, all non-blocking, and
+ * walks each connection through reading requests, waiting for
+ * the threadpool to process them, and writing the responses.
+ * Only whole frames reach the pool, and a worker hands its
+ * result back through an eventfd, so a slow client costs a
+ * buffer rather than a worker.  Connections are persistent and
+ * may pipeline requests.
+ *
+ * A loop may instead be driven by io_uring (see uring.h): one
+ * multishot accept stands in for accept4 on every connection,
+ * reads land in a ring of provided buffers, a last response is
+ * sent with the close linked behind it, and everything a pass of
+ * the loop queues goes to the kernel, and everything that has
+ * finished comes back, in the one system call that waits.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "common.h"
+#include "threadpool.h"
+
+/**
+ * Answers the frame "f", whose payload is at "payload", on a
+ * connection speaking protocol "*version" (0 to start with; the
+ * handler keeps it).  It fills in "reply" and returns the reply's
+ * payload, from bp_alloc (see buf_pool.h), or NULL to close the
+ * connection without one.  An ERROR reply closes it once it is
+ * sent.
+ */
+typedef char *(*ev_handler)(int *version, frame *f, char *payload,
+                            frame *reply);
+
+typedef struct ev_loop_st ev_loop;
+
+// what drives a loop
+#define EV_EPOLL 0
+#define EV_URING 1
+
+/**
+ * ev_create sets up a loop that accepts on "socket_listen" (which
+ * it makes non-blocking; several loops may share it) and runs
+ * "handler" on "tp", or on the loop thread itself if tp is NULL,
+ * which then shares nothing with other loops.  A connection that
+ * sends nothing for idle_ms (0: no limit) while not waiting on the
+ * pool is closed, and so is one that sends a frame with more than
+ * max_frame bytes of payload, after an ERROR.  The pool's on_drop
+ * must be ev_drop.  "engine" is EV_EPOLL or EV_URING; a kernel
+ * without what EV_URING needs (5.19 or later, and io_uring not
+ * turned off) gets EV_EPOLL instead, and ev_engine says which the
+ * loop has.  Returns NULL on failure.
+ */
+ev_loop *ev_create(int socket_listen, threadpool tp, ev_handler handler,
+                   int idle_ms, int max_frame, int engine);
+
+/**
+ * ev_run is the loop itself, shaped as a thread start routine.
+ * It returns NULL once ev_stop has been called and no request it
+ * handed to the pool is still outstanding.
+ */
+void *ev_run(void *loop);
+
+/**
+ * ev_stop makes the loop stop accepting and close connections
+ * that are not waiting on the pool, and returns once the loop
+ * will dispatch nothing more; it may be called from any thread.
+ * Follow it with threadpool_shutdown, so the outstanding requests
+ * finish or are dropped, then join ev_run's thread.
+ */
+void ev_stop(ev_loop *loop);
+
+/* ev_drop is the on_drop for a pool behind event loops */
+void ev_drop(void *conn);
+
+/**
+ * ev_connections returns how many connections the loop has open,
+ * and ev_requests how many requests it has answered.
+ */
+int ev_connections(ev_loop *loop);
+unsigned long ev_requests(ev_loop *loop);
+
+int ev_engine(ev_loop *loop);
+
+/* ev_destroy frees a loop whose ev_run has returned */
+void ev_destroy(ev_loop *loop);
+
+#endif
@@ -44,3 +44,50 @@ slisten (servicename)
     }
     return s;
 }
+
+/*
+ * slisten_reuseport -- like slisten, but with SO_REUSEPORT set, so
+ * several sockets can listen on the same port; the kernel spreads
+ * incoming connections across them.  The backlog is SOMAXCONN.
+ */
+int
+slisten_reuseport (servicename)
+    char   *servicename;
+{
+    struct sockaddr_in inaddr;
+    int     s;
+    int     protonum;
+    int     one = 1;
+
+    sclrerr ();
+    if ((protonum = protonumber ("tcp")) < 0)
+	return -1;
+    if ((s = socket (PF_INET, SOCK_STREAM, protonum)) < 0)
+    {
+	serrno = SE_SYSERR;
+	sename = "socket";
+	return -1;
+    }
+    if (setsockopt (s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one)) < 0 ||
+	setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0)
+    {
+	serrno = SE_SYSERR;
+	sename = "setsockopt";
+	return -1;
+    }
+    if (make_inetaddr ((char *) 0, servicename, &inaddr) < 0)
+	return -1;
+    if (bind (s, (struct sockaddr *)&inaddr, sizeof (inaddr)) < 0)
+    {
+	serrno = SE_SYSERR;
+	sename = "bind";
+	return -1;
+    }
+    if (listen (s, SOMAXCONN) < 0)
+    {
+	serrno = SE_SYSERR;
+	sename = "listen";
+	return -1;
+    }
+    return s;
+}
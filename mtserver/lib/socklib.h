@@ -5,6 +5,7 @@
 extern int saccept ();
 extern int sconnect ();
 extern int slisten ();
+extern int slisten_reuseport ();
 extern int sportnum ();
 
 extern char *serror ();
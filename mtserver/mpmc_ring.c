@@ -0,0 +1,122 @@
+/**
+ * mpmc_ring.c
+ *
+ * Sequence-numbered bounded MPMC queue.  Slot i starts with
+ * seq == i.  A producer that claims position "pos" waits for
+ * seq == pos, fills the slot, and publishes seq = pos + 1.  A
+ * consumer claiming "pos" waits for seq == pos + 1, empties the
+ * slot, and hands it back to the next lap with seq = pos + size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mpmc_ring.h"
+
+mpmc_ring *ring_create(unsigned long capacity) {
+  mpmc_ring *ring;
+  unsigned long size = 2, i;
+
+  while (size < capacity)
+    size <<= 1;
+
+  if (posix_memalign((void **) &ring, RING_CACHE_LINE, sizeof(mpmc_ring))) {
+    fprintf(stderr, "Cant create ring\n");
+    return NULL;
+  }
+  if (posix_memalign((void **) &ring->slots, RING_CACHE_LINE,
+                     size * sizeof(ring_slot))) {
+    fprintf(stderr, "Cant create ring\n");
+    free(ring);
+    return NULL;
+  }
+
+  for (i = 0; i < size; i++) {
+    atomic_init(&ring->slots[i].seq, i);
+    ring->slots[i].data = NULL;
+  }
+  ring->mask = size - 1;
+  atomic_init(&ring->enq_pos, 0);
+  atomic_init(&ring->deq_pos, 0);
+  return ring;
+}
+
+int ring_push(mpmc_ring *ring, void *data) {
+  ring_slot *slot;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = atomic_load_explicit(&ring->enq_pos, memory_order_relaxed);
+  while (1) {
+    slot = &ring->slots[pos & ring->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (long) seq - (long) pos;
+
+    if (diff == 0) {
+      // slot is free on this lap; try to claim it
+      if (atomic_compare_exchange_weak_explicit(&ring->enq_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // the consumer of the previous lap hasn't drained it: full
+      return -1;
+    } else {
+      // another producer got here first
+      pos = atomic_load_explicit(&ring->enq_pos, memory_order_relaxed);
+    }
+  }
+
+  slot->data = data;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+  return 0;
+}
+
+void *ring_pop(mpmc_ring *ring) {
+  ring_slot *slot;
+  unsigned long pos, seq;
+  long diff;
+  void *data;
+
+  pos = atomic_load_explicit(&ring->deq_pos, memory_order_relaxed);
+  while (1) {
+    slot = &ring->slots[pos & ring->mask];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (long) seq - (long) (pos + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->deq_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // nothing published in this slot yet: empty
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&ring->deq_pos, memory_order_relaxed);
+    }
+  }
+
+  data = slot->data;
+  atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+  return data;
+}
+
+unsigned long ring_count(mpmc_ring *ring) {
+  unsigned long enq, deq;
+
+  deq = atomic_load_explicit(&ring->deq_pos, memory_order_relaxed);
+  enq = atomic_load_explicit(&ring->enq_pos, memory_order_relaxed);
+  return (enq > deq) ? enq - deq : 0;
+}
+
+unsigned long ring_capacity(mpmc_ring *ring) {
+  return ring->mask + 1;
+}
+
+void ring_destroy(mpmc_ring *ring) {
+  if (ring == NULL)
+    return;
+  free(ring->slots);
+  free(ring);
+}
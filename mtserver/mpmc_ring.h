@@ -0,0 +1,60 @@
+/**
+ * mpmc_ring.h
+ *
+ * A bounded, lock-free, multi-producer/multi-consumer ring
+ * buffer of pointers.  Each slot carries a sequence number
+ * that tells producers and consumers whose turn it is, so
+ * nobody ever takes a lock; the enqueue and dequeue cursors
+ * live on their own cache lines so producers and consumers
+ * don't false-share.
+ */
+
+#ifndef MPMC_RING_H
+#define MPMC_RING_H
+
+#include <stdatomic.h>
+
+#define RING_CACHE_LINE 64
+
+typedef struct ring_slot_st {
+  atomic_ulong seq;
+  void *data;
+} ring_slot;
+
+typedef struct mpmc_ring_st {
+  ring_slot *slots;
+  unsigned long mask;
+  _Alignas(RING_CACHE_LINE) atomic_ulong enq_pos;  // next slot to fill
+  _Alignas(RING_CACHE_LINE) atomic_ulong deq_pos;  // next slot to drain
+} mpmc_ring;
+
+/**
+ * ring_create allocates a ring with room for at least
+ * "capacity" pointers (rounded up to a power of two).
+ * Returns NULL on failure.
+ */
+mpmc_ring *ring_create(unsigned long capacity);
+
+/**
+ * ring_push appends "data" (which must not be NULL).  Returns
+ * 0 on success, or -1 if the ring is full.
+ */
+int ring_push(mpmc_ring *ring, void *data);
+
+/**
+ * ring_pop removes the oldest pointer and returns it, or
+ * returns NULL if the ring is empty.
+ */
+void *ring_pop(mpmc_ring *ring);
+
+/**
+ * ring_count returns the number of queued pointers.  It is
+ * only a snapshot when other threads are pushing or popping.
+ */
+unsigned long ring_count(mpmc_ring *ring);
+
+unsigned long ring_capacity(mpmc_ring *ring);
+
+void ring_destroy(mpmc_ring *ring);
+
+#endif
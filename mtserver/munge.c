@@ -0,0 +1,126 @@
+/**
+ * munge.c
+ *
+ * The vector pass moves bytes 2..n-1 down one place a register at
+ * a time, each load reading ahead of the store before it, then
+ * puts the old byte 1 at the end.  Which register width to use
+ * is settled the first time it is needed, from what the CPU
+ * reports.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "munge.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MUNGE_X86
+#include <immintrin.h>
+#endif
+
+// one pass over the "m" bytes at "p": rotate them left by one
+typedef void (*pass_fn)(char *p, int m);
+
+static pass_fn simd_pass;
+static const char *simd_isa;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void pass_scalar(char *p, int m) {
+  char first = p[0];
+
+  memmove(p, p + 1, m - 1);
+  p[m - 1] = first;
+}
+
+#ifdef MUNGE_X86
+__attribute__((target("sse2")))
+static void pass_sse2(char *p, int m) {
+  char first = p[0];
+  int i;
+
+  for (i = 0; i + 16 < m; i += 16)
+    _mm_storeu_si128((__m128i *) (p + i),
+                     _mm_loadu_si128((const __m128i *) (p + i + 1)));
+  for (; i < m - 1; i++)
+    p[i] = p[i + 1];
+  p[m - 1] = first;
+}
+
+__attribute__((target("avx2")))
+static void pass_avx2(char *p, int m) {
+  char first = p[0];
+  int i;
+
+  for (i = 0; i + 32 < m; i += 32)
+    _mm256_storeu_si256((__m256i *) (p + i),
+                        _mm256_loadu_si256((const __m256i *) (p + i + 1)));
+  for (; i < m - 1; i++)
+    p[i] = p[i + 1];
+  p[m - 1] = first;
+}
+#endif
+
+static void pick_simd(void) {
+  simd_pass = pass_scalar;
+  simd_isa = "scalar";
+#ifdef MUNGE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    simd_pass = pass_avx2;
+    simd_isa = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    simd_pass = pass_sse2;
+    simd_isa = "sse2";
+  }
+#endif
+}
+
+/* the original loop, kept byte for byte */
+static void munge_scalar(char *response, int n, long loops) {
+  long j;
+  int i;
+
+  for (j=0; j<loops; j++) {
+    for (i=0; i<n; i++) {
+      char swap;
+
+      swap = response[((i+1)%n)];
+      response[((i+1)%n)] = response[i];
+      response[i] = swap;
+    }
+  }
+}
+
+void munge(int kernel, const char *request, char *response, int n, long loops) {
+  long j;
+  int k;
+
+  if (kernel == MUNGE_CLOSED) {
+    // byte 0 stays; the rest are rotated left by k
+    if (n <= 2) {
+      memcpy(response, request, n);
+      return;
+    }
+    k = (int) (loops % (n - 1));
+    response[0] = request[0];
+    memcpy(response + 1, request + 1 + k, n - 1 - k);
+    memcpy(response + n - k, request + 1, k);
+    return;
+  }
+
+  memcpy(response, request, n);
+  if (kernel == MUNGE_SCALAR) {
+    munge_scalar(response, n, loops);
+    return;
+  }
+  if (n <= 2)
+    return;     // a rotation of one byte, or none
+  pthread_once(&once, pick_simd);
+  for (j = 0; j < loops; j++)
+    simd_pass(response + 1, n - 1);
+}
+
+const char *munge_isa(void) {
+  pthread_once(&once, pick_simd);
+  return simd_isa;
+}
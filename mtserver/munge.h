@@ -0,0 +1,36 @@
+/**
+ * munge.h
+ *
+ * The server's "mindless character munging", three ways.  One
+ * pass of the original loop swaps each byte with the next one
+ * along, wrapping at the end, which leaves byte 0 where it was
+ * and rotates bytes 1..n-1 left by one; "loops" passes rotate
+ * them by loops mod (n-1).  The kernels all give the same bytes:
+ *
+ *   MUNGE_SCALAR  the original byte-at-a-time swaps
+ *   MUNGE_SIMD    each pass as one vector-wide shift, on AVX2
+ *                 or SSE2, whichever the CPU has
+ *   MUNGE_CLOSED  the rotation all passes add up to, done once,
+ *                 so "loops" costs nothing
+ *
+ * The first two do work in proportion to loops * n, which makes
+ * "loops" a knob for how CPU-bound requests are.
+ */
+
+#ifndef MUNGE_H
+#define MUNGE_H
+
+#define MUNGE_SCALAR 0
+#define MUNGE_SIMD   1
+#define MUNGE_CLOSED 2
+
+/**
+ * munge writes the response to the "n"-byte "request" into
+ * "response", which must not overlap it.  It is thread-safe.
+ */
+void munge(int kernel, const char *request, char *response, int n, long loops);
+
+/* munge_isa names what MUNGE_SIMD runs on: "avx2", "sse2" or "scalar" */
+const char *munge_isa(void);
+
+#endif
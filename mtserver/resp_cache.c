@@ -0,0 +1,252 @@
+/**
+ * resp_cache.c
+ *
+ * Each shard keeps its entries twice over: in hash buckets, for
+ * lookups, and on a circular list, for the CLOCK hand.  A new
+ * entry goes in just behind the hand, with its bit clear, so it
+ * is the last the hand reaches and survives a sweep only if it
+ * has been hit by then.  An entry is one buffer-pool allocation
+ * holding the request and then the response, and is charged to
+ * the budget at its real size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "resp_cache.h"
+#include "common.h"
+#include "buf_pool.h"
+
+#define RC_SHARDS      64       // a power of two
+#define RC_BUCKETS     64       // a shard's table, to start
+#define RC_CACHE_LINE  64
+#define RC_ENTRY_SHARE 8        // an entry may take 1/8 of a shard
+
+typedef struct rc_entry_st {
+  uint64_t hash;
+  struct rc_entry_st *chain;    // the next in its bucket
+  struct rc_entry_st *next;     // the clock
+  struct rc_entry_st *prev;
+  int ref;                      // hit since the hand last passed
+  int klen;
+  int vlen;
+  char data[];                  // the request, then the response
+} rc_entry;
+
+typedef struct rc_shard_st {
+  _Alignas(RC_CACHE_LINE) pthread_mutex_t lock;
+  rc_entry **buckets;
+  unsigned long nbuckets;       // a power of two
+  unsigned long count;
+  size_t bytes;
+  rc_entry *hand;               // NULL when the shard is empty
+  unsigned long hits, misses, evictions;
+} rc_shard;
+
+struct resp_cache_st {
+  size_t shard_budget;
+  size_t max_entry;
+  rc_shard shards[RC_SHARDS];
+};
+
+static rc_shard *shard_of(resp_cache *rc, uint64_t hash) {
+  return &rc->shards[(hash >> 58) & (RC_SHARDS - 1)];
+}
+
+static rc_entry **bucket_of(rc_shard *sh, uint64_t hash) {
+  return &sh->buckets[hash & (sh->nbuckets - 1)];
+}
+
+resp_cache *rc_create(size_t budget) {
+  resp_cache *rc;
+  rc_shard *sh;
+  int i;
+
+  // shards sit on cache lines of their own
+  if (posix_memalign((void **) &rc, RC_CACHE_LINE, sizeof(resp_cache)))
+    return NULL;
+  rc->shard_budget = budget / RC_SHARDS;
+  rc->max_entry = rc->shard_budget / RC_ENTRY_SHARE;
+  for (i = 0; i < RC_SHARDS; i++) {
+    sh = &rc->shards[i];
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->nbuckets = RC_BUCKETS;
+    sh->buckets = (rc_entry **) calloc(RC_BUCKETS, sizeof(rc_entry *));
+    sh->count = sh->bytes = 0;
+    sh->hand = NULL;
+    sh->hits = sh->misses = sh->evictions = 0;
+    if (sh->buckets == NULL) {
+      while (i-- > 0)
+        free(rc->shards[i].buckets);
+      free(rc);
+      return NULL;
+    }
+  }
+  return rc;
+}
+
+static rc_entry *find(rc_shard *sh, uint64_t hash, const char *request,
+                      int length) {
+  rc_entry *e;
+
+  for (e = *bucket_of(sh, hash); e != NULL; e = e->chain)
+    if (e->hash == hash && e->klen == length &&
+        memcmp(e->data, request, length) == 0)
+      return e;
+  return NULL;
+}
+
+char *rc_get(resp_cache *rc, const char *request, int length,
+             int *response_length) {
+  uint64_t hash;
+  rc_shard *sh;
+  rc_entry *e;
+  char *response = NULL;
+
+  if ((size_t) length > rc->max_entry)
+    return NULL;
+  hash = hash_bytes(request, length);
+  sh = shard_of(rc, hash);
+
+  pthread_mutex_lock(&sh->lock);
+  if ((e = find(sh, hash, request, length)) == NULL) {
+    sh->misses++;
+  } else if ((response = (char *) bp_alloc(e->vlen)) != NULL) {
+    e->ref = 1;
+    memcpy(response, e->data + e->klen, e->vlen);
+    *response_length = e->vlen;
+    sh->hits++;
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return response;
+}
+
+/* take the hand's entry out of the shard, and move the hand on */
+static void evict(rc_shard *sh) {
+  rc_entry *e = sh->hand, **pp;
+
+  for (pp = bucket_of(sh, e->hash); *pp != e; pp = &(*pp)->chain)
+    ;
+  *pp = e->chain;
+  if (e->next == e) {
+    sh->hand = NULL;
+  } else {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    sh->hand = e->next;
+  }
+  sh->count--;
+  sh->bytes -= bp_size(e);
+  sh->evictions++;
+  bp_free(e);
+}
+
+/* double the table once it averages more than one entry a bucket */
+static void grow(rc_shard *sh) {
+  rc_entry **old = sh->buckets, *e, *next;
+  unsigned long n = sh->nbuckets, i;
+
+  if ((sh->buckets = (rc_entry **) calloc(2 * n, sizeof(rc_entry *))) == NULL) {
+    sh->buckets = old;      // stay as we are: chains just get longer
+    return;
+  }
+  sh->nbuckets = 2 * n;
+  for (i = 0; i < n; i++) {
+    for (e = old[i]; e != NULL; e = next) {
+      next = e->chain;
+      e->chain = *bucket_of(sh, e->hash);
+      *bucket_of(sh, e->hash) = e;
+    }
+  }
+  free(old);
+}
+
+void rc_put(resp_cache *rc, const char *request, int length,
+            const char *response, int response_length) {
+  uint64_t hash;
+  rc_shard *sh;
+  rc_entry *e;
+  size_t size;
+
+  if ((size_t) length + response_length > rc->max_entry)
+    return;
+  hash = hash_bytes(request, length);
+  sh = shard_of(rc, hash);
+
+  // fill the entry in before taking the lock
+  if ((e = (rc_entry *) bp_alloc(sizeof(rc_entry) + length + response_length)) == NULL)
+    return;
+  e->hash = hash;
+  e->ref = 0;
+  e->klen = length;
+  e->vlen = response_length;
+  memcpy(e->data, request, length);
+  memcpy(e->data + length, response, response_length);
+  size = bp_size(e);
+
+  pthread_mutex_lock(&sh->lock);
+  if (find(sh, hash, request, length) != NULL) {
+    // another thread got there first
+    pthread_mutex_unlock(&sh->lock);
+    bp_free(e);
+    return;
+  }
+  while (sh->hand != NULL && sh->bytes + size > rc->shard_budget) {
+    if (sh->hand->ref) {
+      sh->hand->ref = 0;
+      sh->hand = sh->hand->next;
+    } else {
+      evict(sh);
+    }
+  }
+  if (sh->count >= sh->nbuckets)
+    grow(sh);
+
+  e->chain = *bucket_of(sh, hash);
+  *bucket_of(sh, hash) = e;
+  if (sh->hand == NULL) {
+    e->next = e->prev = e;
+    sh->hand = e;
+  } else {
+    e->next = sh->hand;
+    e->prev = sh->hand->prev;
+    e->prev->next = e;
+    sh->hand->prev = e;
+  }
+  sh->count++;
+  sh->bytes += size;
+  pthread_mutex_unlock(&sh->lock);
+}
+
+void rc_get_stats(resp_cache *rc, rc_stats *st) {
+  rc_shard *sh;
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  for (i = 0; i < RC_SHARDS; i++) {
+    sh = &rc->shards[i];
+    pthread_mutex_lock(&sh->lock);
+    st->hits += sh->hits;
+    st->misses += sh->misses;
+    st->evictions += sh->evictions;
+    st->entries += sh->count;
+    st->bytes += sh->bytes;
+    pthread_mutex_unlock(&sh->lock);
+  }
+}
+
+void rc_destroy(resp_cache *rc) {
+  rc_shard *sh;
+  int i;
+
+  for (i = 0; i < RC_SHARDS; i++) {
+    sh = &rc->shards[i];
+    while (sh->hand != NULL)
+      evict(sh);
+    free(sh->buckets);
+    pthread_mutex_destroy(&sh->lock);
+  }
+  free(rc);
+}
@@ -0,0 +1,52 @@
+/**
+ * resp_cache.h
+ *
+ * A response cache for process_request, which is a pure function
+ * of the request's bytes.  It is split into shards by the
+ * request's hash, each with its own lock, hash table, share of
+ * the memory budget and CLOCK hand: a hit sets the entry's
+ * reference bit, and to make room the hand sweeps the shard,
+ * clearing set bits and evicting the first entry whose bit is
+ * already clear.  Requests are compared in full, so a hash
+ * collision is only a miss.
+ */
+
+#ifndef RESP_CACHE_H
+#define RESP_CACHE_H
+
+#include <stddef.h>
+
+typedef struct resp_cache_st resp_cache;
+
+/**
+ * rc_create makes a cache that holds at most "budget" bytes of
+ * entries.  A request bigger than a small part of a shard's share
+ * is never cached.  Returns NULL on failure.
+ */
+resp_cache *rc_create(size_t budget);
+
+/**
+ * rc_get returns a copy of the cached response to the "length"
+ * bytes at "request", from bp_alloc (see buf_pool.h), with its
+ * length in "*response_length"; or NULL on a miss.
+ */
+char *rc_get(resp_cache *rc, const char *request, int length,
+             int *response_length);
+
+/* rc_put caches "response" as the answer to "request" */
+void rc_put(resp_cache *rc, const char *request, int length,
+            const char *response, int response_length);
+
+typedef struct rc_stats_st {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long entries;
+  size_t bytes;               // held by entries, of the budget
+} rc_stats;
+
+void rc_get_stats(resp_cache *rc, rc_stats *st);
+
+void rc_destroy(resp_cache *rc);
+
+#endif
@@ -9,46 +9,273 @@
 * connection.
 */
 
+#define _GNU_SOURCE     // for pthread_setaffinity_np
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
 
 #include "lib/socklib.h"
 #include "common.h"
-#include "threadpool.c"
-
-#define NUM_LOOPS 1
+#include "threadpool.h"
+#include "event_loop.h"
+#include "buf_pool.h"
+#include "munge.h"
+#include "resp_cache.h"
+#include "coalesce.h"
+
+#define NUM_LOOPS 1          // default -L
 #define THREADP 1
+#define THREADP_MAX 64      // the pool grows up to this under load
+#define SERVER_QUEUE 256    // connections allowed to wait for a worker
+#define SERVER_BATCH 16     // connections accepted per dispatch_batch
+#define SERVER_ACCEPT_RETRY_MS 10   // pause after accept fails, e.g. EMFILE
+#define SERVER_NODES 64     // most NUMA nodes -N serves
+#define SERVER_GRACE_MS 5000    // default -g
+#define SERVER_IDLE_MS 10000    // default -i
+#define SERVER_PIPELINE 64      // requests read, and answered, at once
+#define SERVER_MAX_FRAME (1 << 20)  // default -m
+#define SERVER_BUF 1024         // a connection's input buffer, to start
 extern int errno;
 
 int   setup_listen(char *socketNumber);
-char *read_request(int fd);
-char *process_request(char *request, int *response_length);
+int   setup_listen_reuseport(char *socketNumber);
+int   read_requests(int fd, char *buf, int len);
+char *process_request(char *request, int request_length, int *response_length);
+char *compute_response(char *request, int request_length, int *response_length);
+char *answer_frame(int *version, frame *f, char *payload, frame *reply);
 void  send_response(int fd, char *response, int response_length);
+int   send_responses(int fd, struct iovec *iov, int n);
 void for_dispatch(int socket_talk);
+static void for_dispatch_task(void *arg);
+void drop_connection(void *arg);
+int   parse_overload(char *spec, threadpool_attr *attr);
+void *accept_loop(void *arg);
+void *event_thread(void *arg);
+void  pin_to_node(int node);
+void  pin_to_cpu(int cpu);
+int   usable_cpus(int *cpus, int max);
+void  print_stats(void *arg);
+
+static atomic_int stopping;     // SIGTERM or SIGINT arrived
+static int idle_ms = SERVER_IDLE_MS;
+static int max_frame = SERVER_MAX_FRAME;
+static long num_loops = NUM_LOOPS;
+static int kernel = MUNGE_SIMD;
+static resp_cache *cache;      // -C, or NULL
+static coalescer *flights;      // -S, or NULL
+
+// one accept loop (or event loop, with -e) and the pool it feeds
+typedef struct acceptor_st {
+    int socket_listen;
+    int node;               // NUMA node to stay on, or -1
+    int cpu;                // -R: the CPU to stay on, or -1
+    threadpool tp;          // NULL with -R
+    ev_loop *loop;          // -e and -R only
+    unsigned long last;     // tasks completed, at the last report
+    unsigned long last_served;  // requests answered, likewise
+} acceptor;
+
+// what the -s reporter watches
+typedef struct reporter_st {
+    int interval;           // seconds between lines
+    int nacc;
+    acceptor *acc;
+} reporter;
 
 /**
 * This program should be invoked as "./server <socketnumber>", for
-* example, "./server 4342".
+* example, "./server 4342".  Options, which go before the port:
+*
+*   -t threads     worker threads the pool starts with, and keeps
+*                  even when idle
+*   -T threads     most worker threads the pool may grow to
+*                  (equal to -t for a fixed-size pool)
+*   -q list|ring   threadpool queue implementation
+*   -Q capacity    connections allowed to queue for a worker
+*   -o policy      what to do with a connection when the queue is
+*                  full: reject (close it at once, the default),
+*                  block, timeout:<ms>, caller (serve it on the
+*                  accept thread) or drop (close the oldest one)
+*   -s seconds     print a line of threadpool statistics this often
+*   -g ms          on SIGTERM or SIGINT, stop accepting and give
+*                  queued requests this long to finish (default
+*                  5000); -g 0 drops them at once
+*   -N             one pool per NUMA node, with its workers and its
+*                  own accept loop kept on that node; -t and -T
+*                  are then per node
+*   -e             event-driven: an epoll loop per pool owns the
+*                  listening socket and every connection, all
+*                  non-blocking, and only hands whole requests to
+*                  the pool, so idle or slow clients tie up no
+*                  worker (see event_loop.h)
+*   -u             drive the event loops, of -e or -R, with
+*                  io_uring instead of epoll, for far fewer system
+*                  calls a request (see event_loop.h); implies -e.
+*                  On a kernel that can't, they fall back to epoll
+*                  and say so
+*   -i ms          close a connection that has sent nothing for
+*                  this long (default 10000; 0: never)
+*   -m bytes       the largest frame payload to take (default 1MB,
+*                  at least 4096); a client that sends a bigger one
+*                  gets an ERROR and is hung up on
+*   -L loops       munging passes over each request (default 1):
+*                  with -k scalar or simd, how much CPU a request
+*                  costs
+*   -k kernel      how to munge (see munge.h): scalar (the original
+*                  loop), simd (the default) or closed (all the
+*                  passes at once, so -L costs nothing); all give
+*                  the same responses
+*   -C mbytes      cache responses, up to this many megabytes of
+*                  them, and answer a repeated request from the
+*                  cache without munging it (default 0: no cache;
+*                  see resp_cache.h)
+*   -S             coalesce: a request identical to one already
+*                  being worked on waits for that one's response
+*                  instead of munging the same bytes again (see
+*                  coalesce.h)
+*   -R cores       thread-per-core: one event loop per CPU (cores
+*                  of them, or 0 for every CPU we may run on; more
+*                  than that are dealt round-robin), each pinned to
+*                  its CPU with its own SO_REUSEPORT
+*                  listening socket, and answering its requests
+*                  itself; they share no pool, queue or socket, and
+*                  the kernel spreads connections across them.  The
+*                  pool options don't apply
+*
+* Clients speak the framed protocol in common.h: a HELLO settles
+* the version, and then a request may be any size up to -m, or,
+* streamed in chunks, any size at all.  Connections are
+* persistent: a client may send any number of requests over one,
+* back to back without waiting for answers.  They are answered
+* in order, everything that has arrived at once in a single
+* write.  Without -e, a connection keeps its
+* worker until it is closed or goes idle.
 */
 
 int main(int argc, char **argv)
 {
-    char buf[1000];
-    int  socket_listen;
-    int  socket_talk;
-    int  dummy, len;
-
-    int c;
+    int  socket_listen = -1;
+
+    int opt, nthreads = THREADP, per_node = 0, grace_ms = SERVER_GRACE_MS;
+    int event_mode = 0, cores = -1, engine = EV_EPOLL;
+    int sig;
+    long dropped;
+    sigset_t stop_sigs;
+    int i, nloops = 1, ncpus = 0;
+    long cache_mb = 0;
+    int coalesce = 0;
+    int cpus[CPU_SETSIZE];
+    reporter rep = { 0, 0, NULL };
+    tp_timer_id stats_timer = 0;
+    threadpool timer_pool = NULL;
+    acceptor *acc;
+    pthread_t *accept_threads;
+    threadpool_attr attr;
+
+    threadpool_attr_init(&attr);
+    attr.max_threads = THREADP_MAX;
+    attr.queue_capacity = SERVER_QUEUE;
+    attr.overload = TP_OVERLOAD_REJECT;
+    attr.on_drop = drop_connection;
+
+    while ((opt = getopt(argc, argv, "t:T:q:Q:o:s:g:Neui:m:L:k:C:SR:")) != -1) {
+        switch (opt) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'T':
+            attr.max_threads = atoi(optarg);
+            break;
+        case 'q':
+            if (!strcmp(optarg, "list"))
+                attr.queue_type = TP_QUEUE_LIST;
+            else if (!strcmp(optarg, "ring"))
+                attr.queue_type = TP_QUEUE_RING;
+            else
+                argc = 0;
+            break;
+        case 'Q':
+            attr.queue_capacity = atoi(optarg);
+            break;
+        case 'o':
+            if (parse_overload(optarg, &attr) < 0) {
+                fprintf(stderr, "(SERVER): unknown overload policy '%s'\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 's':
+            rep.interval = atoi(optarg);
+            break;
+        case 'g':
+            grace_ms = atoi(optarg);
+            break;
+        case 'N':
+            per_node = 1;
+            break;
+        case 'e':
+            event_mode = 1;
+            break;
+        case 'u':
+            engine = EV_URING;
+            event_mode = 1;
+            break;
+        case 'i':
+            idle_ms = atoi(optarg);
+            break;
+        case 'm':
+            max_frame = atoi(optarg);
+            break;
+        case 'L':
+            num_loops = atol(optarg);
+            break;
+        case 'k':
+            if (!strcmp(optarg, "scalar"))
+                kernel = MUNGE_SCALAR;
+            else if (!strcmp(optarg, "simd"))
+                kernel = MUNGE_SIMD;
+            else if (!strcmp(optarg, "closed"))
+                kernel = MUNGE_CLOSED;
+            else
+                argc = 0;
+            break;
+        case 'C':
+            cache_mb = atol(optarg);
+            break;
+        case 'S':
+            coalesce = 1;
+            break;
+        case 'R':
+            cores = atoi(optarg);
+            event_mode = 1;
+            break;
+        default:
+            argc = 0;   // fall into the usage message
+        }
+    }
 
-    if (argc != 2)
+    if (argc - optind != 1 || (cores >= 0 && per_node) || max_frame < FRAME_SMALL ||
+        num_loops < 0 || cache_mb < 0)
     {
-        fprintf(stderr, "(SERVER): Invoke as  './server socknum'\n");
+        fprintf(stderr, "(SERVER): Invoke as  './server [-t threads] [-T max_threads] [-q list|ring] [-Q capacity]\n");
+        fprintf(stderr, "(SERVER):   [-o reject|block|timeout:ms|caller|drop] [-s secs] [-g ms] [-N] [-e] [-u] [-i ms]\n");
+        fprintf(stderr, "(SERVER):   [-m max_frame] [-L loops] [-k scalar|simd|closed] [-C mbytes]\n");
+        fprintf(stderr, "(SERVER):   [-S] [-R cores] socknum'\n");
+        fprintf(stderr, "(SERVER):   (-R and -N don't mix)\n");
         fprintf(stderr, "(SERVER): for example, './server 4434'\n");
         exit(-1);
     }
@@ -56,8 +283,14 @@ int main(int argc, char **argv)
     /*
     * Set up the 'listening socket'.  This establishes a network
     * IP_address:port_number that other programs can connect with.
+    * (With -R, each core sets up its own, below.)
     */
-    socket_listen = setup_listen(argv[1]);
+    if (cores < 0) {
+        socket_listen = setup_listen(argv[optind]);
+        // the accept loops wait in poll, and take only what is
+        // there, so none is ever stuck in accept (-e wants it too)
+        fcntl(socket_listen, F_SETFL, fcntl(socket_listen, F_GETFL) | O_NONBLOCK);
+    }
 
     /*
     * Here's the main loop of our program.  Inside the loop, the
@@ -70,7 +303,7 @@ int main(int argc, char **argv)
     *     so more connections can be made to it later.
     *
     *  2) Read a request off of the listening socket.  Requests
-    *     are, by definition, REQUEST_SIZE bytes long.
+    *     are frames, each saying how long it is.
     *
     *  3) Process the request.
     *
@@ -80,35 +313,367 @@ int main(int argc, char **argv)
     */
     setvbuf(stdout, NULL, _IONBF, 0);
 
-    threadpool tp = create_threadpool(THREADP);
-    c = 0;
+    // every thread we start inherits this, so only sigwait below
+    // ever sees a stop signal
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGTERM);
+    sigaddset(&stop_sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
+    // a client may hang up with responses still on their way
+    signal(SIGPIPE, SIG_IGN);
+
+    attr.min_threads = nthreads;
+    if (event_mode) {
+        struct rlimit rl;
+
+        // queued work is a connection the loop still owns
+        attr.on_drop = ev_drop;
+        // every connection is an fd: allow as many as we may
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    if (cores >= 0) {
+        nloops = ncpus = usable_cpus(cpus, CPU_SETSIZE);
+        if (cores > 0)
+            nloops = cores;
+    } else if (per_node) {
+        nloops = threadpool_numa_nodes();
+        if (nloops > SERVER_NODES)
+            nloops = SERVER_NODES;
+        attr.placement = TP_PLACE_NODE;
+    }
+
+    // one cache, and one coalescer, for every pool and core: they
+    // are sharded, so seldom contended
+    if (cache_mb > 0 && (cache = rc_create((size_t) cache_mb << 20)) == NULL) {
+        fprintf(stderr, "(SERVER): couldn't create the response cache\n");
+        exit(-1);
+    }
+    if (coalesce && (flights = co_create()) == NULL) {
+        fprintf(stderr, "(SERVER): couldn't create the coalescer\n");
+        exit(-1);
+    }
+
+    acc = (acceptor *) calloc(nloops, sizeof(acceptor));
+    accept_threads = (pthread_t *) calloc(nloops, sizeof(pthread_t));
+    if (acc == NULL || accept_threads == NULL) {
+        fprintf(stderr, "(SERVER): out of memory!\n");
+        exit(-1);
+    }
+
+    for (i = 0; i < nloops; i++) {
+        acc[i].node = per_node ? i : -1;
+        acc[i].cpu = -1;
+        if (cores >= 0) {
+            // a core of its own: its own socket, and no pool
+            acc[i].cpu = cpus[i % ncpus];
+            acc[i].socket_listen = setup_listen_reuseport(argv[optind]);
+            acc[i].tp = NULL;
+        } else {
+            attr.numa_node = i;
+            acc[i].socket_listen = socket_listen;
+            acc[i].tp = create_threadpool_attr(nthreads, &attr);
+            if (acc[i].tp == NULL) {
+                fprintf(stderr, "(SERVER): couldn't create the threadpool\n");
+                exit(-1);
+            }
+        }
+        acc[i].loop = NULL;
+        if (event_mode &&
+            (acc[i].loop = ev_create(acc[i].socket_listen, acc[i].tp,
+                                     answer_frame, idle_ms, max_frame, engine)) == NULL) {
+            fprintf(stderr, "(SERVER): couldn't create the event loop\n");
+            exit(-1);
+        }
+    }
+    if (engine == EV_URING && ev_engine(acc[0].loop) != EV_URING)
+        printf("(SERVER): no io_uring here, using epoll\n");
+
+    // the first pool's timer wheel drives the reporter; -R has no
+    // pool, so gets a single-thread one just for that
+    if (rep.interval > 0) {
+        rep.nacc = nloops;
+        rep.acc = acc;
+        timer_pool = cores >= 0 ? create_threadpool(1) : acc[0].tp;
+        if (timer_pool != NULL)
+            stats_timer = dispatch_every(timer_pool, rep.interval * 1000L,
+                                         rep.interval * 1000L, print_stats, &rep);
+        if (stats_timer == 0) {
+            fprintf(stderr, "(SERVER): couldn't start the stats timer\n");
+            exit(-1);
+        }
+    }
 
-    struct timeval start, end;
-    long tim, throughput;
+    // an accept thread per pool, all on the shared listening socket
+    // (or with -R, a loop per core on its own)
+    for (i = 0; i < nloops; i++) {
+        if (pthread_create(&accept_threads[i], NULL,
+                           event_mode ? event_thread : accept_loop, &acc[i])) {
+            fprintf(stderr, "(SERVER): couldn't start an accept thread\n");
+            exit(-1);
+        }
+    }
 
+    // run until told to stop, then stop accepting, let the pools
+    // drain for up to grace_ms, and exit
+    sigwait(&stop_sigs, &sig);
+    atomic_store(&stopping, 1);
+    if (event_mode) {
+        // the loops keep running until the pools below have
+        // answered, or dropped, every request they hold
+        for (i = 0; i < nloops; i++)
+            ev_stop(acc[i].loop);
+    } else {
+        shutdown(socket_listen, SHUT_RDWR);     // wakes the accept()s
+        for (i = 0; i < nloops; i++)
+            pthread_join(accept_threads[i], NULL);
+    }
+    if (stats_timer != 0)
+        timer_cancel(timer_pool, stats_timer);
+    if (cores >= 0 && timer_pool != NULL)
+        destroy_threadpool(timer_pool);
+
+    dropped = 0;
+    for (i = 0; i < nloops; i++)
+        if (acc[i].tp != NULL)
+            dropped += threadpool_shutdown(acc[i].tp,
+                                           grace_ms > 0 ? TP_SHUTDOWN_DRAIN : TP_SHUTDOWN_ABORT,
+                                           grace_ms);
+    if (event_mode) {
+        for (i = 0; i < nloops; i++) {
+            pthread_join(accept_threads[i], NULL);
+            ev_destroy(acc[i].loop);
+        }
+    }
+    if (cores >= 0)
+        for (i = 0; i < nloops; i++)
+            close(acc[i].socket_listen);
+    else
+        close(socket_listen);
+    if (cache != NULL)
+        rc_destroy(cache);
+    if (flights != NULL)
+        co_destroy(flights);
+    free(acc);
+    free(accept_threads);
+    printf("(SERVER): shut down, %ld queued requests dropped\n", dropped);
+    return 0;
+}
 
+/**
+* This function runs every -s seconds, on a pool timer, and prints
+* what each pool has been doing: tasks finished per second (a
+* task is a whole connection, or with -e a batch of pipelined
+* requests), how many are queued (and the most ever queued), busy
+* workers, and median and 99th percentile queue wait and service
+* times.  For each event loop, it adds requests answered per
+* second and open connections, and then how much memory the
+* buffer pool holds, the most it has ever held, and how often it
+* has had to go to the heap (which stops once it has warmed up).
+* With -C, a line covers the response cache, and with -S, one says
+* how many requests shared another's computation.
+*/
+
+void print_stats(void *arg) {
+    reporter *rep = (reporter *) arg;
+    acceptor *acc;
+    tp_stats st;
+    bp_stats bst;
+    rc_stats rst;
+    co_stats cst;
+    unsigned long served;
+    int i;
+
+    for (i = 0; i < rep->nacc; i++) {
+        acc = &rep->acc[i];
+        if (acc->loop != NULL) {
+            served = ev_requests(acc->loop);
+            if (acc->tp != NULL)
+                printf("(SERVER): pool %d: ", i);
+            else
+                printf("(SERVER): core %d (cpu %d): ", i, acc->cpu);
+            printf("%lu req/s, %d open connections\n",
+                   (served - acc->last_served) / rep->interval,
+                   ev_connections(acc->loop));
+            acc->last_served = served;
+        }
+        if (acc->tp == NULL)
+            continue;
+
+        threadpool_get_stats(acc->tp, &st);
+        printf("(SERVER): pool %d: %lu tasks/s, queued %ld (peak %lu), "
+               "busy %d/%d, dropped %lu, wait p50 %luus p99 %luus, "
+               "service p50 %luus p99 %luus\n",
+               i, (st.completed - acc->last) / rep->interval,
+               st.depth, st.peak_depth, st.busy, st.threads, st.dropped,
+               threadpool_hist_percentile(st.wait_hist, 50) / 1000,
+               threadpool_hist_percentile(st.wait_hist, 99) / 1000,
+               threadpool_hist_percentile(st.run_hist, 50) / 1000,
+               threadpool_hist_percentile(st.run_hist, 99) / 1000);
+        acc->last = st.completed;
+    }
+
+    bp_get_stats(&bst);
+    printf("(SERVER): buffers: %lu KB held (peak %lu KB), %lu heap allocations, "
+           "%lu too big to pool\n", bst.held / 1024, bst.peak / 1024,
+           bst.heap_allocs, bst.big_allocs);
+    if (cache != NULL) {
+        rc_get_stats(cache, &rst);
+        printf("(SERVER): cache: %lu hits, %lu misses (%.1f%% hits), %lu entries "
+               "in %lu KB, %lu evicted\n", rst.hits, rst.misses,
+               rst.hits + rst.misses > 0 ?
+                   100.0 * rst.hits / (rst.hits + rst.misses) : 0.0,
+               rst.entries, (unsigned long) (rst.bytes / 1024), rst.evictions);
+    }
+    if (flights != NULL) {
+        co_get_stats(flights, &cst);
+        printf("(SERVER): coalescing: %lu computed, %lu shared another's\n",
+               cst.computed, cst.shared);
+    }
+}
+
+/**
+* This function confines the calling thread to the CPUs of NUMA
+* node "node"; -1 leaves it be.
+*/
+
+void pin_to_node(int node) {
+    int i, n;
+    int cpus[CPU_SETSIZE];
+    cpu_set_t set;
+
+    if (node >= 0 && (n = threadpool_node_cpus(node, cpus, CPU_SETSIZE)) > 0) {
+        CPU_ZERO(&set);
+        for (i = 0; i < n; i++)
+            CPU_SET(cpus[i], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+}
+
+/**
+* This function pins the calling thread to one CPU.
+*/
+
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+* This function stores up to "max" of the CPUs this process may
+* run on in "cpus", and returns how many it stored.
+*/
+
+int usable_cpus(int *cpus, int max) {
+    cpu_set_t set;
+    int i, n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        cpus[0] = 0;
+        return 1;
+    }
+    for (i = 0; i < CPU_SETSIZE && n < max; i++)
+        if (CPU_ISSET(i, &set))
+            cpus[n++] = i;
+    return n;
+}
+
+/**
+* This function runs an event loop (-e) on its pool's node, or
+* with -R, on its own CPU.
+*/
+
+void *event_thread(void *arg) {
+    acceptor *acc = (acceptor *) arg;
+
+    if (acc->cpu >= 0)
+        pin_to_cpu(acc->cpu);
+    else
+        pin_to_node(acc->node);
+    return ev_run(acc->loop);
+}
+
+/**
+* This function is the accept loop: it takes connections off the
+* listening socket and hands them to its threadpool until the
+* server is stopped.  The socket is non-blocking and shared by
+* every accept loop, so a loop that wakes to find the connection
+* taken by another just goes back to waiting; the shutdown() in
+* main wakes them all, and accept then fails for good.
+* With -N, it first moves itself onto its pool's node.
+*/
+
+void *accept_loop(void *arg) {
+    acceptor *acc = (acceptor *) arg;
+    struct pollfd pfd;
+    int  socket_talk;
+    int i, nconn, taken;
+    void *conns[SERVER_BATCH];
+    dispatch_fn fns[SERVER_BATCH];
+
+    pin_to_node(acc->node);
+
+    for (i = 0; i < SERVER_BATCH; i++)
+        fns[i] = for_dispatch_task;
+
+    pfd.fd = acc->socket_listen;
+    pfd.events = POLLIN;
     while(1) {
-        socket_talk = saccept(socket_listen);  // step 1
-        dispatch(tp, for_dispatch, (void *) socket_talk);
-        c++;
-        if (c == 1){
-            gettimeofday(&start, NULL);
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("(SERVER): poll");
+            return NULL;
         }
-        if (c % 100 == 0){
-            gettimeofday(&end, NULL);
-            tim = end.tv_sec - start.tv_sec;
-            if (tim > 0){
-                throughput = c / tim;
-                // printf("%ld\n", throughput);
-            }
 
+        // take whatever is waiting, and hand the lot to the pool
+        // in one go
+        for (nconn = 0; nconn < SERVER_BATCH; nconn++) {
+            socket_talk = accept4(acc->socket_listen, NULL, NULL, SOCK_CLOEXEC);  // step 1
+            if (socket_talk < 0)
+                break;
+            conns[nconn] = (void *) (long) socket_talk;
         }
+        if (nconn == 0) {
+            if (atomic_load(&stopping))
+                return NULL;
+            // out of fds, say: give it a moment rather than spin
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED)
+                poll(NULL, 0, SERVER_ACCEPT_RETRY_MS);
+            continue;
+        }
+
+        // never sit on the accept loop unless -o asked for it; a
+        // connection the pool won't take is closed straight away
+        taken = dispatch_batch(acc->tp, fns, conns, nconn);
+        for (i = taken; i < nconn; i++)
+            close((int) (long) conns[i]);
     }
+    return NULL;
+}
+
+/**
+* The pool hands its tasks a void *: this unwraps the connection
+* for for_dispatch.
+*/
+
+static void for_dispatch_task(void *arg) {
+    for_dispatch((int) (long) arg);
 }
 
 void for_dispatch(int socket_talk){
-  char *request = NULL;
-  char *response = NULL;
+  char *buf, *grown;
+  char headers[SERVER_PIPELINE][FRAME_HEADER];
+  char *replies[SERVER_PIPELINE];
+  struct iovec iov[2 * SERVER_PIPELINE];
+  frame f, reply;
+  int have = 0, version = 0, closing = 0, failed;
+  int ret, i, n, used, need;
+  char *p;
 
   // socket_talk = saccept(socket_listen);  // step 1 //assign value in the main function which will
   // be used to dispatch/
@@ -118,25 +683,107 @@ void for_dispatch(int socket_talk){
       perror("");
       exit(1);
   }
-  request = read_request(socket_talk);  // step 2
-  if (request != NULL) {
-      int response_length;
+  if ((buf = (char *) bp_alloc(SERVER_BUF)) == NULL) {
+      close(socket_talk);
+      return;
+  }
+  // serve requests until the client closes the connection, goes
+  // idle, or breaks the protocol
+  while (!closing) {
+      n = frame_scan(buf, have, SERVER_PIPELINE, max_frame, &used, &need);
+      if (n == 0 && need > 0) {
+          // no whole frame yet: make room for the next one, and
+          // wait for the rest of it
+          if (need > (int) bp_size(buf)) {
+              if ((grown = (char *) bp_grow(buf, have, need)) == NULL)
+                  break;
+              buf = grown;
+          }
+          if ((ret = read_requests(socket_talk, buf + have,
+                                   (int) bp_size(buf) - have)) <= 0)  // step 2
+              break;
+          have += ret;
+          continue;
+      }
 
-      response = process_request(request, &response_length);  // step 3
-      if (response != NULL) {
-          send_response(socket_talk, response, response_length);  // step 4
+      // answer every whole frame that has arrived, in order, and
+      // send the answers together
+      failed = 0;
+      for (i = 0, p = buf; i < n && !closing; i++) {
+          frame_unpack(p, &f);
+          replies[i] = answer_frame(&version, &f, p + FRAME_HEADER, &reply);  // step 3
+          if (replies[i] == NULL) {
+              failed = 1;
+              break;
+          }
+          frame_pack(headers[i], reply.type, reply.flags, reply.length);
+          iov[2 * i].iov_base = headers[i];
+          iov[2 * i].iov_len = FRAME_HEADER;
+          iov[2 * i + 1].iov_base = replies[i];
+          iov[2 * i + 1].iov_len = reply.length;
+          closing = reply.type == FRAME_ERROR;
+          p += FRAME_HEADER + f.length;
       }
+      if (n == 0) {
+          // the next frame is over the limit: say so, and hang up
+          replies[0] = frame_error(&reply, "frame too large");
+          failed = replies[0] == NULL;
+          if (!failed) {
+              frame_pack(headers[0], reply.type, reply.flags, reply.length);
+              iov[0].iov_base = headers[0];
+              iov[0].iov_len = FRAME_HEADER;
+              iov[1].iov_base = replies[0];
+              iov[1].iov_len = reply.length;
+              i = 1;
+          }
+          closing = 1;
+      }
+      ret = failed ? -1 : send_responses(socket_talk, iov, 2 * i);  // step 4
+      while (i-- > 0)
+          bp_free(replies[i]);
+      if (ret < 0)
+          break;
+
+      // keep the start of a request still arriving
+      have -= used;
+      memmove(buf, buf + used, have);
   }
+  bp_free(buf);
   close(socket_talk);  // step 5
+}
+
 
-  // clean up allocated memory, if any
-  if (request != NULL)
-  free(request);
-  if (response != NULL)
-  free(response);
+
+/**
+* The threadpool calls this for a queued connection it discards
+* (the -o drop policy); the client just sees the socket close.
+*/
+
+void drop_connection(void *arg) {
+  close((int) (long) arg);
 }
 
+/**
+* This function turns the -o argument into an overload policy.
+* Returns -1 if it doesn't recognize it.
+*/
 
+int parse_overload(char *spec, threadpool_attr *attr) {
+    if (!strcmp(spec, "reject"))
+        attr->overload = TP_OVERLOAD_REJECT;
+    else if (!strcmp(spec, "block"))
+        attr->overload = TP_OVERLOAD_BLOCK;
+    else if (!strncmp(spec, "timeout:", 8)) {
+        attr->overload = TP_OVERLOAD_TIMEOUT;
+        attr->block_timeout_ms = atoi(spec + 8);
+    } else if (!strcmp(spec, "caller"))
+        attr->overload = TP_OVERLOAD_CALLER_RUNS;
+    else if (!strcmp(spec, "drop"))
+        attr->overload = TP_OVERLOAD_DROP_OLDEST;
+    else
+        return -1;
+    return 0;
+}
 
 /**
 * This function accepts a string of the form "5654", and opens up
@@ -156,51 +803,162 @@ int setup_listen(char *socketNumber) {
 }
 
 /**
-* This function reads a request off of the given socket.
+* This function is setup_listen for -R: every core calls it for
+* the same port, and gets a socket of its own.
+*/
+
+int setup_listen_reuseport(char *socketNumber) {
+    int socket_listen;
+
+    if ((socket_listen = slisten_reuseport(socketNumber)) < 0) {
+        perror("(SERVER): slisten_reuseport");
+        exit(1);
+    }
+
+    return socket_listen;
+}
+
+/**
+* This function waits up to idle_ms for requests on the given
+* socket and reads whatever has arrived, up to "len" bytes.  It
+* returns how many bytes it read, or 0 if the client closed the
+* connection, went idle, or failed.
 * This function is thread-safe.
 */
 
-char *read_request(int fd) {
-    char *request = (char *) malloc(REQUEST_SIZE*sizeof(char));
+int read_requests(int fd, char *buf, int len) {
+    struct pollfd pfd;
     int   ret;
 
-    if (request == NULL) {
-        fprintf(stderr, "(SERVER): out of memory!\n");
-        exit(-1);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    do {
+        ret = poll(&pfd, 1, idle_ms > 0 ? idle_ms : -1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret <= 0)
+        return 0;
+
+    do {
+        ret = read(fd, buf, len);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 ? ret : 0;
+}
+
+/**
+* This function writes n responses to the given socket with as
+* few system calls as it can.  Returns 0, or -1 if the client
+* has gone.  The iovecs are used up.
+* This function is thread-safe.
+*/
+
+int send_responses(int fd, struct iovec *iov, int n) {
+    ssize_t ret;
+
+    while (n > 0) {
+        ret = writev(fd, iov, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // skip what went out, and resume partway into an iovec
+        while (n > 0 && ret >= (ssize_t) iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
     }
+    return 0;
+}
 
-    ret = correct_read(fd, request, REQUEST_SIZE);
-    if (ret != REQUEST_SIZE) {
-        free(request);
-        request = NULL;
+/**
+* This function answers one frame from a client that speaks
+* protocol version "*version", or hasn't said yet (0): the HELLO
+* sets it, and after that only REQUESTs are allowed.  It fills in
+* the reply's header and returns its payload, from bp_alloc, or NULL
+* to hang up without one.  After an ERROR, the connection is
+* closed once it has been sent.
+* This function is thread-safe.
+*/
+
+char *answer_frame(int *version, frame *f, char *payload, frame *reply) {
+    char *out;
+    int   v, len;
+
+    if (*version == 0) {
+        if (f->type != FRAME_HELLO || f->length != HELLO_SIZE)
+            return frame_error(reply, "expected HELLO");
+        if ((v = hello_choose(payload)) < 0)
+            return frame_error(reply, "no protocol version in common");
+        if ((out = (char *) bp_alloc(HELLO_REPLY_SIZE)) == NULL)
+            return NULL;
+        hello_reply_pack(out, v, max_frame);
+        *version = v;
+        reply->type = FRAME_HELLO;
+        reply->flags = 0;
+        reply->length = HELLO_REPLY_SIZE;
+        return out;
+    }
+
+    if (f->type != FRAME_REQUEST)
+        return frame_error(reply, "expected REQUEST");
+    if (f->flags & ~FRAME_MORE)
+        return frame_error(reply, "unknown flags");
+    if ((f->flags & FRAME_MORE) && *version < PROTO_CHUNKED)
+        return frame_error(reply, "chunked bodies need version 2");
+
+    // a chunk of a streamed body is answered on its own, like any
+    // other request; one seen before comes out of the cache, not
+    // the munger, and one already being munged waits for that
+    if (cache == NULL || (out = rc_get(cache, payload, f->length, &len)) == NULL) {
+        if (flights != NULL)
+            out = co_run(flights, payload, f->length, &len, compute_response);
+        else
+            out = compute_response(payload, f->length, &len);
+        if (out == NULL)
+            return NULL;
     }
-    return request;
+    reply->type = FRAME_RESPONSE;
+    reply->flags = f->flags;
+    reply->length = len;
+    return out;
 }
 
 /**
-* This function crunches on a request, returning a response.
-* This is where all of the hard work happens.
+* This function works out a response the hard way, with
+* process_request, and with -C, keeps it for next time.
 * This function is thread-safe.
 */
 
-char *process_request(char *request, int *response_length) {
-    char *response = (char *) malloc(RESPONSE_SIZE*sizeof(char));
-    int   i,j;
+char *compute_response(char *request, int request_length, int *response_length) {
+    char *out;
 
-    // just do some mindless character munging here
+    if ((out = process_request(request, request_length, response_length)) != NULL &&
+        cache != NULL)
+        rc_put(cache, request, request_length, out, *response_length);
+    return out;
+}
 
-    for (i=0; i<RESPONSE_SIZE; i++)
-    response[i] = request[i%REQUEST_SIZE];
+/**
+* This function crunches on a request, returning a response from
+* the buffer pool (see buf_pool.h), to be given back with bp_free.
+* This is where all of the hard work happens.
+* This function is thread-safe.
+*/
 
-    for (j=0; j<NUM_LOOPS; j++) {
-        for (i=0; i<RESPONSE_SIZE; i++) {
-            char swap;
+char *process_request(char *request, int request_length, int *response_length) {
+    char *response = (char *) bp_alloc(request_length);
 
-            swap = response[((i+1)%RESPONSE_SIZE)];
-            response[((i+1)%RESPONSE_SIZE)] = response[i];
-            response[i] = swap;
-        }
-    }
-    *response_length = RESPONSE_SIZE;
+    if (response == NULL)
+        return NULL;
+
+    // just do some mindless character munging here
+    munge(kernel, request, response, request_length, num_loops);
+
+    *response_length = request_length;
     return response;
 }
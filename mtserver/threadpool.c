@@ -6,12 +6,70 @@
 
  // followed a tutorial na khrub
 
+#define _GNU_SOURCE	// for CPU affinity
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <string.h>
+#include <limits.h>
 
 #include "threadpool.h"
+#include "mpmc_ring.h"
+#include "ws_deque.h"
+#include "timer_wheel.h"
+
+#define WS_DEQUE_SIZE 256
+#define WORK_CACHE_SIZE 64	//work_t nodes a worker keeps to itself
+#define SPIN_MIN 16		//a spin budget never adapts below this
+#define TIMER_TICK_NS 1000000L	//timer wheel resolution, 1ms
+#define TIMER_CHUNK 1024	//timer records allocated at a time
+#define TIMER_NONE 0xffffffffu	//end of the timer freelist
+
+// tp_timer_rec.state, guarded by lock_t
+#define TIMER_FREE  0
+#define TIMER_ARMED 1	//on the wheel
+#define TIMER_FIRED 2	//handed to the pool to run
+#define WORK_HEAP 0xffffffffu	//slab_idx of a malloc'd work_t
+#define SLAB_EMPTY 0xffffffffu
+
+// counters and histograms one thread writes; others only read
+// them (threadpool_get_stats), so plain load+store is enough
+typedef struct tp_shard_st {
+	_Alignas(64) atomic_ulong dispatched;
+	atomic_ulong completed;
+	atomic_int busy;
+	atomic_ulong wait_hist[TP_HIST_BUCKETS];
+	atomic_ulong run_hist[TP_HIST_BUCKETS];
+} tp_shard;
+
+struct _threadpool_st;
+
+// a dispatch_after/dispatch_every timer.  Records never move, and
+// a tp_timer_id names one by index and generation, so cancelling
+// a timer that already fired and was reused is harmless
+typedef struct tp_timer_rec_st {
+	tw_timer node;		//must come first
+	struct _threadpool_st *pool;
+	dispatch_fn fn;
+	void *arg;
+	unsigned long period;	//ticks; 0 = one-shot
+	unsigned int idx;
+	unsigned int gen;	//bumped whenever the record is freed
+	int state;		//TIMER_*
+	int cancelled;		//stop re-arming once it has run
+	unsigned int free_next;
+} tp_timer_rec;
+
+// tp_worker.state, guarded by lock_q
+#define SLOT_EMPTY   0	//no thread
+#define SLOT_RUNNING 1
+#define SLOT_RETIRED 2	//thread retired, waiting to be joined
 
 // _threadpool is the internal threadpool structure that is
 // cast to type "threadpool" before it given out to callers
@@ -20,176 +78,2304 @@ typedef struct work_st{
 	void (*routine) (void*);
 	void * arg;
 	struct work_st* next;
+	long enq_ns;		//when it was queued
+	unsigned int slab_idx;	//index in pool->slab, or WORK_HEAP
+	atomic_uint free_next;	//freelist link while the node is unused
 } work_t;
 
+typedef struct tp_worker_st {
+	ws_deque deque;		//TP_SCHED_STEAL: tasks this worker dispatched
+	struct _threadpool_st *pool;
+	pthread_t thread;
+	int state;		//SLOT_*
+	int id;
+	unsigned int seed;	//picks steal victims
+	int pinned;		//run only on "cpus"
+	cpu_set_t cpus;
+	int spin;		//current spin budget
+	int ncached;
+	work_t *cache[WORK_CACHE_SIZE];	//free work_t nodes, ours alone
+	unsigned long slab_hits;	//allocations served from cache
+	tp_shard stats;
+} tp_worker;
+
+// one FIFO of the shared queue per priority level
+typedef struct tp_level_st {
+	work_t* head;	//TP_QUEUE_LIST, under lock_q
+	work_t* tail;
+	int size;
+	mpmc_ring *ring;	//TP_QUEUE_RING
+	atomic_int credits;	//TP_PRIO_WEIGHTED: turns left this round
+	atomic_int skipped;	//times passed over while non-empty
+	atomic_ulong dispatched;
+	atomic_ulong peak;	//deepest it has been
+} tp_level;
+
 typedef struct _threadpool_st {
-	//we'll be using queue for this
-   // you should fill in this structure with whatever you need
-	int threads_act; //active threads
-	int size;			//queue size
-	pthread_t *threads;
-	work_t* head;	//queue head
-	work_t* tail;		//queue tail
+	atomic_int threads_act; //active threads
+	int threads_max;	//slots in workers[]
+	int threads_min;
+	int elastic;
+	int keepalive_ms;
+	int grow_depth;
+	long grow_wait_ns;
+	int queue_type;		//TP_QUEUE_LIST or TP_QUEUE_RING
+	int sched;		//TP_SCHED_FIFO or TP_SCHED_STEAL
+	tp_worker *workers;
+
+	// the shared queue: a FIFO per priority level.  For
+	// TP_QUEUE_LIST they and everything below are guarded by
+	// lock_q; TP_QUEUE_RING levels are lock-free, and lock_q
+	// only parks sleepers
+	tp_level levels[TP_MAX_PRIO];
+	int nlevels;
+	int prio_sched;		//TP_PRIO_STRICT or TP_PRIO_WEIGHTED
+	int aging;		//times a level may be passed over, 0 = forever
+	int default_prio;	//level plain dispatch uses
+	atomic_int size;		//queue size, all levels (TP_QUEUE_LIST);
+					//spinning workers peek at it unlocked
+	int rem_threads; //threads neither running nor promised a task
+	int capacity;		//max queued tasks, 0 = bounded by rem_threads
+
+	// work_t slab; the shared freelist is a Treiber stack of slab
+	// indexes whose head carries a tag in the top 32 bits, so a
+	// node popped and pushed back in between can't fool the CAS
+	work_t *slab;
+	unsigned int slab_size;
+	atomic_ulong free_head;
+	atomic_ulong slab_hits;	//allocations served from the shared stack
+	atomic_ulong heap_allocs;
+
 	pthread_mutex_t lock_q;	//queue lock
-	pthread_cond_t non_empt_q; //check queue empty
-	pthread_cond_t empt_q; //check queue empty
-	int shutdown;
-	int reject;
-	int rem_threads; //remaning threads
+	pthread_cond_t non_empt_q; //workers sleep here while queue is empty
+	pthread_cond_t empt_q; //dispatchers sleep here while queue is full
+	atomic_int sleepers;	//workers waiting on non_empt_q
+	atomic_int full_waiters;	//dispatchers waiting on empt_q
+	atomic_int spinners;	//spinning workers no dispatcher has claimed
+	int spin_max;
+	int overload;		//TP_OVERLOAD_*
+	int block_timeout_ms;
+	dispatch_fn on_drop;
+	atomic_ulong dropped;	//tasks discarded without running
+	atomic_ulong peak_depth;	//shared queue high-water mark
+	tp_shard ext_stats;	//for threads outside the pool, shared
+	atomic_long outstanding;	//tasks taken but not yet finished or dropped
+	atomic_int all_waiters;	//threads in threadpool_wait_all
+	pthread_cond_t all_done;	//outstanding reached 0
+	// timers; the wheel and the records are guarded by lock_t,
+	// and the workers take turns driving it
+	pthread_mutex_t lock_t;
+	timer_wheel wheel;
+	long timer_epoch;	//now_ns() at tick 0
+	tp_timer_rec **timer_chunks;
+	int ntimer_chunks;
+	unsigned int timer_free;
+	atomic_long timers_armed;	//on the wheel
+	atomic_ulong timer_due;	//tick by which the wheel needs advancing
+	int timer_keeper;	//a parked worker is timing the wheel (lock_q)
+
+	atomic_int shutdown;	//workers quit after their current task
+	atomic_int reject;	//dispatch from outside fails
+	atomic_int submitters;	//threads inside submit, dispatch_batch or
+				//timer_add; shutdown frees nothing until 0
 } _threadpool;
 
-/* This function is the work function of the thread */
-void* worker_thread(threadpool p) {
-	_threadpool * pool = (_threadpool *) p;
-	work_t* cur;
+// the worker running on this thread, or NULL outside any pool
+static __thread tp_worker *self;
 
-	while(1) {
-		// wait for a signal
-		// l
-		// mark itself as busy
-		// run a given function
-		//
+void threadpool_attr_init(threadpool_attr *attr) {
+  attr->queue_type = TP_QUEUE_LIST;
+  attr->queue_capacity = 0;
+  attr->overload = TP_OVERLOAD_BLOCK;
+  attr->block_timeout_ms = 0;
+  attr->on_drop = NULL;
+  attr->min_threads = 0;
+  attr->max_threads = 0;
+  attr->keepalive_ms = TP_DEFAULT_KEEPALIVE_MS;
+  attr->grow_depth = TP_DEFAULT_GROW_DEPTH;
+  attr->grow_wait_us = TP_DEFAULT_GROW_WAIT_US;
+  attr->priority_levels = 1;
+  attr->prio_sched = TP_PRIO_STRICT;
+  attr->aging = TP_DEFAULT_AGING;
+  attr->default_prio = 0;
+  attr->placement = TP_PLACE_NONE;
+  attr->cpus = NULL;
+  attr->ncpus = 0;
+  attr->numa_node = 0;
+  attr->spin = TP_DEFAULT_SPIN;
+  attr->sched = TP_SCHED_FIFO;
+  attr->slab_size = TP_DEFAULT_SLAB_SIZE;
+}
 
-		pool->size = pool->size;
-		pthread_mutex_lock(&(pool->lock_q));
+/* push the chain first..last (linked by free_next) on the shared freelist */
+static void slab_push_chain(_threadpool *pool, work_t *first, work_t *last) {
+	unsigned long old, new;
+
+	old = atomic_load(&pool->free_head);
+	do {
+		atomic_store_explicit(&last->free_next, (unsigned int) old,
+				      memory_order_relaxed);
+		new = ((old >> 32) + 1) << 32 | first->slab_idx;
+	} while (!atomic_compare_exchange_weak(&pool->free_head, &old, new));
+}
+
+static work_t *slab_pop(_threadpool *pool) {
+	unsigned long old, new;
+	unsigned int idx;
+
+	old = atomic_load(&pool->free_head);
+	do {
+		idx = (unsigned int) old;
+		if (idx == SLAB_EMPTY) return NULL;
+		new = ((old >> 32) + 1) << 32 |
+		      atomic_load_explicit(&pool->slab[idx].free_next,
+					   memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak(&pool->free_head, &old, new));
+	return &pool->slab[idx];
+}
+
+/* get a work_t: worker cache, then the shared slab, then malloc */
+static work_t *work_alloc(_threadpool *pool) {
+	tp_worker *me = (self != NULL && self->pool == pool) ? self : NULL;
+	work_t *cur;
+
+	if (me != NULL && me->ncached > 0) {
+		me->slab_hits++;
+		return me->cache[--me->ncached];
+	}
+	if ((cur = slab_pop(pool)) != NULL) {
+		atomic_fetch_add_explicit(&pool->slab_hits, 1, memory_order_relaxed);
+		return cur;
+	}
+
+	cur = (work_t*) malloc(sizeof(work_t));
+	if (cur == NULL) return NULL;
+	cur->slab_idx = WORK_HEAP;
+	atomic_fetch_add_explicit(&pool->heap_allocs, 1, memory_order_relaxed);
+	return cur;
+}
+
+static void work_free(_threadpool *pool, work_t *cur) {
+	tp_worker *me = (self != NULL && self->pool == pool) ? self : NULL;
+	int i;
 
-		if (pool->size == 0){
-			pthread_cond_wait(&(pool->non_empt_q), &(pool->lock_q));
+	if (cur->slab_idx == WORK_HEAP) {
+		free(cur);
+		return;
+	}
+	if (me == NULL) {
+		slab_push_chain(pool, cur, cur);
+		return;
+	}
+
+	if (me->ncached == WORK_CACHE_SIZE) {
+		// full: hand half of it back in a single CAS
+		for (i = WORK_CACHE_SIZE / 2; i < WORK_CACHE_SIZE - 1; i++)
+			atomic_store_explicit(&me->cache[i]->free_next,
+					      me->cache[i + 1]->slab_idx,
+					      memory_order_relaxed);
+		slab_push_chain(pool, me->cache[WORK_CACHE_SIZE / 2],
+				me->cache[WORK_CACHE_SIZE - 1]);
+		me->ncached = WORK_CACHE_SIZE / 2;
+	}
+	me->cache[me->ncached++] = cur;
+}
+
+/* pops the head of one level; lock_q must be held for TP_QUEUE_LIST */
+static work_t *level_take(_threadpool *pool, int l) {
+	tp_level *lv = &pool->levels[l];
+	work_t *cur;
+
+	if (pool->queue_type == TP_QUEUE_RING)
+		return (work_t *) ring_pop(lv->ring);
+
+	cur = lv->head;
+	if (cur == NULL) return NULL;
+
+	lv->size--;
+	pool->size--;
+	if(lv->size == 0) {
+		lv->head = NULL;
+		lv->tail = NULL;
+	}
+	else lv->head = cur->next;
+	return cur;
+}
+
+static long level_depth(_threadpool *pool, int l) {
+	if (pool->queue_type == TP_QUEUE_RING)
+		return (long) ring_count(pool->levels[l].ring);
+	return pool->levels[l].size;
+}
+
+/* level "l" was just served: every busier level below it was passed over */
+static void note_served(_threadpool *pool, int l) {
+	int m;
+
+	atomic_store_explicit(&pool->levels[l].skipped, 0, memory_order_relaxed);
+	for (m = l + 1; m < pool->nlevels; m++)
+		if (level_depth(pool, m) > 0)
+			atomic_fetch_add_explicit(&pool->levels[m].skipped, 1,
+						  memory_order_relaxed);
+}
+
+/**
+ * pops the next task across the priority levels; lock_q must be
+ * held for TP_QUEUE_LIST.  A level passed over "aging" times goes
+ * first; otherwise TP_PRIO_STRICT always serves the highest
+ * non-empty level and TP_PRIO_WEIGHTED gives level l up to
+ * 2^(nlevels-1-l) turns per round.  For rings the bookkeeping is
+ * racy, so the shares are only approximate.
+ */
+static work_t *queue_take(_threadpool *pool) {
+	work_t *cur;
+	int l, pass;
+
+	if (pool->nlevels == 1)
+		return level_take(pool, 0);
+
+	if (pool->aging > 0) {
+		for (l = pool->nlevels - 1; l > 0; l--) {
+			if (atomic_load_explicit(&pool->levels[l].skipped,
+						 memory_order_relaxed) >= pool->aging &&
+			    (cur = level_take(pool, l)) != NULL) {
+				note_served(pool, l);
+				return cur;
+			}
 		}
+	}
 
+	if (pool->prio_sched == TP_PRIO_STRICT) {
+		for (l = 0; l < pool->nlevels; l++) {
+			if ((cur = level_take(pool, l)) != NULL) {
+				note_served(pool, l);
+				return cur;
+			}
+		}
+		return NULL;
+	}
 
-		while( pool->size == 0) {
-			if(pool->shutdown) {
-				pthread_mutex_unlock(&(pool->lock_q));
-				pthread_exit(NULL);
+	for (pass = 0; pass < 2; pass++) {
+		for (l = 0; l < pool->nlevels; l++) {
+			if (atomic_load_explicit(&pool->levels[l].credits,
+						 memory_order_relaxed) <= 0)
+				continue;
+			if ((cur = level_take(pool, l)) != NULL) {
+				atomic_fetch_sub_explicit(&pool->levels[l].credits, 1,
+							  memory_order_relaxed);
+				note_served(pool, l);
+				return cur;
 			}
 		}
+		// every level with work has used its turns: new round
+		for (l = 0; l < pool->nlevels; l++)
+			atomic_store_explicit(&pool->levels[l].credits,
+					      1 << (pool->nlevels - 1 - l),
+					      memory_order_relaxed);
+	}
+	return NULL;
+}
 
-		pthread_mutex_unlock(&(pool->lock_q));
+static long queue_depth(_threadpool *pool);
 
-		cur = pool->head;
+/* a task just went into level "l"; keep its high-water mark */
+static void note_queued(_threadpool *pool, int l, long n) {
+	tp_level *lv = &pool->levels[l];
+	long depth = level_depth(pool, l);
 
-		pool->size--;
-		pool->rem_threads++;
+	atomic_fetch_add_explicit(&lv->dispatched, n, memory_order_relaxed);
+	if ((unsigned long) depth > atomic_load_explicit(&lv->peak, memory_order_relaxed))
+		atomic_store_explicit(&lv->peak, depth, memory_order_relaxed);
+	depth = pool->nlevels > 1 ? queue_depth(pool) : depth;
+	if ((unsigned long) depth > atomic_load_explicit(&pool->peak_depth, memory_order_relaxed))
+		atomic_store_explicit(&pool->peak_depth, depth, memory_order_relaxed);
+}
 
-		if(pool->size == 0) {
-			pool->head = NULL;
-			pool->tail = NULL;
-		}
-		else pool->head = cur->next;
+/* the shard the calling thread may write: its own, or the shared one */
+static tp_shard *my_shard(_threadpool *pool) {
+	return (self != NULL && self->pool == pool) ? &self->stats : &pool->ext_stats;
+}
+
+static void shard_add(_threadpool *pool, tp_shard *sh, atomic_ulong *c,
+		      unsigned long n) {
+	if (sh == &pool->ext_stats)
+		atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+	else
+		atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+				      memory_order_relaxed);
+}
+
+static void shard_init(tp_shard *sh) {
+	int b;
+
+	atomic_init(&sh->dispatched, 0);
+	atomic_init(&sh->completed, 0);
+	atomic_init(&sh->busy, 0);
+	for (b = 0; b < TP_HIST_BUCKETS; b++) {
+		atomic_init(&sh->wait_hist[b], 0);
+		atomic_init(&sh->run_hist[b], 0);
+	}
+}
+
+static int hist_bucket(long ns) {
+	int b;
+
+	if (ns <= 0) return 0;
+	b = 64 - __builtin_clzl((unsigned long) ns);
+	return b < TP_HIST_BUCKETS ? b : TP_HIST_BUCKETS - 1;
+}
 
-		if(pool->size == 0 && ! pool->shutdown) pthread_cond_signal(&(pool->empt_q));
+static long now_ns(void);
+static void deadline_after_ns(clockid_t clock, long ns, struct timespec *ts);
+
+/**
+ * Run one task, timing how long it waited and how long it ran.
+ * The caller still frees "cur".
+ */
+static void run_work(_threadpool *pool, work_t *cur) {
+	tp_shard *sh = my_shard(pool);
+	long start, end;
+
+	start = now_ns();
+	shard_add(pool, sh, &sh->wait_hist[hist_bucket(start - cur->enq_ns)], 1);
+	// counted, not flagged: a task run in place inside another, or
+	// several callers sharing ext_stats, each count once
+	atomic_fetch_add_explicit(&sh->busy, 1, memory_order_relaxed);
+	(cur->routine) (cur->arg);
+	atomic_fetch_sub_explicit(&sh->busy, 1, memory_order_relaxed);
+	end = now_ns();
+	shard_add(pool, sh, &sh->run_hist[hist_bucket(end - start)], 1);
+	shard_add(pool, sh, &sh->completed, 1);
+}
+
+struct tp_task_st {
+	task_fn fn;
+	void *arg;
+	void *result;
+	atomic_int state;	//0 pending, 1 done, -1 dropped
+	atomic_int refs;	//the pool's and the caller's
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static void run_task(void *t);
+static void pf_run(void *n);
+static void dag_run(void *n);
+static void dag_drop(tp_dag_node *node);
+static void timer_fire(void *r);
+static void *timer_drop(tp_timer_rec *rec);
+static int submit(_threadpool *pool, dispatch_fn dispatch_to_here, void *arg,
+		  int prio, int nonblock);
+
+/* "n" tasks finished or were dropped; wake threadpool_wait_all */
+static void tasks_finished(_threadpool *pool, long n) {
+	if (atomic_fetch_sub(&pool->outstanding, n) == n &&
+	    atomic_load(&pool->all_waiters) > 0) {
+		pthread_mutex_lock(&(pool->lock_q));
+		pthread_cond_broadcast(&(pool->all_done));
 		pthread_mutex_unlock(&(pool->lock_q));
+	}
+}
+
+/* publish a handle's outcome and drop the pool's reference */
+static void task_complete(tp_task *task, void *result, int state) {
+	pthread_mutex_lock(&task->lock);
+	task->result = result;
+	atomic_store(&task->state, state);
+	pthread_cond_broadcast(&task->done);
+	pthread_mutex_unlock(&task->lock);
+	task_release(task);
+}
+
+/* hand a task we won't run back to its owner */
+static void drop_work(_threadpool *pool, work_t *cur) {
+	tp_task *task;
+	void *arg = cur->arg;
+
+	if (cur->routine == pf_run) {
+		// someone is waiting for every piece of a parallel loop
 		(cur->routine) (cur->arg);
+		work_free(pool, cur);
+		tasks_finished(pool, 1);
+		return;
+	}
+	if (cur->routine == dag_run) {
+		// its successors are dropped along with it
+		dag_drop((tp_dag_node *) arg);
+		atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+		work_free(pool, cur);
+		tasks_finished(pool, 1);
+		return;
+	}
+	if (cur->routine == timer_fire)
+		arg = timer_drop((tp_timer_rec *) arg);
+	if (cur->routine == run_task) {
+		// the owner of a handle task is whoever waits on it
+		task = (tp_task *) cur->arg;
+		if (pool->on_drop != NULL)
+			(pool->on_drop) (task->arg);
+		task_complete(task, NULL, -1);
+	} else if (pool->on_drop != NULL)
+		(pool->on_drop) (arg);
+	atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+	work_free(pool, cur);
+	tasks_finished(pool, 1);
+}
+
+/**
+ * Claim up to "n" spinning workers for tasks just queued, and
+ * return how many we got.  A spinner takes one task, so each
+ * claim covers one; spin_for_work settles up with the claims
+ * when it stops spinning.
+ */
+static int claim_spinners(_threadpool *pool, int n) {
+	int s = atomic_load(&pool->spinners);
+
+	while (s > 0 && !atomic_compare_exchange_weak(&pool->spinners, &s,
+						      s - (s < n ? s : n)))
+		;
+	return s > 0 ? (s < n ? s : n) : 0;
+}
+
+/**
+ * Wake one parked worker, but only pay for it if one is parked
+ * and no spinner is free to claim: a claimed spinner sees the new
+ * task, or, if it gives up first, looks for it before parking.
+ */
+static void wake_sleeper(_threadpool *pool) {
+	atomic_thread_fence(memory_order_seq_cst);
+	if (claim_spinners(pool, 1) == 0 && atomic_load(&pool->sleepers) > 0) {
 		pthread_mutex_lock(&(pool->lock_q));
+		pthread_cond_signal(&(pool->non_empt_q));
+		pthread_mutex_unlock(&(pool->lock_q));
+	}
+}
 
-		free(cur);
+static long now_ns(void) {
+	struct timespec ts;
 
-		if (pool->rem_threads == 1){
-			pthread_mutex_unlock(&(pool->lock_q));
-			pthread_cond_signal(&(pool->empt_q));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* tasks waiting in the shared queue; lock_q held for TP_QUEUE_LIST */
+static long queue_depth(_threadpool *pool) {
+	long depth = 0;
+	int l;
+
+	if (pool->queue_type == TP_QUEUE_LIST)
+		return pool->size;
+	for (l = 0; l < pool->nlevels; l++)
+		depth += level_depth(pool, l);
+	return depth;
+}
+
+void* worker_thread(void *w);
+
+/**
+ * Elastic pools: start one more worker, in the first free slot.
+ * lock_q must be held.  Returns 0, or -1 if the pool is at its
+ * maximum or the thread couldn't be created.
+ */
+static int spawn_worker(_threadpool *pool) {
+	tp_worker *w = NULL;
+	pthread_attr_t tattr;
+	int i;
+
+	if (pool->shutdown || atomic_load(&pool->threads_act) >= pool->threads_max)
+		return -1;
+
+	for (i = 0; i < pool->threads_max; i++) {
+		if (pool->workers[i].state == SLOT_RETIRED) {
+			pthread_join(pool->workers[i].thread, NULL);
+			pool->workers[i].state = SLOT_EMPTY;
+		}
+		if (pool->workers[i].state == SLOT_EMPTY) {
+			w = &pool->workers[i];
+			break;
 		}
-		else pthread_mutex_unlock(&(pool->lock_q));
 	}
+	if (w == NULL) return -1;
+
+	// pin before the thread exists, so even its stack is touched
+	// on the right node
+	pthread_attr_init(&tattr);
+	if (w->pinned)
+		pthread_attr_setaffinity_np(&tattr, sizeof(cpu_set_t), &w->cpus);
+	if (pthread_create(&w->thread, &tattr, worker_thread, w)) {
+		pthread_attr_destroy(&tattr);
+		fprintf(stderr, "Thread couldn't initialize\n");
+		return -1;
+	}
+	pthread_attr_destroy(&tattr);
+	w->state = SLOT_RUNNING;
+	atomic_fetch_add(&pool->threads_act, 1);
+	pool->rem_threads++;
+	return 0;
 }
 
-threadpool create_threadpool(int num_threads_in_pool) {
-  _threadpool *pool;
+/**
+ * Elastic pools: add a worker if nobody is idle and the queue is
+ * backing up.  "waited_ns" is how long the task just dequeued
+ * sat in the queue, or 0.  lock_q must be held when "locked".
+ */
+static void maybe_grow(_threadpool *pool, long waited_ns, int locked) {
+	long depth;
 
-  if ((num_threads_in_pool <= 0) || (num_threads_in_pool > MAXT_IN_POOL)) return NULL;
+	if (!pool->elastic || atomic_load(&pool->sleepers) > 0 ||
+	    atomic_load(&pool->threads_act) >= pool->threads_max)
+		return;
 
-  pool = (_threadpool *) malloc(sizeof(_threadpool));
-  if (pool == NULL) {
-    fprintf(stderr, "Cant create threadpool\n");
-    return NULL;
-  }
+	// the list's depth can only be read under lock_q
+	depth = (locked || pool->queue_type == TP_QUEUE_RING) ? queue_depth(pool) : 0;
+	if (depth < pool->grow_depth &&
+	    (pool->grow_wait_ns == 0 || waited_ns < pool->grow_wait_ns))
+		return;
 
-  pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads_in_pool);
+	if (!locked) pthread_mutex_lock(&(pool->lock_q));
+	if (atomic_load(&pool->sleepers) == 0)
+		spawn_worker(pool);
+	if (!locked) pthread_mutex_unlock(&(pool->lock_q));
+}
 
-  if (!pool->threads){
-    fprintf(stderr, "Cant create threadpool\n");
-    return NULL;
-  }
+/* a retiring worker gives its cached work_t nodes back */
+static void flush_cache(tp_worker *me) {
+	int i;
 
-  pool->head = NULL;
-  pool->tail = NULL;
-  pool->size = 0;
-  pool->reject = 0;
-  pool->shutdown  = 0;
-  pool->threads_act = num_threads_in_pool;
-  pool->rem_threads = num_threads_in_pool;
+	if (me->ncached == 0) return;
+	for (i = 0; i < me->ncached - 1; i++)
+		atomic_store_explicit(&me->cache[i]->free_next,
+				      me->cache[i + 1]->slab_idx,
+				      memory_order_relaxed);
+	slab_push_chain(me->pool, me->cache[0], me->cache[me->ncached - 1]);
+	me->ncached = 0;
+}
 
-  if (pthread_cond_init(&pool->empt_q, NULL)){
-    fprintf(stderr, "CV initiation error\n");
-    return NULL;
-  }
-  if (pthread_mutex_init(&pool->lock_q, NULL)){
-    fprintf(stderr, "Mutex error\n");
-    return NULL;
-  }
-  if (pthread_cond_init(&pool->non_empt_q, NULL)){
-    fprintf(stderr, "CV initiation error\n");
-    return NULL;
-  }
+/* wake up to "n" parked workers with a single trip through lock_q */
+static void wake_sleepers(_threadpool *pool, int n) {
+	int i;
 
-  for (int i = 0; i < pool->threads_act;i++){
-    if (pthread_create(&(pool->threads[i]), NULL, worker_thread, pool)){
-      fprintf(stderr, "Thread couldn't initialize\n");
-      return NULL;
-    }
-  }
-  return (threadpool) pool;
+	atomic_thread_fence(memory_order_seq_cst);
+	n -= claim_spinners(pool, n);
+	if (n <= 0 || atomic_load(&pool->sleepers) == 0) return;
+
+	pthread_mutex_lock(&(pool->lock_q));
+	if (n >= atomic_load(&pool->sleepers))
+		pthread_cond_broadcast(&(pool->non_empt_q));
+	else
+		for (i = 0; i < n; i++)
+			pthread_cond_signal(&(pool->non_empt_q));
+	pthread_mutex_unlock(&(pool->lock_q));
 }
 
+/* TP_SCHED_STEAL: try a round of random victims */
+static work_t *steal_work(tp_worker *me) {
+	_threadpool *pool = me->pool;
+	tp_worker *victim;
+	work_t *cur;
+	int i;
 
-void dispatch(threadpool from_me, dispatch_fn dispatch_to_here, void *arg) {
-  _threadpool *pool = (_threadpool *) from_me;
+	for (i = 0; i < pool->threads_max; i++) {
+		victim = &pool->workers[rand_r(&me->seed) % pool->threads_max];
+		if (victim == me) continue;
+		if ((cur = (work_t *) deque_steal(&victim->deque)) != NULL)
+			return cur;
+	}
+	return NULL;
+}
 
-	// add your code here to dispatch a thread
-	work_t *cur;
+/* TP_SCHED_STEAL: does any worker have something left to steal? */
+static int stealable(_threadpool *pool) {
+	int i;
 
-	//make a work queue element.
-	cur = (work_t*) malloc(sizeof(work_t));
-	if(cur == NULL) {
-		fprintf(stderr, "Out of memory creating a work struct!\n");
-		return;
+	for (i = 0; i < pool->threads_max; i++)
+		if (deque_count(&pool->workers[i].deque) > 0) return 1;
+	return 0;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/* is there anything a spinning worker could pick up? */
+static int work_visible(_threadpool *pool) {
+	int l;
+
+	if (pool->queue_type == TP_QUEUE_LIST) {
+		if (atomic_load_explicit(&pool->size, memory_order_relaxed) > 0)
+			return 1;
+	} else {
+		for (l = 0; l < pool->nlevels; l++)
+			if (ring_count(pool->levels[l].ring) > 0) return 1;
 	}
+	return pool->sched == TP_SCHED_STEAL && stealable(pool);
+}
 
-	cur->routine = dispatch_to_here;
-	cur->arg = arg;
-	cur->next = NULL;
+/**
+ * Spin on the queue for up to me->spin pauses before parking.
+ * Returns 1 if work (or shutdown) showed up meanwhile, and
+ * adapts the budget to how that went.
+ */
+static int spin_for_work(tp_worker *me) {
+	_threadpool *pool = me->pool;
+	int i, s, found = 0;
 
-	pthread_mutex_lock(&(pool->lock_q));
+	if (me->spin == 0) return 0;
+	atomic_fetch_add(&pool->spinners, 1);
+	for (i = 1; i <= me->spin; i++) {
+		cpu_relax();
+		if ((i & 15) == 0 &&
+		    (work_visible(pool) || atomic_load(&pool->shutdown))) {
+			found = 1;
+			break;
+		}
+	}
+	// with no unclaimed spinner left to count down, one of the
+	// claims is ours: look for its task before parking
+	s = atomic_load(&pool->spinners);
+	while (s > 0 && !atomic_compare_exchange_weak(&pool->spinners, &s, s - 1))
+		;
+	if (s == 0)
+		found = 1;
 
-	if(pool->reject) {
-		free(cur);
-		return;
+	if (found)
+		me->spin = me->spin * 2 < pool->spin_max ? me->spin * 2 : pool->spin_max;
+	else
+		me->spin = me->spin / 2 > SPIN_MIN ? me->spin / 2 :
+			   (pool->spin_max < SPIN_MIN ? pool->spin_max : SPIN_MIN);
+	return found;
+}
+
+/**
+ * Find the next task for "me": its own deque first, then the
+ * shared queue, then other workers' deques.  Sets *from_queue
+ * when the task came off the shared queue.  Returns NULL only
+ * when there's nothing anywhere.
+ */
+static work_t *find_work(tp_worker *me, int *from_queue) {
+	_threadpool *pool = me->pool;
+	work_t *cur = NULL;
+
+	*from_queue = 0;
+	if (pool->sched == TP_SCHED_STEAL &&
+	    (cur = (work_t *) deque_take(&me->deque)) != NULL)
+		return cur;
+
+	if (pool->queue_type == TP_QUEUE_RING) {
+		cur = queue_take(pool);
+	} else if (pool->sched == TP_SCHED_STEAL) {
+		pthread_mutex_lock(&(pool->lock_q));
+		cur = queue_take(pool);
+		pthread_mutex_unlock(&(pool->lock_q));
 	}
-	if(pool->size == 0) {
-		pool->head = cur;
-		pool->tail = cur;
-	} else {
-		pool->tail->next = cur;
-		pool->tail = cur;
+	if (cur != NULL) {
+		*from_queue = 1;
+		return cur;
 	}
-	pool->size++;
-	pool->rem_threads--;
 
-	pthread_mutex_unlock(&(pool->lock_q));
-	pthread_cond_signal(&(pool->non_empt_q));
-	pthread_mutex_lock(&(pool->lock_q));
+	if (pool->sched == TP_SCHED_STEAL)
+		cur = steal_work(me);
+	return cur;
+}
+
+static unsigned long timer_now(_threadpool *pool) {
+	return (unsigned long) ((now_ns() - pool->timer_epoch) / TIMER_TICK_NS);
+}
+
+/* has the wheel reached a tick that needs advancing? */
+static int timers_due(_threadpool *pool) {
+	return atomic_load_explicit(&pool->timers_armed, memory_order_relaxed) > 0 &&
+	       timer_now(pool) >= atomic_load(&pool->timer_due);
+}
+
+/* the wheel changed; lock_t held.  Returns 1 if it's due sooner */
+static int timer_update_due(_threadpool *pool) {
+	unsigned long due = pool->wheel.count > 0 ? tw_next_tick(&pool->wheel) : ULONG_MAX;
+	int sooner;
+
+	sooner = due < atomic_load(&pool->timer_due) ||
+		 atomic_load(&pool->timers_armed) == 0;
+	atomic_store(&pool->timer_due, due);
+	atomic_store(&pool->timers_armed, pool->wheel.count);
+	return sooner && pool->wheel.count > 0;
+}
+
+/**
+ * When the wheel next needs advancing, as a CLOCK_REALTIME
+ * deadline in "ts", unless "limit" comes first.  Returns 1 if
+ * the wheel's deadline is the one used.
+ */
+static int timer_deadline(_threadpool *pool, struct timespec *ts,
+			  const struct timespec *limit) {
+	long wait = pool->timer_epoch +
+		    (long) atomic_load(&pool->timer_due) * TIMER_TICK_NS - now_ns();
 
-	if (pool->rem_threads == 0) pthread_cond_wait(&(pool->empt_q), &(pool->lock_q));
+	deadline_after_ns(CLOCK_REALTIME, wait > 0 ? wait : 0, ts);
+	if (limit != NULL && (limit->tv_sec < ts->tv_sec ||
+	    (limit->tv_sec == ts->tv_sec && limit->tv_nsec < ts->tv_nsec))) {
+		*ts = *limit;
+		return 0;
+	}
+	return 1;
+}
+
+/* a timer is due sooner than the wheel's keeper thinks: tell it */
+static void timer_kick(_threadpool *pool) {
+	pthread_mutex_lock(&(pool->lock_q));
+	if (pool->timer_keeper)
+		pthread_cond_broadcast(&(pool->non_empt_q));
+	else if (atomic_load(&pool->sleepers) > 0)
+		pthread_cond_signal(&(pool->non_empt_q));	//to become keeper
 	pthread_mutex_unlock(&(pool->lock_q));
 }
 
-void destroy_threadpool(threadpool destroyme) {
-	_threadpool *pool = (_threadpool *) destroyme;
+/**
+ * Advance the wheel to now and hand whatever expired to the pool
+ * as tasks.  Only one thread drives the wheel at a time; anyone
+ * else finding it busy just carries on.
+ */
+static void run_timers(_threadpool *pool) {
+	tw_timer *t, *next;
 
-	// add your code here to kill a threadpool
-	free(pool->threads);
-	pthread_mutex_destroy(&(pool->lock_q));
-	pthread_cond_destroy(&(pool->non_empt_q));
-	pthread_cond_destroy(&(pool->empt_q));
-	return;
+	if (pthread_mutex_trylock(&pool->lock_t)) return;
+	t = tw_advance(&pool->wheel, timer_now(pool));
+	for (next = t; next != NULL; next = next->next)
+		((tp_timer_rec *) next)->state = TIMER_FIRED;
+	timer_update_due(pool);
+	pthread_mutex_unlock(&pool->lock_t);
+
+	// a fired record stays put until its task has run
+	for (; t != NULL; t = next) {
+		next = t->next;
+		if (submit(pool, timer_fire, t, pool->default_prio, 1) != TP_OK)
+			timer_fire(t);
+	}
+}
+
+/* return a record to the freelist; lock_t held */
+static void timer_rec_free(_threadpool *pool, tp_timer_rec *rec) {
+	rec->state = TIMER_FREE;
+	rec->gen++;
+	rec->free_next = pool->timer_free;
+	pool->timer_free = rec->idx;
+}
+
+static tp_timer_rec *timer_rec(_threadpool *pool, unsigned int idx) {
+	return &pool->timer_chunks[idx / TIMER_CHUNK][idx % TIMER_CHUNK];
+}
+
+static void timer_fire(void *r) {
+	tp_timer_rec *rec = (tp_timer_rec *) r;
+	_threadpool *pool = rec->pool;
+	int sooner = 0;
+
+	(rec->fn) (rec->arg);
+
+	pthread_mutex_lock(&pool->lock_t);
+	if (rec->period > 0 && !rec->cancelled) {
+		// keep to the original schedule, but skip runs we fell
+		// behind on instead of bunching them up
+		rec->node.expires += rec->period;
+		if ((long) (rec->node.expires - pool->wheel.now) <= 0)
+			rec->node.expires = pool->wheel.now + rec->period;
+		rec->state = TIMER_ARMED;
+		tw_add(&pool->wheel, &rec->node);
+		sooner = timer_update_due(pool);
+	} else
+		timer_rec_free(pool, rec);
+	pthread_mutex_unlock(&pool->lock_t);
+	if (sooner) timer_kick(pool);
+}
+
+/* a fired timer's task is being dropped: free it, return its arg */
+static void *timer_drop(tp_timer_rec *rec) {
+	_threadpool *pool = rec->pool;
+	void *arg = rec->arg;
+
+	pthread_mutex_lock(&pool->lock_t);
+	timer_rec_free(pool, rec);
+	pthread_mutex_unlock(&pool->lock_t);
+	return arg;
+}
+
+/* run a task we took, and free it; from_queue if it came off the shared queue */
+static void run_taken(_threadpool *pool, work_t *cur, int from_queue) {
+	// a slot just opened up in the queue
+	atomic_thread_fence(memory_order_seq_cst);
+	if (from_queue && atomic_load(&pool->full_waiters) > 0) {
+		pthread_mutex_lock(&(pool->lock_q));
+		pthread_cond_signal(&(pool->empt_q));
+		pthread_mutex_unlock(&(pool->lock_q));
+	}
+
+	run_work(pool, cur);
+	work_free(pool, cur);
+	tasks_finished(pool, 1);
+
+	if (from_queue && pool->queue_type == TP_QUEUE_LIST) {
+		// we're free again, let a blocked dispatcher through
+		pthread_mutex_lock(&(pool->lock_q));
+		pool->rem_threads++;
+		pthread_cond_signal(&(pool->empt_q));
+		pthread_mutex_unlock(&(pool->lock_q));
+	}
+}
+
+/**
+ * A thread waiting on the pool lends a hand: run one task from
+ * its own deque, the shared queue or another worker's deque.
+ * Returns 0 if there was nothing to run.
+ */
+static int help_once(_threadpool *pool) {
+	tp_worker *me = (self != NULL && self->pool == pool) ? self : NULL;
+	work_t *cur = NULL;
+	int from_queue = 0, i;
+
+	if (me != NULL && pool->sched == TP_SCHED_STEAL)
+		cur = (work_t *) deque_take(&me->deque);
+	if (cur == NULL) {
+		if (pool->queue_type == TP_QUEUE_LIST) pthread_mutex_lock(&(pool->lock_q));
+		cur = queue_take(pool);
+		if (pool->queue_type == TP_QUEUE_LIST) pthread_mutex_unlock(&(pool->lock_q));
+		from_queue = cur != NULL;
+	}
+	for (i = 0; cur == NULL && pool->sched == TP_SCHED_STEAL &&
+		    i < pool->threads_max; i++)
+		if (&pool->workers[i] != me)
+			cur = (work_t *) deque_steal(&pool->workers[i].deque);
+	if (cur == NULL) return 0;
+
+	run_taken(pool, cur, from_queue);
+	return 1;
+}
+
+/* This function is the work function of the thread */
+void* worker_thread(void *w) {
+	tp_worker *me = (tp_worker *) w;
+	_threadpool * pool = me->pool;
+	work_t* cur;
+	int from_queue, idle, keeper, timed;
+	struct timespec keepalive, deadline;
+
+	self = me;
+	if (atomic_load(&me->deque.array) == NULL &&
+	    deque_init(&me->deque, WS_DEQUE_SIZE)) {
+		fprintf(stderr, "Out of memory creating a worker deque!\n");
+		exit(-1);
+	}
+
+	while(1) {
+		if (atomic_load(&pool->shutdown)) pthread_exit(NULL);
+		if (timers_due(pool)) run_timers(pool);
+
+		// only an empty queue (and, when stealing, nothing to
+		// steal) sends us to sleep on non_empt_q
+		cur = find_work(me, &from_queue);
+
+		// a FIFO list is only taken from in the park loop below
+		if (cur == NULL && spin_for_work(me) &&
+		    !(pool->queue_type == TP_QUEUE_LIST && pool->sched == TP_SCHED_FIFO))
+			continue;
+
+		if (cur == NULL) {
+			idle = 0;
+			if (pool->elastic)
+				deadline_after_ns(CLOCK_REALTIME,
+						  (long) pool->keepalive_ms * 1000000, &keepalive);
+
+			pthread_mutex_lock(&(pool->lock_q));
+			atomic_fetch_add(&pool->sleepers, 1);
+			atomic_thread_fence(memory_order_seq_cst);
+			keeper = 0;
+			while ((cur = queue_take(pool)) == NULL && !pool->shutdown) {
+				if (pool->sched == TP_SCHED_STEAL && stealable(pool)) break;
+				if (timers_due(pool)) break;
+				if (idle && atomic_load(&pool->threads_act) > pool->threads_min) {
+					// nothing to do for a whole keepalive: retire
+					atomic_fetch_sub(&pool->sleepers, 1);
+					atomic_fetch_sub(&pool->threads_act, 1);
+					pool->rem_threads--;
+					me->state = SLOT_RETIRED;
+					flush_cache(me);
+					pthread_mutex_unlock(&(pool->lock_q));
+					pthread_exit(NULL);
+				}
+
+				// one sleeper keeps time for the wheel, the rest
+				// wait to be woken
+				keeper = !pool->timer_keeper && atomic_load(&pool->timers_armed) > 0;
+				timed = pool->elastic;
+				deadline = keepalive;
+				if (keeper) {
+					pool->timer_keeper = 1;
+					if (timer_deadline(pool, &deadline, timed ? &keepalive : NULL))
+						timed = 2;	//woken for the wheel, not for idling
+					else
+						timed = 1;
+				}
+				if (!timed)
+					pthread_cond_wait(&(pool->non_empt_q), &(pool->lock_q));
+				else if (pthread_cond_timedwait(&(pool->non_empt_q), &(pool->lock_q),
+								&deadline) == ETIMEDOUT && timed == 1)
+					idle = pool->elastic;
+				if (keeper) pool->timer_keeper = 0;
+			}
+			atomic_fetch_sub(&pool->sleepers, 1);
+			// off to work: hand the wheel to another sleeper
+			if (keeper && cur != NULL && atomic_load(&pool->timers_armed) > 0 &&
+			    atomic_load(&pool->sleepers) > 0)
+				pthread_cond_signal(&(pool->non_empt_q));
+			pthread_mutex_unlock(&(pool->lock_q));
+
+			if (cur == NULL) {
+				if (pool->shutdown) pthread_exit(NULL);
+				continue;	// go steal it
+			}
+			from_queue = 1;
+		}
+
+		if (from_queue && pool->elastic)
+			maybe_grow(pool, now_ns() - cur->enq_ns, 0);
+
+		run_taken(pool, cur, from_queue);
+	}
+}
+
+/* parse a sysfs CPU list like "0-3,8,10-11" into cpus[] */
+static int parse_cpulist(const char *list, int *cpus, int max) {
+	int n = 0, lo, hi, used;
+
+	while (sscanf(list, "%d%n", &lo, &used) == 1) {
+		list += used;
+		hi = lo;
+		if (*list == '-' && sscanf(list + 1, "%d%n", &hi, &used) == 1)
+			list += used + 1;
+		for (; lo <= hi && n < max; lo++)
+			cpus[n++] = lo;
+		if (*list != ',') break;
+		list++;
+	}
+	return n;
+}
+
+int threadpool_numa_nodes(void) {
+	char path[64];
+	int n = 0;
+
+	while (1) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", n);
+		if (access(path, F_OK) != 0) break;
+		n++;
+	}
+	return n > 0 ? n : 1;
+}
+
+int threadpool_node_cpus(int node, int *cpus, int max) {
+	char path[64], buf[4096];
+	FILE *f;
+	int n = 0, i, online;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if ((f = fopen(path, "r")) != NULL) {
+		if (fgets(buf, sizeof(buf), f) != NULL)
+			n = parse_cpulist(buf, cpus, max);
+		fclose(f);
+		return n;
+	}
+
+	// no NUMA information: one node with every CPU on it
+	if (node != 0) return 0;
+	online = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < online && i < max; i++)
+		cpus[i] = i;
+	return i;
+}
+
+/* work out the CPUs slot "w" may run on, per attr->placement */
+static int place_worker(tp_worker *w, const threadpool_attr *attr) {
+	int cpus[CPU_SETSIZE], n, i, node;
+
+	w->pinned = 0;
+	CPU_ZERO(&w->cpus);
+
+	switch (attr->placement) {
+	case TP_PLACE_NONE:
+		return 0;
+	case TP_PLACE_PIN:
+		if (attr->cpus != NULL && attr->ncpus > 0) {
+			CPU_SET(attr->cpus[w->id % attr->ncpus], &w->cpus);
+		} else {
+			n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+			CPU_SET(w->id % (n > 0 ? n : 1), &w->cpus);
+		}
+		break;
+	case TP_PLACE_SPREAD:
+	case TP_PLACE_NODE:
+		node = attr->placement == TP_PLACE_NODE ? attr->numa_node :
+		       w->id % threadpool_numa_nodes();
+		if ((n = threadpool_node_cpus(node, cpus, CPU_SETSIZE)) == 0)
+			return -1;
+		for (i = 0; i < n; i++)
+			CPU_SET(cpus[i], &w->cpus);
+		break;
+	default:
+		return -1;
+	}
+	w->pinned = 1;
+	return 0;
+}
+
+threadpool create_threadpool(int num_threads_in_pool) {
+  return create_threadpool_attr(num_threads_in_pool, NULL);
+}
+
+threadpool create_threadpool_attr(int num_threads_in_pool,
+				  const threadpool_attr *attr) {
+  _threadpool *pool;
+  threadpool_attr defaults;
+  int i, l, nsync = 0;
+
+  if ((num_threads_in_pool <= 0) || (num_threads_in_pool > MAXT_IN_POOL)) return NULL;
+
+  if (attr == NULL) {
+    threadpool_attr_init(&defaults);
+    attr = &defaults;
+  }
+  if (attr->max_threads < 0 || attr->max_threads > MAXT_IN_POOL)
+    return NULL;
+  if (attr->priority_levels < 1 || attr->priority_levels > TP_MAX_PRIO)
+    return NULL;
+  if (attr->queue_type != TP_QUEUE_LIST && attr->queue_type != TP_QUEUE_RING)
+    return NULL;
+  if (attr->sched != TP_SCHED_FIFO && attr->sched != TP_SCHED_STEAL)
+    return NULL;
+  if (attr->overload < TP_OVERLOAD_BLOCK ||
+      attr->overload > TP_OVERLOAD_DROP_OLDEST || attr->queue_capacity < 0)
+    return NULL;
+
+  // ext_stats sits on a cache line of its own
+  if (posix_memalign((void **) &pool, 64, sizeof(_threadpool))) {
+    fprintf(stderr, "Cant create threadpool\n");
+    return NULL;
+  }
+  // whatever "fail" gives back starts out empty
+  pool->workers = NULL;
+  pool->slab = NULL;
+  for (l = 0; l < TP_MAX_PRIO; l++)
+    pool->levels[l].ring = NULL;
+  pool->timer_chunks = NULL;
+  pool->ntimer_chunks = 0;
+
+  // the deques inside are cache-line aligned
+  pool->elastic = attr->max_threads > num_threads_in_pool;
+  pool->threads_max = pool->elastic ? attr->max_threads : num_threads_in_pool;
+  pool->threads_min = attr->min_threads > 0 ? attr->min_threads : 1;
+  if (pool->threads_min > num_threads_in_pool)
+    pool->threads_min = num_threads_in_pool;
+  pool->keepalive_ms = attr->keepalive_ms > 0 ? attr->keepalive_ms :
+                       TP_DEFAULT_KEEPALIVE_MS;
+  pool->grow_depth = attr->grow_depth > 0 ? attr->grow_depth : 1;
+  pool->grow_wait_ns = (long) attr->grow_wait_us * 1000;
+
+  if (posix_memalign((void **) &pool->workers, 64,
+                     sizeof(tp_worker) * pool->threads_max)) {
+    pool->workers = NULL;
+    goto fail;
+  }
+  for (i = 0; i < pool->threads_max; i++) {
+    pool->workers[i].state = SLOT_EMPTY;
+    deque_init_empty(&pool->workers[i].deque);
+  }
+
+  pool->slab_size = attr->slab_size > 0 ? attr->slab_size : 0;
+  atomic_init(&pool->free_head, SLAB_EMPTY);
+  atomic_init(&pool->slab_hits, 0);
+  atomic_init(&pool->heap_allocs, 0);
+  if (pool->slab_size > 0) {
+    pool->slab = (work_t *) malloc(sizeof(work_t) * pool->slab_size);
+    if (pool->slab == NULL)
+      goto fail;
+    for (unsigned int i = 0; i < pool->slab_size; i++) {
+      pool->slab[i].slab_idx = i;
+      atomic_init(&pool->slab[i].free_next,
+                  i + 1 < pool->slab_size ? i + 1 : SLAB_EMPTY);
+    }
+    atomic_store(&pool->free_head, 0);
+  }
+
+  pool->queue_type = attr->queue_type;
+  pool->sched = attr->sched;
+  pool->capacity = attr->queue_capacity;
+  pool->overload = attr->overload;
+  pool->block_timeout_ms = attr->block_timeout_ms;
+  pool->on_drop = attr->on_drop;
+  atomic_init(&pool->dropped, 0);
+  atomic_init(&pool->peak_depth, 0);
+  shard_init(&pool->ext_stats);
+  atomic_init(&pool->outstanding, 0);
+  atomic_init(&pool->all_waiters, 0);
+  pool->nlevels = attr->priority_levels;
+  pool->prio_sched = attr->prio_sched;
+  pool->aging = attr->aging;
+  pool->default_prio = attr->default_prio;
+  if (pool->default_prio < 0) pool->default_prio = 0;
+  if (pool->default_prio >= pool->nlevels) pool->default_prio = pool->nlevels - 1;
+  for (l = 0; l < TP_MAX_PRIO; l++) {
+    tp_level *lv = &pool->levels[l];
+
+    lv->head = NULL;
+    lv->tail = NULL;
+    lv->size = 0;
+    atomic_init(&lv->credits, l < pool->nlevels ? 1 << (pool->nlevels - 1 - l) : 0);
+    atomic_init(&lv->skipped, 0);
+    atomic_init(&lv->dispatched, 0);
+    atomic_init(&lv->peak, 0);
+    if (pool->queue_type == TP_QUEUE_RING && l < pool->nlevels) {
+      lv->ring = ring_create(attr->queue_capacity > 0 ?
+                             attr->queue_capacity : TP_DEFAULT_RING_SIZE);
+      if (lv->ring == NULL)
+        goto fail;
+    }
+  }
+  atomic_init(&pool->size, 0);
+  atomic_init(&pool->reject, 0);
+  atomic_init(&pool->submitters, 0);
+  atomic_init(&pool->shutdown, 0);
+  atomic_init(&pool->threads_act, 0);
+  pool->rem_threads = 0;
+  atomic_init(&pool->sleepers, 0);
+  atomic_init(&pool->full_waiters, 0);
+  atomic_init(&pool->spinners, 0);
+  // on one CPU a spinner only keeps the dispatcher off it
+  pool->spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? attr->spin : 0;
+
+  // "nsync" counts these, so fail destroys only what was made
+  if (pthread_mutex_init(&pool->lock_q, NULL)) goto fail;
+  nsync++;
+  if (pthread_mutex_init(&pool->lock_t, NULL)) goto fail;
+  nsync++;
+  if (pthread_cond_init(&pool->non_empt_q, NULL)) goto fail;
+  nsync++;
+  if (pthread_cond_init(&pool->empt_q, NULL)) goto fail;
+  nsync++;
+  if (pthread_cond_init(&pool->all_done, NULL)) goto fail;
+  nsync++;
+  tw_init(&pool->wheel, 0);
+  pool->timer_epoch = now_ns();
+  pool->timer_free = TIMER_NONE;
+  atomic_init(&pool->timers_armed, 0);
+  atomic_init(&pool->timer_due, ULONG_MAX);
+  pool->timer_keeper = 0;
+
+  // each worker allocates its own deque when it starts; until
+  // then thieves just find it empty
+  for (i = 0; i < pool->threads_max;i++){
+    tp_worker *w = &pool->workers[i];
+
+    w->pool = pool;
+    w->id = i;
+    w->seed = (unsigned int) i * 2654435761u + 1;
+    w->ncached = 0;
+    w->slab_hits = 0;
+    w->spin = pool->spin_max;
+    shard_init(&w->stats);
+    if (place_worker(w, attr) < 0) {
+      fprintf(stderr, "Cant place threadpool workers\n");
+      goto fail;
+    }
+  }
+
+  pthread_mutex_lock(&pool->lock_q);
+  for (i = 0; i < num_threads_in_pool;i++){
+    if (spawn_worker(pool)){
+      pthread_mutex_unlock(&pool->lock_q);
+      goto fail;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock_q);
+  return (threadpool) pool;
+
+ fail:
+  fprintf(stderr, "Cant create threadpool\n");
+  if (nsync == 5) {
+    // the workers already started have nothing to do but quit
+    pthread_mutex_lock(&pool->lock_q);
+    atomic_store(&pool->shutdown, 1);
+    pthread_cond_broadcast(&pool->non_empt_q);
+    pthread_mutex_unlock(&pool->lock_q);
+    for (i = 0; i < pool->threads_max; i++)
+      if (pool->workers[i].state != SLOT_EMPTY)
+        pthread_join(pool->workers[i].thread, NULL);
+  }
+  if (nsync > 4) pthread_cond_destroy(&pool->all_done);
+  if (nsync > 3) pthread_cond_destroy(&pool->empt_q);
+  if (nsync > 2) pthread_cond_destroy(&pool->non_empt_q);
+  if (nsync > 1) pthread_mutex_destroy(&pool->lock_t);
+  if (nsync > 0) pthread_mutex_destroy(&pool->lock_q);
+  for (l = 0; l < TP_MAX_PRIO; l++)
+    ring_destroy(pool->levels[l].ring);
+  free(pool->slab);
+  if (pool->workers != NULL)
+    for (i = 0; i < pool->threads_max; i++)
+      deque_destroy(&pool->workers[i].deque);
+  free(pool->workers);
+  free(pool);
+  return NULL;
+}
+
+/**
+ * Does the pool take new work from this thread?  Call it after
+ * raising outstanding: threadpool_shutdown sets reject and then
+ * waits for outstanding to drain, so one of the two sees the other.
+ */
+static int accepting(_threadpool *pool) {
+	if (!atomic_load(&pool->reject)) return 1;
+	// while draining, tasks may still spawn the work they need
+	return self != NULL && self->pool == pool && !atomic_load(&pool->shutdown);
+}
+
+/* the absolute time "ns" from now on "clock", for timedwait */
+static void deadline_after_ns(clockid_t clock, long ns, struct timespec *ts) {
+	clock_gettime(clock, ts);
+	ts->tv_sec += ns / 1000000000;
+	ts->tv_nsec += ns % 1000000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* the absolute time block_timeout_ms from now, for timedwait */
+static void overload_deadline(_threadpool *pool, struct timespec *ts) {
+	deadline_after_ns(CLOCK_REALTIME, (long) pool->block_timeout_ms * 1000000, ts);
+}
+
+/**
+ * Wait on empt_q for the queue to have room, per the overload
+ * policy.  lock_q must be held and full_waiters raised.  Returns
+ * TP_OK once woken (the caller re-checks for room), or TP_EFULL /
+ * TP_ETIMEDOUT if we aren't allowed to wait any longer.
+ */
+static int wait_for_room(_threadpool *pool, int nonblock,
+			 const struct timespec *deadline) {
+	// a draining pool's own tasks go on to run in place
+	if (!accepting(pool))
+		return TP_ESHUTDOWN;
+	if (nonblock || (pool->overload != TP_OVERLOAD_BLOCK &&
+			 pool->overload != TP_OVERLOAD_TIMEOUT))
+		return TP_EFULL;
+
+	if (pool->overload == TP_OVERLOAD_BLOCK) {
+		pthread_cond_wait(&(pool->empt_q), &(pool->lock_q));
+		return TP_OK;
+	}
+	if (pthread_cond_timedwait(&(pool->empt_q), &(pool->lock_q),
+				   deadline) == ETIMEDOUT)
+		return TP_ETIMEDOUT;
+	return TP_OK;
+}
+
+/* lock-free enqueue; only takes lock_q to wait while the ring is full */
+static int enqueue_ring(_threadpool *pool, work_t *cur, int prio, int nonblock) {
+	mpmc_ring *ring = pool->levels[prio].ring;
+	struct timespec deadline;
+	work_t *old;
+	int rc = TP_OK;
+
+	if (ring_push(ring, cur) != 0) {
+		if (pool->overload == TP_OVERLOAD_TIMEOUT)
+			overload_deadline(pool, &deadline);
+
+		// raise full_waiters before retrying, so a worker that
+		// frees a slot after our next failed push knows to wake us
+		pthread_mutex_lock(&(pool->lock_q));
+		atomic_fetch_add(&pool->full_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (ring_push(ring, cur) != 0) {
+			if (pool->overload == TP_OVERLOAD_DROP_OLDEST &&
+			    (old = (work_t *) ring_pop(ring)) != NULL) {
+				pthread_mutex_unlock(&(pool->lock_q));
+				drop_work(pool, old);
+				pthread_mutex_lock(&(pool->lock_q));
+				continue;
+			}
+			if ((rc = wait_for_room(pool, nonblock, &deadline)) != TP_OK) {
+				// one last try: a slot may have opened as we timed out
+				if (rc != TP_ESHUTDOWN && ring_push(ring, cur) == 0) rc = TP_OK;
+				break;
+			}
+		}
+		atomic_fetch_sub(&pool->full_waiters, 1);
+		pthread_mutex_unlock(&(pool->lock_q));
+		if (rc != TP_OK) return rc;
+	}
+
+	note_queued(pool, prio, 1);
+	wake_sleeper(pool);
+	maybe_grow(pool, 0, 0);
+	return TP_OK;
+}
+
+/* TP_QUEUE_LIST: is there room for one more task?  lock_q held */
+static int list_has_room(_threadpool *pool) {
+	if (pool->capacity > 0) return pool->size < pool->capacity;
+	return pool->rem_threads > 0;
+}
+
+/* append to level "prio"'s list; lock_q held */
+static void list_append(_threadpool *pool, work_t *cur, int prio) {
+	tp_level *lv = &pool->levels[prio];
+
+	if(lv->size == 0) {
+		lv->head = cur;
+		lv->tail = cur;
+	} else {
+		lv->tail->next = cur;
+		lv->tail = cur;
+	}
+	lv->size++;
+	pool->size++;
+	pool->rem_threads--;
+}
+
+static int enqueue_list(_threadpool *pool, work_t *cur, int prio, int nonblock) {
+	struct timespec deadline;
+	work_t *old = NULL;
+	int rc, l;
+
+	if (pool->overload == TP_OVERLOAD_TIMEOUT)
+		overload_deadline(pool, &deadline);
+
+	pthread_mutex_lock(&(pool->lock_q));
+
+	if(!accepting(pool)) {
+		pthread_mutex_unlock(&(pool->lock_q));
+		return TP_ESHUTDOWN;
+	}
+
+	// every thread is busy: wait for one to come free
+	while (!list_has_room(pool)) {
+		if (pool->overload == TP_OVERLOAD_DROP_OLDEST && pool->size > 0) {
+			// drop the oldest of the least important tasks; it will
+			// never run, so its thread is ours
+			for (l = pool->nlevels - 1; (old = level_take(pool, l)) == NULL; l--)
+				;
+			pool->rem_threads++;
+			continue;
+		}
+		atomic_fetch_add(&pool->full_waiters, 1);
+		rc = wait_for_room(pool, nonblock, &deadline);
+		atomic_fetch_sub(&pool->full_waiters, 1);
+		if (rc != TP_OK && !list_has_room(pool)) {
+			pthread_mutex_unlock(&(pool->lock_q));
+			if (old != NULL) drop_work(pool, old);
+			return rc;
+		}
+	}
+
+	list_append(pool, cur, prio);
+	note_queued(pool, prio, 1);
+
+	// a spinner we claim will see it; otherwise wake one
+	if (claim_spinners(pool, 1) == 0)
+		pthread_cond_signal(&(pool->non_empt_q));
+	maybe_grow(pool, 0, 1);
+	pthread_mutex_unlock(&(pool->lock_q));
+
+	if (old != NULL) drop_work(pool, old);
+	return TP_OK;
+}
+
+/**
+ * A dispatcher holds the pool from before it looks at reject until
+ * its very last access; threadpool_shutdown waits for every holder
+ * to let go before it frees anything.
+ */
+static void hold(_threadpool *pool) {
+	atomic_fetch_add(&pool->submitters, 1);
+}
+
+static void let_go(_threadpool *pool) {
+	atomic_fetch_sub(&pool->submitters, 1);
+}
+
+static int submit_work(_threadpool *pool, dispatch_fn dispatch_to_here, void *arg,
+		       int prio, int nonblock) {
+	work_t *cur;
+	int rc, runs_here = pool->overload == TP_OVERLOAD_CALLER_RUNS;
+
+	// one of our own tasks never sleeps waiting for room: the
+	// thread it would wait for may be waiting on it.  Where the
+	// policy says block, it runs the task itself instead
+	if (self != NULL && self->pool == pool && !nonblock &&
+	    (pool->overload == TP_OVERLOAD_BLOCK || pool->overload == TP_OVERLOAD_TIMEOUT)) {
+		nonblock = 1;
+		runs_here = 1;
+	}
+
+	//make a work queue element.
+	cur = work_alloc(pool);
+	if(cur == NULL) {
+		fprintf(stderr, "Out of memory creating a work struct!\n");
+		return TP_ENOMEM;
+	}
+
+	cur->routine = dispatch_to_here;
+	cur->arg = arg;
+	cur->next = NULL;
+	cur->enq_ns = now_ns();
+	atomic_fetch_add(&pool->outstanding, 1);
+	if (!accepting(pool)) {
+		work_free(pool, cur);
+		tasks_finished(pool, 1);
+		return TP_ESHUTDOWN;
+	}
+
+	// dispatched from one of our own tasks: keep it local, where
+	// it never waits for a free thread
+	if (pool->sched == TP_SCHED_STEAL && self != NULL && self->pool == pool &&
+	    deque_push(&self->deque, cur) == 0) {
+		shard_add(pool, &self->stats, &self->stats.dispatched, 1);
+		wake_sleeper(pool);
+		return TP_OK;
+	}
+
+	if (pool->queue_type == TP_QUEUE_RING)
+		rc = enqueue_ring(pool, cur, prio, nonblock);
+	else
+		rc = enqueue_list(pool, cur, prio, nonblock);
+	if (rc == TP_OK) {
+		shard_add(pool, my_shard(pool), &my_shard(pool)->dispatched, 1);
+		return TP_OK;
+	}
+
+	if (rc == TP_EFULL && runs_here) {
+		shard_add(pool, my_shard(pool), &my_shard(pool)->dispatched, 1);
+		run_work(pool, cur);
+		rc = TP_OK;
+	}
+	work_free(pool, cur);
+	tasks_finished(pool, 1);
+	return rc;
+}
+
+static int submit(_threadpool *pool, dispatch_fn dispatch_to_here, void *arg,
+		  int prio, int nonblock) {
+	int rc;
+
+	hold(pool);
+	rc = submit_work(pool, dispatch_to_here, arg, prio, nonblock);
+	let_go(pool);
+	return rc;
+}
+
+/**
+ * Queue as many of works[0..n-1] as fit right now, in order,
+ * without waiting and without waking anyone.  Returns how many
+ * went in.
+ */
+static int enqueue_batch(_threadpool *pool, work_t **works, int n) {
+	int i = 0;
+
+	if (!accepting(pool)) return 0;
+	if (pool->sched == TP_SCHED_STEAL && self != NULL && self->pool == pool) {
+		while (i < n && deque_push(&self->deque, works[i]) == 0) i++;
+		return i;
+	}
+
+	if (pool->queue_type == TP_QUEUE_RING) {
+		while (i < n && ring_push(pool->levels[pool->default_prio].ring,
+					  works[i]) == 0) i++;
+		note_queued(pool, pool->default_prio, i);
+		return i;
+	}
+
+	pthread_mutex_lock(&(pool->lock_q));
+	if (accepting(pool)) {
+		for (; i < n && list_has_room(pool); i++)
+			list_append(pool, works[i], pool->default_prio);
+		note_queued(pool, pool->default_prio, i);
+	}
+	pthread_mutex_unlock(&(pool->lock_q));
+	return i;
+}
+
+int dispatch_batch(threadpool from_me, dispatch_fn *fns, void **args, int n) {
+  _threadpool *pool = (_threadpool *) from_me;
+	work_t *works[64];
+	int done = 0, chunk, queued, i;
+
+	hold(pool);
+	while (done < n) {
+		chunk = n - done < 64 ? n - done : 64;
+		for (i = 0; i < chunk; i++) {
+			if ((works[i] = work_alloc(pool)) == NULL) break;
+			works[i]->routine = fns[done + i];
+			works[i]->arg = args[done + i];
+			works[i]->next = NULL;
+			works[i]->enq_ns = now_ns();
+		}
+		chunk = i;
+
+		atomic_fetch_add(&pool->outstanding, chunk);
+		queued = enqueue_batch(pool, works, chunk);
+		shard_add(pool, my_shard(pool), &my_shard(pool)->dispatched, queued);
+		if (queued < chunk) tasks_finished(pool, chunk - queued);
+		wake_sleepers(pool, queued);
+		maybe_grow(pool, 0, 0);
+		for (i = queued; i < chunk; i++)
+			work_free(pool, works[i]);
+		done += queued;
+
+		if (queued < chunk || chunk == 0) {
+			// out of room (or memory): the rest goes the slow way
+			for (; done < n; done++)
+				if (submit(pool, fns[done], args[done], pool->default_prio, 0) != TP_OK)
+					break;
+			break;
+		}
+	}
+	let_go(pool);
+	return done;
+}
+
+int dispatch(threadpool from_me, dispatch_fn dispatch_to_here, void *arg) {
+  _threadpool *pool = (_threadpool *) from_me;
+
+	return submit(pool, dispatch_to_here, arg, pool->default_prio, 0);
+}
+
+int dispatch_prio(threadpool from_me, int prio, dispatch_fn dispatch_to_here,
+		  void *arg) {
+  _threadpool *pool = (_threadpool *) from_me;
+
+	if (prio < 0) prio = 0;
+	if (prio >= pool->nlevels) prio = pool->nlevels - 1;
+	return submit(pool, dispatch_to_here, arg, prio, 0);
+}
+
+static void run_task(void *t) {
+	tp_task *task = (tp_task *) t;
+
+	task_complete(task, (task->fn) (task->arg), 1);
+}
+
+tp_task *dispatch_with_handle(threadpool from_me, task_fn fn, void *arg) {
+  _threadpool *pool = (_threadpool *) from_me;
+	tp_task *task;
+
+	task = (tp_task *) malloc(sizeof(tp_task));
+	if (task == NULL) return NULL;
+	task->fn = fn;
+	task->arg = arg;
+	task->result = NULL;
+	atomic_init(&task->state, 0);
+	atomic_init(&task->refs, 2);
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->done, NULL);
+
+	if (submit(pool, run_task, task, pool->default_prio, 0) != TP_OK) {
+		pthread_mutex_destroy(&task->lock);
+		pthread_cond_destroy(&task->done);
+		free(task);
+		return NULL;
+	}
+	return task;
+}
+
+int task_test(tp_task *task) {
+	return atomic_load(&task->state);
+}
+
+void *task_wait(tp_task *task) {
+	if (atomic_load(&task->state) == 0) {
+		pthread_mutex_lock(&task->lock);
+		while (atomic_load(&task->state) == 0)
+			pthread_cond_wait(&task->done, &task->lock);
+		pthread_mutex_unlock(&task->lock);
+	}
+	return task->result;
+}
+
+void task_release(tp_task *task) {
+	if (atomic_fetch_sub(&task->refs, 1) == 1) {
+		pthread_mutex_destroy(&task->lock);
+		pthread_cond_destroy(&task->done);
+		free(task);
+	}
+}
+
+void threadpool_wait_all(threadpool from_me) {
+  _threadpool *pool = (_threadpool *) from_me;
+
+	pthread_mutex_lock(&(pool->lock_q));
+	atomic_fetch_add(&pool->all_waiters, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while (atomic_load(&pool->outstanding) > 0)
+		pthread_cond_wait(&(pool->all_done), &(pool->lock_q));
+	atomic_fetch_sub(&pool->all_waiters, 1);
+	pthread_mutex_unlock(&(pool->lock_q));
+}
+
+int try_dispatch(threadpool from_me, dispatch_fn dispatch_to_here, void *arg) {
+  _threadpool *pool = (_threadpool *) from_me;
+
+	return submit(pool, dispatch_to_here, arg, pool->default_prio, 1);
+}
+
+void threadpool_slab_stats(threadpool from_me, tp_slab_stats *out) {
+	_threadpool *pool = (_threadpool *) from_me;
+
+	// worker counters are racy reads, good enough for a snapshot
+	out->slab_hits = atomic_load(&pool->slab_hits);
+	for (int i = 0; i < pool->threads_max; i++)
+		out->slab_hits += pool->workers[i].slab_hits;
+	out->heap_allocs = atomic_load(&pool->heap_allocs);
+	out->slab_size = pool->slab_size;
+}
+
+int threadpool_prio_stats(threadpool from_me, tp_prio_stats *out, int n) {
+	_threadpool *pool = (_threadpool *) from_me;
+	int l;
+
+	if (pool->queue_type == TP_QUEUE_LIST) pthread_mutex_lock(&(pool->lock_q));
+	for (l = 0; l < pool->nlevels && l < n; l++) {
+		out[l].depth = level_depth(pool, l);
+		out[l].peak_depth = atomic_load(&pool->levels[l].peak);
+		out[l].dispatched = atomic_load(&pool->levels[l].dispatched);
+	}
+	if (pool->queue_type == TP_QUEUE_LIST) pthread_mutex_unlock(&(pool->lock_q));
+	return l;
+}
+
+static tp_timer_id timer_add(_threadpool *pool, long delay_ms, long period_ms,
+			     dispatch_fn fn, void *arg) {
+	tp_timer_rec *rec, **chunks;
+	tp_timer_id id;
+	unsigned int i, base;
+	int sooner;
+
+	if (delay_ms < 0) delay_ms = 0;
+	hold(pool);
+	pthread_mutex_lock(&pool->lock_t);
+	// shutdown sets reject before it drops the armed timers, under
+	// lock_t, so a timer added here either is dropped or isn't added
+	if (atomic_load(&pool->reject)) {
+		pthread_mutex_unlock(&pool->lock_t);
+		let_go(pool);
+		return 0;
+	}
+	if (pool->timer_free == TIMER_NONE) {
+		// out of records: add another chunk of them
+		chunks = (tp_timer_rec **) realloc(pool->timer_chunks,
+				(pool->ntimer_chunks + 1) * sizeof(tp_timer_rec *));
+		if (chunks == NULL ||
+		    (rec = (tp_timer_rec *) malloc(TIMER_CHUNK * sizeof(tp_timer_rec))) == NULL) {
+			if (chunks != NULL) pool->timer_chunks = chunks;
+			pthread_mutex_unlock(&pool->lock_t);
+			let_go(pool);
+			return 0;
+		}
+		pool->timer_chunks = chunks;
+		base = (unsigned int) pool->ntimer_chunks * TIMER_CHUNK;
+		chunks[pool->ntimer_chunks++] = rec;
+		for (i = TIMER_CHUNK; i-- > 0; ) {
+			rec[i].idx = base + i;
+			rec[i].gen = 1;
+			rec[i].node.prev = NULL;
+			timer_rec_free(pool, &rec[i]);
+		}
+	}
+	rec = timer_rec(pool, pool->timer_free);
+	pool->timer_free = rec->free_next;
+
+	rec->pool = pool;
+	rec->fn = fn;
+	rec->arg = arg;
+	rec->period = period_ms > 0 ? (period_ms * 1000000L + TIMER_TICK_NS - 1) / TIMER_TICK_NS : 0;
+	rec->cancelled = 0;
+	rec->state = TIMER_ARMED;
+	// round up, so it never fires early
+	rec->node.expires = timer_now(pool) + 1 +
+			    (delay_ms * 1000000L + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	tw_add(&pool->wheel, &rec->node);
+	sooner = timer_update_due(pool);
+	// once unlocked, the timer may fire and its record be reused
+	id = ((tp_timer_id) rec->gen << 32) | rec->idx;
+	pthread_mutex_unlock(&pool->lock_t);
+
+	if (sooner) timer_kick(pool);
+	let_go(pool);
+	return id;
+}
+
+tp_timer_id dispatch_after(threadpool from_me, long delay_ms, dispatch_fn fn,
+			   void *arg) {
+	return timer_add((_threadpool *) from_me, delay_ms, 0, fn, arg);
+}
+
+tp_timer_id dispatch_every(threadpool from_me, long delay_ms, long period_ms,
+			   dispatch_fn fn, void *arg) {
+	if (period_ms <= 0) return 0;
+	return timer_add((_threadpool *) from_me, delay_ms, period_ms, fn, arg);
+}
+
+int timer_cancel(threadpool from_me, tp_timer_id id) {
+	_threadpool *pool = (_threadpool *) from_me;
+	unsigned int idx = (unsigned int) id, gen = (unsigned int) (id >> 32);
+	tp_timer_rec *rec;
+	int stopped = 0;
+
+	pthread_mutex_lock(&pool->lock_t);
+	if (idx < (unsigned int) pool->ntimer_chunks * TIMER_CHUNK &&
+	    (rec = timer_rec(pool, idx))->gen == gen) {
+		if (rec->state == TIMER_ARMED) {
+			tw_del(&pool->wheel, &rec->node);
+			timer_rec_free(pool, rec);
+			timer_update_due(pool);
+			stopped = 1;
+		} else if (rec->state == TIMER_FIRED && rec->period > 0 && !rec->cancelled) {
+			// running now; just don't let it come round again
+			rec->cancelled = 1;
+			stopped = 1;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock_t);
+	return stopped;
+}
+
+/**
+ * Wait for *done, which whoever sets it does under "lock" and
+ * then broadcasts "cond".  Meanwhile, run the pool's tasks: the
+ * ones we wait for may be queued behind others, and the caller
+ * may be one of the pool's workers.
+ */
+static void help_until(_threadpool *pool, atomic_int *done,
+		       pthread_mutex_t *lock, pthread_cond_t *cond) {
+	struct timespec ts;
+
+	while (!atomic_load(done)) {
+		if (help_once(pool)) continue;
+		// nothing to run right now; don't sleep long, since more
+		// of ours may be queued any moment
+		pthread_mutex_lock(lock);
+		if (!atomic_load(done)) {
+			deadline_after_ns(CLOCK_REALTIME, 1000000, &ts);
+			pthread_cond_timedwait(cond, lock, &ts);
+		}
+		pthread_mutex_unlock(lock);
+	}
+	// wait for whoever set done to let go of the lock
+	pthread_mutex_lock(lock);
+	pthread_mutex_unlock(lock);
+}
+
+// one parallel_for/parallel_reduce call
+typedef struct pf_job_st {
+	_threadpool *pool;
+	long grain;
+	range_fn fn;
+	reduce_fn rfn;
+	combine_fn combine;
+	void *ctx;
+	size_t size;		//accumulator bytes (reduce only)
+	const void *identity;
+	atomic_int done;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+} pf_job;
+
+// a range being worked on.  Its task splits off the left half
+// as a child until what's left is one grain, runs that, and
+// the last of it and its children to finish combines them
+typedef struct pf_node_st {
+	pf_job *job;
+	struct pf_node_st *parent;
+	struct pf_node_st *first, *last;	//children, in range order
+	struct pf_node_st *sibling;
+	long begin;
+	long end;
+	atomic_int pending;	//itself plus unfinished children
+	_Alignas(16) char acc[];	//reduce: this subtree's result
+} pf_node;
+
+static pf_node *pf_node_new(pf_job *job, pf_node *parent, long begin, long end) {
+	pf_node *n = (pf_node *) malloc(sizeof(pf_node) + job->size);
+
+	if (n == NULL) return NULL;
+	n->job = job;
+	n->parent = parent;
+	n->first = n->last = n->sibling = NULL;
+	n->begin = begin;
+	n->end = end;
+	atomic_init(&n->pending, 1);
+	if (job->size > 0) memcpy(n->acc, job->identity, job->size);
+	return n;
+}
+
+/* "n" and its subtree are done: combine in order and go up */
+static void pf_finish(pf_node *n) {
+	pf_job *job = n->job;
+	pf_node *c, *next, *parent;
+
+	while (n != NULL && atomic_fetch_sub(&n->pending, 1) == 1) {
+		if (job->rfn != NULL && n->first != NULL) {
+			// children hold the ranges left of ours
+			for (c = n->first->sibling; c != NULL; c = c->sibling)
+				(job->combine) (n->first->acc, c->acc, job->ctx);
+			(job->combine) (n->first->acc, n->acc, job->ctx);
+			memcpy(n->acc, n->first->acc, job->size);
+		}
+		for (c = n->first; c != NULL; c = next) {
+			next = c->sibling;
+			free(c);
+		}
+		// once done is set, the caller may free the root and the job
+		if ((parent = n->parent) == NULL) {
+			pthread_mutex_lock(&job->lock);
+			atomic_store(&job->done, 1);
+			pthread_cond_broadcast(&job->finished);
+			pthread_mutex_unlock(&job->lock);
+		}
+		n = parent;
+	}
+}
+
+static void pf_run(void *arg) {
+	pf_node *n = (pf_node *) arg, *c;
+	pf_job *job = n->job;
+	long mid;
+
+	while (n->end - n->begin > job->grain) {
+		mid = n->begin + (n->end - n->begin) / 2;
+		if ((c = pf_node_new(job, n, n->begin, mid)) == NULL) break;
+		if (n->last == NULL) n->first = c;
+		else n->last->sibling = c;
+		n->last = c;
+		atomic_fetch_add(&n->pending, 1);
+		n->begin = mid;
+		// never wait for room: a piece that doesn't fit runs here
+		if (submit(job->pool, pf_run, c, job->pool->default_prio, 1) != TP_OK)
+			pf_run(c);
+	}
+
+	if (job->rfn != NULL)
+		(job->rfn) (n->begin, n->end, n->acc, job->ctx);
+	else
+		(job->fn) (n->begin, n->end, job->ctx);
+	pf_finish(n);
+}
+
+static int parallel_run(pf_job *job, long begin, long end, long grain) {
+	_threadpool *pool = job->pool;
+	pf_node *root;
+
+	if (grain <= 0) {
+		// enough pieces for every worker to steal a few
+		grain = (end - begin) / (8L * pool->threads_max);
+		if (grain < 1) grain = 1;
+	}
+	job->grain = grain;
+	atomic_init(&job->done, 0);
+	if ((root = pf_node_new(job, NULL, begin, end)) == NULL)
+		return TP_ENOMEM;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->finished, NULL);
+
+	pf_run(root);
+	help_until(pool, &job->done, &job->lock, &job->finished);
+
+	if (job->rfn != NULL) memcpy((void *) job->identity, root->acc, job->size);
+	free(root);
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->finished);
+	return TP_OK;
+}
+
+int threadpool_parallel_for(threadpool from_me, long begin, long end,
+			    long grain, range_fn fn, void *ctx) {
+	pf_job job;
+
+	if (end <= begin) return TP_OK;
+	job.pool = (_threadpool *) from_me;
+	job.fn = fn;
+	job.rfn = NULL;
+	job.combine = NULL;
+	job.ctx = ctx;
+	job.size = 0;
+	job.identity = NULL;
+	return parallel_run(&job, begin, end, grain);
+}
+
+int threadpool_parallel_reduce(threadpool from_me, long begin, long end,
+			       long grain, void *result, size_t size,
+			       reduce_fn fn, combine_fn combine, void *ctx) {
+	pf_job job;
+
+	if (end <= begin) return TP_OK;
+	job.pool = (_threadpool *) from_me;
+	job.fn = NULL;
+	job.rfn = fn;
+	job.combine = combine;
+	job.ctx = ctx;
+	job.size = size;
+	job.identity = result;	//and where the answer goes
+	return parallel_run(&job, begin, end, grain);
+}
+
+struct tp_dag_node_st {
+	struct tp_dag_st *dag;
+	dispatch_fn fn;
+	void *arg;
+	int npred;		//edges in
+	atomic_int deps;	//predecessors yet to finish, this run
+	atomic_int poisoned;	//a predecessor was dropped
+	int nsucc;
+	int succ_cap;
+	tp_dag_node **succ;
+};
+
+struct tp_dag_st {
+	_threadpool *pool;
+	int n;
+	int cap;
+	tp_dag_node **nodes;
+	atomic_int remaining;	//nodes yet to run or be dropped, this run
+	atomic_int dropped;
+	atomic_int done;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+};
+
+tp_dag *dag_create(threadpool from_me) {
+	tp_dag *dag = (tp_dag *) malloc(sizeof(tp_dag));
+
+	if (dag == NULL) return NULL;
+	dag->pool = (_threadpool *) from_me;
+	dag->n = dag->cap = 0;
+	dag->nodes = NULL;
+	dag->running = 0;
+	atomic_init(&dag->remaining, 0);
+	atomic_init(&dag->dropped, 0);
+	atomic_init(&dag->done, 1);
+	pthread_mutex_init(&dag->lock, NULL);
+	pthread_cond_init(&dag->finished, NULL);
+	return dag;
+}
+
+tp_dag_node *dag_add(tp_dag *dag, dispatch_fn fn, void *arg) {
+	tp_dag_node *node, **nodes;
+
+	if (dag->n == dag->cap) {
+		nodes = (tp_dag_node **) realloc(dag->nodes,
+				(dag->cap ? dag->cap * 2 : 16) * sizeof(tp_dag_node *));
+		if (nodes == NULL) return NULL;
+		dag->nodes = nodes;
+		dag->cap = dag->cap ? dag->cap * 2 : 16;
+	}
+	if ((node = (tp_dag_node *) malloc(sizeof(tp_dag_node))) == NULL)
+		return NULL;
+	node->dag = dag;
+	node->fn = fn;
+	node->arg = arg;
+	node->npred = 0;
+	atomic_init(&node->deps, 0);
+	atomic_init(&node->poisoned, 0);
+	node->nsucc = node->succ_cap = 0;
+	node->succ = NULL;
+	dag->nodes[dag->n++] = node;
+	return node;
+}
+
+int dag_edge(tp_dag *dag, tp_dag_node *before, tp_dag_node *after) {
+	tp_dag_node **succ;
+
+	if (before == after || before->dag != dag || after->dag != dag)
+		return TP_EINVAL;
+	if (before->nsucc == before->succ_cap) {
+		succ = (tp_dag_node **) realloc(before->succ,
+				(before->succ_cap ? before->succ_cap * 2 : 4) * sizeof(tp_dag_node *));
+		if (succ == NULL) return TP_ENOMEM;
+		before->succ = succ;
+		before->succ_cap = before->succ_cap ? before->succ_cap * 2 : 4;
+	}
+	before->succ[before->nsucc++] = after;
+	after->npred++;
+	return TP_OK;
+}
+
+/* one node has run or been dropped */
+static void dag_node_done(tp_dag *dag) {
+	if (atomic_fetch_sub(&dag->remaining, 1) == 1) {
+		pthread_mutex_lock(&dag->lock);
+		atomic_store(&dag->done, 1);
+		pthread_cond_broadcast(&dag->finished);
+		pthread_mutex_unlock(&dag->lock);
+	}
+}
+
+/* "node" won't run, so neither will anything downstream of it */
+static void dag_drop(tp_dag_node *node) {
+	tp_dag *dag = node->dag;
+	int i;
+
+	if (dag->pool->on_drop != NULL)
+		(dag->pool->on_drop) (node->arg);
+	atomic_fetch_add(&dag->dropped, 1);
+	for (i = 0; i < node->nsucc; i++) {
+		atomic_store(&node->succ[i]->poisoned, 1);
+		if (atomic_fetch_sub(&node->succ[i]->deps, 1) == 1)
+			dag_drop(node->succ[i]);
+	}
+	dag_node_done(dag);
+}
+
+/**
+ * Run a ready node, then release its successors.  The first one
+ * that becomes ready runs next on this thread, with no queue and
+ * no wakeup in between; the rest are dispatched, which keeps them
+ * on this worker's deque when the pool steals.
+ */
+static void dag_run(void *arg) {
+	tp_dag_node *node = (tp_dag_node *) arg, *next, *succ;
+	tp_dag *dag = node->dag;
+	int i;
+
+	while (node != NULL) {
+		(node->fn) (node->arg);
+		next = NULL;
+		for (i = 0; i < node->nsucc; i++) {
+			succ = node->succ[i];
+			if (atomic_fetch_sub(&succ->deps, 1) != 1) continue;
+			if (atomic_load(&succ->poisoned))
+				dag_drop(succ);
+			else if (next == NULL)
+				next = succ;
+			else if (submit(dag->pool, dag_run, succ, dag->pool->default_prio, 1) != TP_OK)
+				dag_run(succ);	//no room: run it here
+		}
+		dag_node_done(dag);
+		node = next;
+	}
+}
+
+int dag_submit(tp_dag *dag) {
+	tp_dag_node **ready;
+	int i, j, head = 0, tail = 0;
+
+	if (dag->running) return TP_EINVAL;
+	if (dag->n == 0) return TP_OK;
+	if ((ready = (tp_dag_node **) malloc(dag->n * sizeof(tp_dag_node *))) == NULL)
+		return TP_ENOMEM;
+
+	// refuse a cycle: Kahn's algorithm must reach every node
+	for (i = 0; i < dag->n; i++) {
+		atomic_store(&dag->nodes[i]->deps, dag->nodes[i]->npred);
+		if (dag->nodes[i]->npred == 0) ready[tail++] = dag->nodes[i];
+	}
+	for (; head < tail; head++)
+		for (j = 0; j < ready[head]->nsucc; j++)
+			if (atomic_fetch_sub(&ready[head]->succ[j]->deps, 1) == 1)
+				ready[tail++] = ready[head]->succ[j];
+	free(ready);
+	if (tail < dag->n) return TP_EINVAL;
+
+	for (i = 0; i < dag->n; i++) {
+		atomic_store(&dag->nodes[i]->deps, dag->nodes[i]->npred);
+		atomic_store(&dag->nodes[i]->poisoned, 0);
+	}
+	atomic_store(&dag->remaining, dag->n);
+	atomic_store(&dag->dropped, 0);
+	atomic_store(&dag->done, 0);
+	dag->running = 1;
+
+	for (i = 0; i < dag->n; i++)
+		if (dag->nodes[i]->npred == 0 &&
+		    submit(dag->pool, dag_run, dag->nodes[i], dag->pool->default_prio, 0) != TP_OK)
+			dag_drop(dag->nodes[i]);
+	return TP_OK;
+}
+
+int dag_wait(tp_dag *dag) {
+	if (!dag->running) return 0;
+	help_until(dag->pool, &dag->done, &dag->lock, &dag->finished);
+	dag->running = 0;
+	return atomic_load(&dag->dropped);
+}
+
+void dag_destroy(tp_dag *dag) {
+	int i;
+
+	dag_wait(dag);
+	for (i = 0; i < dag->n; i++) {
+		free(dag->nodes[i]->succ);
+		free(dag->nodes[i]);
+	}
+	free(dag->nodes);
+	pthread_mutex_destroy(&dag->lock);
+	pthread_cond_destroy(&dag->finished);
+	free(dag);
+}
+
+static void shard_merge(tp_stats *out, tp_shard *sh) {
+	int b;
+
+	out->dispatched += atomic_load_explicit(&sh->dispatched, memory_order_relaxed);
+	out->completed += atomic_load_explicit(&sh->completed, memory_order_relaxed);
+	out->busy += atomic_load_explicit(&sh->busy, memory_order_relaxed);
+	for (b = 0; b < TP_HIST_BUCKETS; b++) {
+		out->wait_hist[b] += atomic_load_explicit(&sh->wait_hist[b], memory_order_relaxed);
+		out->run_hist[b] += atomic_load_explicit(&sh->run_hist[b], memory_order_relaxed);
+	}
+}
+
+void threadpool_get_stats(threadpool from_me, tp_stats *out) {
+	_threadpool *pool = (_threadpool *) from_me;
+
+	memset(out, 0, sizeof(*out));
+	// a retired worker's slot keeps its counts, so every slot counts
+	for (int i = 0; i < pool->threads_max; i++)
+		shard_merge(out, &pool->workers[i].stats);
+	shard_merge(out, &pool->ext_stats);
+
+	out->dropped = atomic_load(&pool->dropped);
+	out->peak_depth = atomic_load(&pool->peak_depth);
+	out->threads = atomic_load(&pool->threads_act);
+	if (pool->queue_type == TP_QUEUE_LIST) pthread_mutex_lock(&(pool->lock_q));
+	out->depth = queue_depth(pool);
+	if (pool->queue_type == TP_QUEUE_LIST) pthread_mutex_unlock(&(pool->lock_q));
+}
+
+unsigned long threadpool_hist_percentile(const unsigned long *hist, double pct) {
+	unsigned long total = 0, seen = 0;
+	int b;
+
+	for (b = 0; b < TP_HIST_BUCKETS; b++)
+		total += hist[b];
+	if (total == 0) return 0;
+	for (b = 0; b < TP_HIST_BUCKETS - 1; b++) {
+		seen += hist[b];
+		if (seen * 100.0 >= pct * total) break;
+	}
+	return b == 0 ? 0 : 1UL << b;
+}
+
+/* drop everything still queued or in a deque; returns how many */
+static long drop_pending(_threadpool *pool) {
+	work_t *cur;
+	long n = 0;
+	int l, i;
+
+	for (l = 0; l < pool->nlevels; l++) {
+		pthread_mutex_lock(&(pool->lock_q));
+		while ((cur = level_take(pool, l)) != NULL) {
+			if (pool->queue_type == TP_QUEUE_LIST) pool->rem_threads++;
+			pthread_mutex_unlock(&(pool->lock_q));
+			drop_work(pool, cur);
+			n++;
+			pthread_mutex_lock(&(pool->lock_q));
+		}
+		pthread_mutex_unlock(&(pool->lock_q));
+	}
+	// the owners are gone, so we may take from the bottom
+	for (i = 0; i < pool->threads_max; i++) {
+		if (atomic_load(&pool->workers[i].deque.array) == NULL) continue;
+		while ((cur = (work_t *) deque_take(&pool->workers[i].deque)) != NULL) {
+			drop_work(pool, cur);
+			n++;
+		}
+	}
+	return n;
+}
+
+long threadpool_shutdown(threadpool from_me, int mode, int timeout_ms) {
+	_threadpool *pool = (_threadpool *) from_me;
+	struct timespec deadline;
+	long dropped = 0;
+	int i, rc = 0;
+
+	if (timeout_ms >= 0)
+		deadline_after_ns(CLOCK_REALTIME, (long) timeout_ms * 1000000, &deadline);
+
+	// no more work from outside; blocked dispatchers give up
+	pthread_mutex_lock(&(pool->lock_q));
+	atomic_store(&pool->reject, 1);
+	pthread_cond_broadcast(&(pool->empt_q));
+
+	if (mode == TP_SHUTDOWN_DRAIN) {
+		atomic_fetch_add(&pool->all_waiters, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		while (atomic_load(&pool->outstanding) > 0 && rc != ETIMEDOUT) {
+			if (timeout_ms < 0)
+				pthread_cond_wait(&(pool->all_done), &(pool->lock_q));
+			else
+				rc = pthread_cond_timedwait(&(pool->all_done), &(pool->lock_q),
+							    &deadline);
+		}
+		atomic_fetch_sub(&pool->all_waiters, 1);
+	}
+
+	// workers finish what they're running and quit
+	atomic_store(&pool->shutdown, 1);
+	pthread_cond_broadcast(&(pool->non_empt_q));
+	pthread_cond_broadcast(&(pool->empt_q));
+	pthread_mutex_unlock(&(pool->lock_q));
+
+	// no spawn_worker can start a thread now, so the slots hold still
+	for (i = 0; i < pool->threads_max; i++) {
+		if (pool->workers[i].state == SLOT_EMPTY) continue;
+		pthread_join(pool->workers[i].thread, NULL);
+		pool->workers[i].state = SLOT_EMPTY;
+	}
+
+	// timers that never fired are dropped like queued tasks
+	pthread_mutex_lock(&pool->lock_t);
+	for (i = 0; i < pool->ntimer_chunks * TIMER_CHUNK; i++) {
+		tp_timer_rec *rec = timer_rec(pool, i);
+
+		if (rec->state != TIMER_ARMED) continue;
+		tw_del(&pool->wheel, &rec->node);
+		if (pool->on_drop != NULL)
+			(pool->on_drop) (rec->arg);
+		timer_rec_free(pool, rec);
+		atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+		dropped++;
+	}
+	pthread_mutex_unlock(&pool->lock_t);
+
+	// a dispatcher that got in before reject may still be queuing
+	// its task, and touches the pool until it lets go; once none
+	// holds it, nothing more can be queued
+	while (atomic_load(&pool->submitters) > 0 ||
+	       atomic_load(&pool->outstanding) > 0) {
+		dropped += drop_pending(pool);
+		if (atomic_load(&pool->submitters) > 0 ||
+		    atomic_load(&pool->outstanding) > 0) sched_yield();
+	}
+
+	for (i = 0; i < pool->threads_max; i++)
+		deque_destroy(&pool->workers[i].deque);
+	free(pool->workers);
+	free(pool->slab);
+	for (i = 0; i < pool->nlevels; i++)
+		ring_destroy(pool->levels[i].ring);
+	pthread_mutex_destroy(&(pool->lock_q));
+	pthread_cond_destroy(&(pool->non_empt_q));
+	pthread_cond_destroy(&(pool->empt_q));
+	pthread_cond_destroy(&(pool->all_done));
+	for (i = 0; i < pool->ntimer_chunks; i++)
+		free(pool->timer_chunks[i]);
+	free(pool->timer_chunks);
+	pthread_mutex_destroy(&pool->lock_t);
+	free(pool);
+	return dropped;
+}
+
+void destroy_threadpool(threadpool destroyme) {
+	threadpool_shutdown(destroyme, TP_SHUTDOWN_DRAIN, -1);
 }
@@ -5,6 +5,9 @@
  * your implementation of a threadpool.
  */
 
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
 // maximum number of threads allowed in a pool
 #define MAXT_IN_POOL 200
 
@@ -24,6 +27,133 @@ typedef void *threadpool;
 
 typedef void (*dispatch_fn)(void *);
 
+#include <stddef.h>
+
+// The queue a pool hands work through.  TP_QUEUE_LIST is the
+// original mutex-protected linked list; TP_QUEUE_RING is a
+// lock-free bounded ring (see mpmc_ring.h) that producers and
+// workers touch without taking the pool lock, which is only
+// used to put workers to sleep when the ring is empty.
+#define TP_QUEUE_LIST 0
+#define TP_QUEUE_RING 1
+
+#define TP_DEFAULT_RING_SIZE 1024
+
+// What dispatch does when the queue is full.  A TP_QUEUE_LIST pool
+// is full when queue_capacity tasks are waiting or, with the
+// default capacity of 0, when every thread already has a task; a
+// TP_QUEUE_RING pool is full when the ring is.
+#define TP_OVERLOAD_BLOCK       0  // wait for room (the default)
+#define TP_OVERLOAD_TIMEOUT     1  // wait up to block_timeout_ms
+#define TP_OVERLOAD_REJECT      2  // fail at once with TP_EFULL
+#define TP_OVERLOAD_CALLER_RUNS 3  // run the task on the calling thread
+#define TP_OVERLOAD_DROP_OLDEST 4  // discard the oldest queued task
+
+// return codes of dispatch and try_dispatch
+#define TP_OK         0
+#define TP_EFULL     -1  // queue full and the policy said not to wait
+#define TP_ETIMEDOUT -2  // TP_OVERLOAD_TIMEOUT ran out
+#define TP_ENOMEM    -3
+#define TP_ESHUTDOWN -4  // the pool no longer takes work
+#define TP_EINVAL    -5  // bad arguments, e.g. a cycle in a DAG
+
+// How workers pick up work.  TP_SCHED_FIFO has every worker pull
+// from the one shared queue.  TP_SCHED_STEAL gives each worker
+// its own deque (see ws_deque.h): tasks dispatched from inside a
+// running task go on the dispatching worker's deque and are run
+// LIFO, idle workers steal from random victims, and dispatches
+// from outside the pool go through the shared queue, which then
+// acts as the injection queue.
+#define TP_SCHED_FIFO  0
+#define TP_SCHED_STEAL 1
+
+// work_t nodes preallocated per pool.  Workers keep a small cache
+// of them; once the slab runs dry, dispatch falls back to malloc.
+#define TP_DEFAULT_SLAB_SIZE 4096
+
+// Elastic pools (max_threads > 0) start with the requested number
+// of workers and add more, up to max_threads, whenever nobody is
+// idle and either grow_depth tasks are queued or a task waited
+// longer than grow_wait_us to start.  A worker left idle for
+// keepalive_ms retires, down to min_threads.
+#define TP_DEFAULT_KEEPALIVE_MS 5000
+#define TP_DEFAULT_GROW_DEPTH   4
+#define TP_DEFAULT_GROW_WAIT_US 1000
+
+// Priority levels: level 0 is the most important.  TP_PRIO_STRICT
+// always serves the most important level that has work;
+// TP_PRIO_WEIGHTED lets level l run up to 2^(levels-1-l) tasks per
+// round (4:2:1 with three levels).  Either way, a waiting level
+// that is passed over "aging" times in a row is served next, so
+// nothing starves.  Priorities apply to the shared queue: tasks a
+// TP_SCHED_STEAL worker keeps on its own deque ignore them.
+#define TP_MAX_PRIO       8
+#define TP_PRIO_STRICT    0
+#define TP_PRIO_WEIGHTED  1
+#define TP_DEFAULT_AGING  64
+
+// Where workers run.  TP_PLACE_NONE leaves them to the scheduler.
+// TP_PLACE_PIN pins worker i to cpus[i % ncpus] (every online CPU
+// if cpus is NULL).  TP_PLACE_SPREAD deals workers round-robin
+// across NUMA nodes, each confined to its node's CPUs, and
+// TP_PLACE_NODE keeps them all on numa_node.  A pinned worker
+// allocates its own deque, so that memory lands on its node.
+#define TP_PLACE_NONE   0
+#define TP_PLACE_PIN    1
+#define TP_PLACE_SPREAD 2
+#define TP_PLACE_NODE   3
+
+// A worker that runs out of work spins (with a pause instruction)
+// for up to "spin" iterations before it parks, and a dispatcher
+// that can claim a spinning worker for its task (one task each)
+// skips the wakeup syscall.  Each
+// worker tunes its own budget: doubled when spinning found work,
+// halved when it didn't.  0 turns spinning off, as does a machine
+// with a single online CPU, where spinning only delays the
+// thread we're waiting for.
+#define TP_DEFAULT_SPIN 2048
+
+// Optional knobs for create_threadpool_attr.  Always start from
+// threadpool_attr_init() so new fields get sane defaults.
+typedef struct threadpool_attr_st {
+  int queue_type;          // TP_QUEUE_LIST or TP_QUEUE_RING
+  int queue_capacity;      // max queued tasks; 0 = see TP_OVERLOAD_*
+                           // (rings round it up to a power of 2)
+  int overload;            // TP_OVERLOAD_*
+  int block_timeout_ms;    // for TP_OVERLOAD_TIMEOUT
+  dispatch_fn on_drop;     // gets the arg of every task a pool
+                           // discards without running it, so the
+                           // owner can release it (may be NULL)
+  int sched;               // TP_SCHED_FIFO or TP_SCHED_STEAL
+  int slab_size;           // preallocated work_t nodes (0 = none)
+  int min_threads;         // elastic: never retire below this
+  int max_threads;         // elastic: never grow past this (0 = fixed)
+  int keepalive_ms;        // elastic: idle time before a worker retires
+  int grow_depth;          // elastic: queue depth that adds a worker
+  int grow_wait_us;        // elastic: queue wait that adds a worker
+  int priority_levels;     // 1..TP_MAX_PRIO
+  int prio_sched;          // TP_PRIO_STRICT or TP_PRIO_WEIGHTED
+  int aging;               // passes before a waiting level goes first
+                           // (0 = never promote)
+  int default_prio;        // the level dispatch() uses
+  int placement;           // TP_PLACE_*
+  const int *cpus;         // TP_PLACE_PIN: CPU numbers, in order
+  int ncpus;
+  int numa_node;           // TP_PLACE_NODE
+  int spin;                // most pause iterations before parking
+} threadpool_attr;
+
+void threadpool_attr_init(threadpool_attr *attr);
+
+/**
+ * threadpool_numa_nodes returns how many NUMA nodes this
+ * machine has (1 if it can't tell), and threadpool_node_cpus
+ * stores up to "max" of node's CPU numbers in "cpus" and
+ * returns how many it stored.
+ */
+int threadpool_numa_nodes(void);
+int threadpool_node_cpus(int node, int *cpus, int max);
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -31,25 +161,287 @@ typedef void (*dispatch_fn)(void *);
  */
 threadpool create_threadpool(int num_threads_in_pool);
 
+/**
+ * create_threadpool_attr is create_threadpool with the knobs
+ * in "attr" applied.  A NULL attr gives the defaults.  For an
+ * elastic pool, num_threads_in_pool is how many workers it
+ * starts with.
+ */
+threadpool create_threadpool_attr(int num_threads_in_pool,
+				  const threadpool_attr *attr);
+
 
 /**
  * dispatch sends a thread off to do some work.  If
  * all threads in the pool are busy, dispatch will
  * block until a thread becomes free and is dispatched.
+ * (With TP_QUEUE_RING, dispatch only blocks when the
+ * ring itself is full.)  A pool created with another
+ * overload policy applies that policy instead.
  * 
  * Once a thread is dispatched, this function returns
  * immediately.
  * 
  * The dispatched thread calls into the function
  * "dispatch_to_here" with argument "arg".
+ *
+ * Called from one of the pool's own tasks, dispatch never
+ * sleeps: where the policy would block, the task is run right
+ * there instead, so nested dispatch can't deadlock.
+ *
+ * Returns TP_OK, or one of the TP_E* codes if the task
+ * was not taken (in which case "arg" is still the
+ * caller's to clean up).
+ */
+int dispatch(threadpool from_me, dispatch_fn dispatch_to_here,
+	     void *arg);
+
+/**
+ * dispatch_prio is dispatch at priority level "prio" (0 is
+ * the most important; out-of-range levels are clamped).
+ */
+int dispatch_prio(threadpool from_me, int prio, dispatch_fn dispatch_to_here,
+		  void *arg);
+
+/**
+ * try_dispatch is dispatch that never sleeps: where the
+ * pool's policy would block (TP_OVERLOAD_BLOCK or
+ * TP_OVERLOAD_TIMEOUT) it returns TP_EFULL instead.  The
+ * other policies behave exactly as in dispatch.
+ */
+int try_dispatch(threadpool from_me, dispatch_fn dispatch_to_here,
+		 void *arg);
+
+// where dispatch got its work_t nodes from
+typedef struct tp_slab_stats_st {
+  unsigned long slab_hits;     // served from the slab (cached or shared)
+  unsigned long heap_allocs;   // slab empty, fell back to malloc
+  unsigned long slab_size;
+} tp_slab_stats;
+
+/**
+ * threadpool_slab_stats fills in "out" with a snapshot of
+ * the pool's work_t allocation counters.
+ */
+void threadpool_slab_stats(threadpool from_me, tp_slab_stats *out);
+
+/**
+ * dispatch_batch dispatches the n tasks fns[i](args[i]).
+ * As many as there is room for go in with a single queue
+ * operation, and only as many sleeping workers are woken as
+ * there are tasks to run; any that don't fit are then handed
+ * to dispatch one by one, under the pool's overload policy.
+ * Returns how many tasks were taken: it stops at the first
+ * one dispatch refuses, leaving args[ret..n-1] to the caller.
+ */
+int dispatch_batch(threadpool from_me, dispatch_fn *fns, void **args, int n);
+
+// A task whose result somebody wants: "task_fn" is a dispatch_fn
+// that also returns a value, which task_wait hands back.
+typedef void *(*task_fn)(void *);
+
+// an opaque handle on a task started by dispatch_with_handle
+typedef struct tp_task_st tp_task;
+
+/**
+ * dispatch_with_handle dispatches fn(arg) like dispatch, but
+ * returns a handle the caller can wait on.  Returns NULL if the
+ * pool refused the task.  Every handle must be given back with
+ * task_release once the caller is done with it.
+ */
+tp_task *dispatch_with_handle(threadpool from_me, task_fn fn, void *arg);
+
+/**
+ * task_test returns 0 while the task is queued or running, 1
+ * once it has finished, and -1 if the pool dropped it without
+ * running it.  It never blocks.
+ */
+int task_test(tp_task *task);
+
+/**
+ * task_wait blocks until the task is finished (or dropped) and
+ * returns what its function returned (NULL if dropped).
+ */
+void *task_wait(tp_task *task);
+
+void task_release(tp_task *task);
+
+/**
+ * threadpool_wait_all blocks until every task dispatched to
+ * the pool so far, and any they dispatched in turn, has
+ * finished or been dropped.  Don't call it from one of the
+ * pool's own tasks: that task would be waiting for itself.
+ */
+void threadpool_wait_all(threadpool from_me);
+
+// Timers.  A tp_timer_id names a timer until it is done (0 is
+// never a valid id); ids aren't reused, so cancelling one that
+// has already fired is safe.  Timers have millisecond resolution
+// and never fire early; when one is due, its fn is dispatched to
+// the pool like any other task.  threadpool_wait_all doesn't wait
+// for timers that haven't fired, and shutdown drops them.
+typedef unsigned long tp_timer_id;
+
+/**
+ * dispatch_after runs fn(arg) on the pool once delay_ms has
+ * passed.  Returns the timer's id, or 0 if out of memory or
+ * the pool is shutting down.
+ */
+tp_timer_id dispatch_after(threadpool from_me, long delay_ms,
+                           dispatch_fn fn, void *arg);
+
+/**
+ * dispatch_every runs fn(arg) after delay_ms, and then every
+ * period_ms until cancelled.  A run that falls behind skips the
+ * periods it missed rather than bunching them up.
+ */
+tp_timer_id dispatch_every(threadpool from_me, long delay_ms, long period_ms,
+                           dispatch_fn fn, void *arg);
+
+/**
+ * timer_cancel stops a timer.  Returns 1 if that prevented any
+ * future run, 0 if there was nothing left to stop.  A periodic
+ * timer's run already under way still finishes.
+ */
+int timer_cancel(threadpool from_me, tp_timer_id id);
+
+// Data-parallel loops.  A range_fn handles [begin, end); a
+// reduce_fn folds [begin, end) into the accumulator "acc"; a
+// combine_fn folds "other" into "acc" (acc = acc op other), and
+// must be associative.  Partial results are combined in range
+// order, so op need not be commutative.
+typedef void (*range_fn)(long begin, long end, void *ctx);
+typedef void (*reduce_fn)(long begin, long end, void *acc, void *ctx);
+typedef void (*combine_fn)(void *acc, const void *other, void *ctx);
+
+/**
+ * threadpool_parallel_for calls fn over [begin, end), split into
+ * pieces of at most "grain" iterations (grain <= 0: about eight
+ * pieces per worker).  Pieces are split off recursively, half a
+ * range at a time, and the calling thread works on them too,
+ * so it may be one of the pool's own tasks.  Returns once every
+ * piece has run: TP_OK, or TP_ENOMEM.
+ */
+int threadpool_parallel_for(threadpool from_me, long begin, long end,
+                            long grain, range_fn fn, void *ctx);
+
+/**
+ * threadpool_parallel_reduce is the same for a reduction.
+ * "result" points to "size" bytes holding the identity of op;
+ * every piece starts from a copy of it, and on return "result"
+ * holds the combined value.
+ */
+int threadpool_parallel_reduce(threadpool from_me, long begin, long end,
+                               long grain, void *result, size_t size,
+                               reduce_fn fn, combine_fn combine, void *ctx);
+
+// Task graphs.  A tp_dag holds tasks and "runs before" edges
+// between them; submitting it runs every task once its
+// predecessors have finished.
+typedef struct tp_dag_st tp_dag;
+typedef struct tp_dag_node_st tp_dag_node;
+
+/* dag_create returns an empty graph whose tasks run on "from_me" */
+tp_dag *dag_create(threadpool from_me);
+
+/**
+ * dag_add adds a task to the graph and returns it, or NULL if
+ * out of memory.  dag_edge makes "before" run, and finish,
+ * before "after" starts; TP_EINVAL if they are the same node or
+ * from another graph.  Neither may be called while it runs.
+ */
+tp_dag_node *dag_add(tp_dag *dag, dispatch_fn fn, void *arg);
+int dag_edge(tp_dag *dag, tp_dag_node *before, tp_dag_node *after);
+
+/**
+ * dag_submit starts the graph: TP_OK, or TP_EINVAL if its edges
+ * make a cycle (nothing runs then) or it is running already.
+ * Each finished task counts its successors' dependencies down;
+ * the first one it makes ready runs straight after it on the
+ * same thread, and the rest are dispatched from there.  A task
+ * the pool drops takes everything downstream of it with it,
+ * through on_drop.  A graph may be submitted again once it has
+ * been waited for.
+ */
+int dag_submit(tp_dag *dag);
+
+/**
+ * dag_wait returns once every task of the submitted graph has
+ * run or been dropped, with how many were dropped.  Like
+ * parallel_for, the caller runs queued work meanwhile, so it may
+ * be one of the pool's own tasks.
+ */
+int dag_wait(tp_dag *dag);
+
+/* dag_destroy waits for the graph, if submitted, and frees it */
+void dag_destroy(tp_dag *dag);
+
+// per priority level queue metrics
+typedef struct tp_prio_stats_st {
+  long depth;                 // queued right now
+  unsigned long peak_depth;   // most ever queued at once
+  unsigned long dispatched;   // total tasks queued at this level
+} tp_prio_stats;
+
+/**
+ * threadpool_prio_stats fills in out[0..n-1], one entry per
+ * priority level, and returns how many levels it filled in.
+ */
+int threadpool_prio_stats(threadpool from_me, tp_prio_stats *out, int n);
+
+// wait and service time histograms: bucket 0 counts 0ns, bucket
+// b counts [2^(b-1), 2^b) ns, and the last one everything longer
+#define TP_HIST_BUCKETS 32
+
+// whole-pool metrics; worker counters are summed when read, so
+// the numbers are a snapshot rather than one instant
+typedef struct tp_stats_st {
+  unsigned long dispatched;   // tasks the pool accepted
+  unsigned long completed;    // tasks that ran to the end
+  unsigned long dropped;      // tasks discarded without running
+  long depth;                 // waiting in the shared queue now
+  unsigned long peak_depth;   // most ever waiting there at once
+  int busy;                   // tasks running now, inline ones too
+  int threads;                // workers alive
+  unsigned long wait_hist[TP_HIST_BUCKETS];  // queued to started
+  unsigned long run_hist[TP_HIST_BUCKETS];   // started to finished
+} tp_stats;
+
+/**
+ * threadpool_get_stats fills in "out".  It takes no lock the
+ * workers need (except lock_q, briefly, for TP_QUEUE_LIST), so
+ * it is cheap enough to poll.
+ */
+void threadpool_get_stats(threadpool from_me, tp_stats *out);
+
+/**
+ * threadpool_hist_percentile returns the upper bound, in ns, of
+ * the bucket holding the "pct"th percentile (0 to 100) of
+ * "hist", or 0 if the histogram is empty.
+ */
+unsigned long threadpool_hist_percentile(const unsigned long *hist, double pct);
+
+// how threadpool_shutdown treats work still queued
+#define TP_SHUTDOWN_DRAIN 0   // run it, until the deadline
+#define TP_SHUTDOWN_ABORT 1   // drop it at once
+
+/**
+ * threadpool_shutdown stops the pool taking new work (dispatch
+ * returns TP_ESHUTDOWN; the pool's own tasks may still dispatch
+ * while it drains), waits up to timeout_ms (-1: forever) for
+ * queued work to finish in TP_SHUTDOWN_DRAIN mode, then joins
+ * every worker and frees the pool.  Tasks already running are
+ * always let finish; anything still queued is dropped through
+ * on_drop.  Returns how many tasks were dropped.
  */
-void dispatch(threadpool from_me, dispatch_fn dispatch_to_here,
-	      void *arg);
+long threadpool_shutdown(threadpool pool, int mode, int timeout_ms);
 
 /**
  * destroy_threadpool kills the threadpool, causing
  * all threads in it to commit suicide, and then
  * frees all the memory associated with the threadpool.
+ * It is threadpool_shutdown(pool, TP_SHUTDOWN_DRAIN, -1).
  */
 void destroy_threadpool(threadpool destroyme);
 
+#endif
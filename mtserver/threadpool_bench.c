@@ -0,0 +1,316 @@
+/**
+ * threadpool_bench.c
+ *
+ * Microbenchmarks for the threadpool, one CSV row per measurement
+ * on stdout, so runs before and after a change can be diffed:
+ *
+ *   throughput  empty tasks per second with 1..P producer threads
+ *   latency     dispatch-to-start percentiles, one task in flight
+ *               ("idle") and in bursts of 64 ("burst")
+ *   fanout      a DAG of one root, k children and a join, per run
+ *               (the "producers" column holds k)
+ *   oversub     1us tasks on 1x..8x as many workers as CPUs
+ *
+ * Each row is run on every queue/sched combination unless -q or
+ * -S narrow it down.  Times are in nanoseconds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "threadpool.h"
+
+#define BURST 64
+
+static int nthreads;        // workers (-t), default: online CPUs
+static long ntasks = 200000;   // tasks per throughput run (-n)
+static int max_producers = 8;  // -p
+static int reps = 3;           // -r: best of
+
+static const char *qname[] = { "list", "ring" };
+static const char *sname[] = { "fifo", "steal" };
+
+static long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static threadpool make_pool(int q, int s, int threads) {
+  threadpool_attr attr;
+  threadpool tp;
+
+  threadpool_attr_init(&attr);
+  attr.queue_type = q;
+  attr.sched = s;
+  if ((tp = create_threadpool_attr(threads, &attr)) == NULL) {
+    fprintf(stderr, "couldn't create a pool of %d threads\n", threads);
+    exit(-1);
+  }
+  return tp;
+}
+
+static void row(const char *bench, int q, int s, int threads, int producers,
+                long tasks, long ns, double per_sec, const long *pct) {
+  printf("%s,%s,%s,%d,%d,%ld,%ld,%.0f", bench, qname[q], sname[s],
+         threads, producers, tasks, ns, per_sec);
+  if (pct != NULL)
+    printf(",%ld,%ld,%ld,%ld\n", pct[0], pct[1], pct[2], pct[3]);
+  else
+    printf(",,,,\n");
+  fflush(stdout);
+}
+
+/* --- throughput ----------------------------------------------------- */
+
+typedef struct producer_st {
+  threadpool tp;
+  long n;
+  dispatch_fn fn;
+  pthread_barrier_t *go;
+} producer;
+
+static void empty_task(void *arg) {
+}
+
+static void spin_task(void *arg) {
+  long until = now_ns() + 1000;
+
+  while (now_ns() < until)
+    ;
+}
+
+static void *produce(void *arg) {
+  producer *p = (producer *) arg;
+  long i;
+
+  pthread_barrier_wait(p->go);
+  for (i = 0; i < p->n; i++)
+    dispatch(p->tp, p->fn, NULL);
+  return NULL;
+}
+
+/* best wall time over "reps" runs of n tasks from "np" producers */
+static long run_throughput(threadpool tp, int np, long n, dispatch_fn fn) {
+  pthread_t tid[np];
+  producer p[np];
+  pthread_barrier_t go;
+  long start, best = 0, ns;
+  int r, i;
+
+  for (r = 0; r < reps; r++) {
+    pthread_barrier_init(&go, NULL, np + 1);
+    for (i = 0; i < np; i++) {
+      p[i].tp = tp;
+      p[i].n = n / np;
+      p[i].fn = fn;
+      p[i].go = &go;
+      pthread_create(&tid[i], NULL, produce, &p[i]);
+    }
+    pthread_barrier_wait(&go);
+    start = now_ns();
+    for (i = 0; i < np; i++)
+      pthread_join(tid[i], NULL);
+    threadpool_wait_all(tp);
+    ns = now_ns() - start;
+    pthread_barrier_destroy(&go);
+    if (best == 0 || ns < best)
+      best = ns;
+  }
+  return best;
+}
+
+static void bench_throughput(int q, int s) {
+  threadpool tp = make_pool(q, s, nthreads);
+  long ns;
+  int np;
+
+  for (np = 1; np <= max_producers; np *= 2) {
+    ns = run_throughput(tp, np, ntasks, empty_task);
+    row("throughput", q, s, nthreads, np, ntasks / np * np, ns,
+        (ntasks / np * np) * 1e9 / ns, NULL);
+  }
+  destroy_threadpool(tp);
+}
+
+/* --- latency -------------------------------------------------------- */
+
+static long *sent;      // when task i was dispatched
+static long *waited;    // and how long it took to start
+
+static void stamp_task(void *arg) {
+  long i = (long) arg;
+
+  waited[i] = now_ns() - sent[i];
+}
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *) a, y = *(const long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* p50, p90, p99 and p99.9 of samples[0..n-1], which get sorted */
+static void percentiles(long *samples, long n, long *pct) {
+  static const double at[] = { 0.50, 0.90, 0.99, 0.999 };
+  int i;
+
+  qsort(samples, n, sizeof(long), cmp_long);
+  for (i = 0; i < 4; i++)
+    pct[i] = samples[(long) (at[i] * (n - 1))];
+}
+
+static void bench_latency(int q, int s) {
+  threadpool tp = make_pool(q, s, nthreads);
+  long n = ntasks / 10, i, j, start, ns, pct[4];
+
+  sent = (long *) malloc(n * sizeof(long));
+  waited = (long *) malloc(n * sizeof(long));
+
+  start = now_ns();
+  for (i = 0; i < n; i++) {
+    sent[i] = now_ns();
+    dispatch(tp, stamp_task, (void *) i);
+    threadpool_wait_all(tp);
+  }
+  ns = now_ns() - start;
+  percentiles(waited, n, pct);
+  row("latency_idle", q, s, nthreads, 1, n, ns, n * 1e9 / ns, pct);
+
+  start = now_ns();
+  for (i = 0; i < n; i += BURST) {
+    for (j = i; j < n && j < i + BURST; j++) {
+      sent[j] = now_ns();
+      dispatch(tp, stamp_task, (void *) j);
+    }
+    threadpool_wait_all(tp);
+  }
+  ns = now_ns() - start;
+  percentiles(waited, n, pct);
+  row("latency_burst", q, s, nthreads, 1, n, ns, n * 1e9 / ns, pct);
+
+  free(sent);
+  free(waited);
+  destroy_threadpool(tp);
+}
+
+/* --- fan-out/fan-in ------------------------------------------------- */
+
+static void bench_fanout(int q, int s) {
+  static const int widths[] = { 4, 64, 1024 };
+  threadpool tp = make_pool(q, s, nthreads);
+  tp_dag *dag;
+  tp_dag_node *root, *join, *child;
+  long runs, r, start, ns, *samples, pct[4];
+  int w, i;
+
+  for (w = 0; w < (int) (sizeof(widths) / sizeof(widths[0])); w++) {
+    dag = dag_create(tp);
+    root = dag_add(dag, empty_task, NULL);
+    join = dag_add(dag, empty_task, NULL);
+    for (i = 0; i < widths[w]; i++) {
+      child = dag_add(dag, empty_task, NULL);
+      dag_edge(dag, root, child);
+      dag_edge(dag, child, join);
+    }
+
+    runs = ntasks / (widths[w] + 2);
+    if (runs < 10)
+      runs = 10;
+    samples = (long *) malloc(runs * sizeof(long));
+    start = now_ns();
+    for (r = 0; r < runs; r++) {
+      samples[r] = now_ns();
+      dag_submit(dag);
+      dag_wait(dag);
+      samples[r] = now_ns() - samples[r];
+    }
+    ns = now_ns() - start;
+    percentiles(samples, runs, pct);
+    // per_sec and the percentiles are of whole graph runs
+    row("fanout", q, s, nthreads, widths[w], runs * (widths[w] + 2), ns,
+        runs * 1e9 / ns, pct);
+    free(samples);
+    dag_destroy(dag);
+  }
+  destroy_threadpool(tp);
+}
+
+/* --- oversubscription ----------------------------------------------- */
+
+static void bench_oversub(int q, int s) {
+  threadpool tp;
+  long n = ntasks / 10, ns;
+  int mult, threads;
+
+  for (mult = 1; mult <= 8; mult *= 2) {
+    threads = nthreads * mult;
+    if (threads > MAXT_IN_POOL)
+      break;
+    tp = make_pool(q, s, threads);
+    ns = run_throughput(tp, 1, n, spin_task);
+    row("oversub", q, s, threads, 1, n, ns, n * 1e9 / ns, NULL);
+    destroy_threadpool(tp);
+  }
+}
+
+static void usage(char *prog) {
+  fprintf(stderr,
+          "usage: %s [-t threads] [-n tasks] [-p max_producers] [-r reps]\n"
+          "          [-q list|ring] [-S fifo|steal] [-b bench,...]\n"
+          "  benches: throughput latency fanout oversub (default: all)\n",
+          prog);
+  exit(-1);
+}
+
+int main(int argc, char **argv) {
+  int q, s, qfrom = 0, qto = 1, sfrom = 0, sto = 1, c;
+  const char *benches = "throughput,latency,fanout,oversub";
+
+  nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+
+  while ((c = getopt(argc, argv, "t:n:p:r:q:S:b:")) != -1) {
+    switch (c) {
+    case 't': nthreads = atoi(optarg); break;
+    case 'n': ntasks = atol(optarg); break;
+    case 'p': max_producers = atoi(optarg); break;
+    case 'r': reps = atoi(optarg); break;
+    case 'q':
+      qfrom = qto = strcmp(optarg, "ring") == 0 ? TP_QUEUE_RING : TP_QUEUE_LIST;
+      break;
+    case 'S':
+      sfrom = sto = strcmp(optarg, "steal") == 0 ? TP_SCHED_STEAL : TP_SCHED_FIFO;
+      break;
+    case 'b': benches = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (nthreads < 1 || nthreads > MAXT_IN_POOL || ntasks < BURST ||
+      max_producers < 1 || reps < 1)
+    usage(argv[0]);
+
+  printf("bench,queue,sched,threads,producers,tasks,ns,per_sec,"
+         "p50_ns,p90_ns,p99_ns,p999_ns\n");
+  for (q = qfrom; q <= qto; q++) {
+    for (s = sfrom; s <= sto; s++) {
+      if (strstr(benches, "throughput"))
+        bench_throughput(q, s);
+      if (strstr(benches, "latency"))
+        bench_latency(q, s);
+      if (strstr(benches, "fanout"))
+        bench_fanout(q, s);
+      if (strstr(benches, "oversub"))
+        bench_oversub(q, s);
+    }
+  }
+  return 0;
+}
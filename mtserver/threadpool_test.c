@@ -1,7 +1,9 @@
 /**
  * threadpool_test.c, copyright 2001 Steve Gribble
  *
- * Just a regression test for the threadpool code.
+ * Just a regression test for the threadpool code, and for the
+ * event loop that sits in front of it.  It exits 0 if every
+ * check passed; threadpool_bench measures speed.
  */
 
 #include <stdio.h>
@@ -9,43 +11,682 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include "threadpool.h"
+#include "common.h"
+#include "event_loop.h"
+#include "buf_pool.h"
 
-extern int errno;
+static atomic_long ran;
+static int failures;
+
+// tasks that hold a worker until the gate opens
+static atomic_int gate_open, gate_waiting;
+
+// the order tasks ran in, by their args
+static long order[64];
+static atomic_int norder;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      fprintf(stdout, "  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                     \
+    }                                                                 \
+  } while (0)
 
 void dispatch_to_me(void *arg) {
-  int seconds = (int) arg;
+  atomic_fetch_add(&ran, (long) arg);
+}
 
-  fprintf(stdout, "  in dispatch %d\n", seconds);
-  sleep(seconds);
-  fprintf(stdout, "  done dispatch %d\n", seconds);
+void *square(void *arg) {
+  return (void *) ((long) arg * (long) arg);
 }
 
-int main(int argc, char **argv) {
+void fill(long begin, long end, void *ctx) {
+  long i;
+
+  for (i = begin; i < end; i++)
+    ((long *) ctx)[i] = i;
+}
+
+void close_gate(void) {
+  atomic_store(&gate_open, 0);
+  atomic_store(&gate_waiting, 0);
+}
+
+void wait_at_gate(void *arg) {
+  atomic_fetch_add(&gate_waiting, 1);
+  while (!atomic_load(&gate_open))
+    usleep(1000);
+}
+
+/* wait up to five seconds for *n to reach "want" */
+int wait_for(atomic_int *n, int want) {
+  int i;
+
+  for (i = 0; i < 5000 && atomic_load(n) < want; i++)
+    usleep(1000);
+  return atomic_load(n) >= want;
+}
+
+void record(void *arg) {
+  int i = atomic_fetch_add(&norder, 1);
+
+  if (i < 64)
+    order[i] = (long) arg;
+}
+
+long ms_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* run every check against one kind of pool */
+void test_pool(const char *name, int queue_type, int sched) {
+  threadpool_attr attr;
   threadpool tp;
+  tp_task *tasks[16];
+  tp_stats stats;
+  long i, sum, *v;
+
+  fprintf(stdout, "**main** %s\n", name);
+  threadpool_attr_init(&attr);
+  attr.queue_type = queue_type;
+  attr.sched = sched;
+  tp = create_threadpool_attr(2, &attr);
+  CHECK(tp != NULL);
+
+  // plain dispatch, waited for without sleeping
+  atomic_store(&ran, 0);
+  for (i = 1; i <= 1000; i++)
+    CHECK(dispatch(tp, dispatch_to_me, (void *) i) == TP_OK);
+  threadpool_wait_all(tp);
+  CHECK(atomic_load(&ran) == 1000 * 1001 / 2);
+
+  // handles carry results back
+  for (i = 0; i < 16; i++)
+    CHECK((tasks[i] = dispatch_with_handle(tp, square, (void *) i)) != NULL);
+  for (i = 0, sum = 0; i < 16; i++) {
+    sum += (long) task_wait(tasks[i]);
+    task_release(tasks[i]);
+  }
+  CHECK(sum == 1240);
+
+  // parallel_for touches every index once
+  v = (long *) calloc(10000, sizeof(long));
+  CHECK(threadpool_parallel_for(tp, 0, 10000, 0, fill, v) == TP_OK);
+  for (i = 0, sum = 0; i < 10000; i++)
+    sum += v[i];
+  CHECK(sum == 10000L * 9999 / 2);
+  free(v);
+
+  threadpool_get_stats(tp, &stats);
+  CHECK(stats.completed >= 1016);
+  CHECK(stats.dropped == 0);
+
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+}
+
+/* an event loop handler that echoes, holding "w" requests at the gate */
+char *echo_at_gate(int *version, frame *f, char *payload, frame *reply) {
+  char *out = (char *) bp_alloc(f->length);
+
+  if (f->length > 0 && payload[0] == 'w')
+    wait_at_gate(NULL);
+  if (out == NULL)
+    return NULL;
+  memcpy(out, payload, f->length);
+  reply->type = FRAME_RESPONSE;
+  reply->flags = 0;
+  reply->length = f->length;
+  return out;
+}
+
+/* send a one-byte REQUEST */
+int ask(int fd, char what) {
+  char buf[FRAME_HEADER + 1];
+
+  frame_pack(buf, FRAME_REQUEST, 0, 1);
+  buf[FRAME_HEADER] = what;
+  if (send(fd, buf, sizeof(buf), MSG_NOSIGNAL) != sizeof(buf))
+    return -1;
+  return 0;
+}
+
+/* read its RESPONSE: how many bytes came, 0 if the server hung up */
+int answer(int fd) {
+  char buf[FRAME_HEADER + 1];
 
+  return (int) recv(fd, buf, sizeof(buf), MSG_WAITALL);
+}
+
+/**
+ * A batch the pool drops must close its connection, even one that
+ * has had a batch answered already, rather than leave the client
+ * waiting for a response that will never come.
+ */
+void test_ev_drop(const char *name, int engine) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  struct timeval tv = { 5, 0 };
+  threadpool_attr attr;
+  threadpool tp;
+  ev_loop *loop;
+  pthread_t thread;
+  tp_stats stats;
+  int lfd, fds[3], i;
+
+  fprintf(stdout, "**main** %s: a dropped batch closes its connection\n", name);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  CHECK(listen(lfd, 16) == 0);
+  CHECK(getsockname(lfd, (struct sockaddr *) &addr, &len) == 0);
+
+  // one worker and room for one batch: a third one pushes the
+  // second out
+  threadpool_attr_init(&attr);
+  attr.queue_capacity = 1;
+  attr.overload = TP_OVERLOAD_DROP_OLDEST;
+  attr.on_drop = ev_drop;
+  tp = create_threadpool_attr(1, &attr);
+  CHECK(tp != NULL);
+  loop = ev_create(lfd, tp, echo_at_gate, 0, FRAME_SMALL, engine);
+  CHECK(loop != NULL);
+  CHECK(pthread_create(&thread, NULL, ev_run, loop) == 0);
+
+  // a batch each first, so every connection has responses behind it
+  close_gate();
+  for (i = 0; i < 3; i++) {
+    fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    CHECK(connect(fds[i], (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    CHECK(ask(fds[i], 'a') == 0);
+    CHECK(answer(fds[i]) == FRAME_HEADER + 1);
+  }
+
+  // 0 runs and holds the worker, 1 queues, and 2 drops 1
+  CHECK(ask(fds[0], 'w') == 0);
+  CHECK(wait_for(&gate_waiting, 1));
+  CHECK(ask(fds[1], 'w') == 0);
+  for (i = 0; i < 5000; i++) {
+    threadpool_get_stats(tp, &stats);
+    if (stats.depth == 1)
+      break;
+    usleep(1000);
+  }
+  CHECK(ask(fds[2], 'w') == 0);
+  for (i = 0; i < 5000; i++) {
+    threadpool_get_stats(tp, &stats);
+    if (stats.dropped == 1)
+      break;
+    usleep(1000);
+  }
+  CHECK(stats.dropped == 1);
+  atomic_store(&gate_open, 1);
+
+  CHECK(answer(fds[0]) == FRAME_HEADER + 1);
+  CHECK(answer(fds[1]) == 0);
+  CHECK(answer(fds[2]) == FRAME_HEADER + 1);
+
+  ev_stop(loop);
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+  pthread_join(thread, NULL);
+  ev_destroy(loop);
+  for (i = 0; i < 3; i++)
+    close(fds[i]);
+  close(lfd);
+}
+
+/* a pool with its one worker held at the gate */
+threadpool held_pool(threadpool_attr *attr) {
+  threadpool tp;
+
+  close_gate();
+  atomic_store(&norder, 0);
+  tp = create_threadpool_attr(1, attr);
+  CHECK(tp != NULL);
+  CHECK(dispatch(tp, wait_at_gate, NULL) == TP_OK);
+  CHECK(wait_for(&gate_waiting, 1));
+  return tp;
+}
+
+/* open the gate and let the pool go */
+void release_pool(threadpool tp) {
+  atomic_store(&gate_open, 1);
+  threadpool_wait_all(tp);
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+}
+
+/* levels are served in order, and aging lets a starved one through */
+void test_priorities(void) {
+  threadpool_attr attr;
+  threadpool tp;
+  int i, count[3];
+
+  fprintf(stdout, "**main** priorities and aging\n");
+  threadpool_attr_init(&attr);
+  attr.queue_capacity = 64;
+  attr.priority_levels = 2;
+  attr.prio_sched = TP_PRIO_STRICT;
+
+  // without aging, level 1 waits for level 0 to empty
+  attr.aging = 0;
+  tp = held_pool(&attr);
+  CHECK(dispatch_prio(tp, 1, record, (void *) 'b') == TP_OK);
+  for (i = 0; i < 5; i++)
+    CHECK(dispatch_prio(tp, 0, record, (void *) 'a') == TP_OK);
+  release_pool(tp);
+  CHECK(atomic_load(&norder) == 6);
+  CHECK(order[5] == 'b');
+
+  // passed over twice, it goes next
+  attr.aging = 2;
+  tp = held_pool(&attr);
+  CHECK(dispatch_prio(tp, 1, record, (void *) 'b') == TP_OK);
+  for (i = 0; i < 5; i++)
+    CHECK(dispatch_prio(tp, 0, record, (void *) 'a') == TP_OK);
+  release_pool(tp);
+  CHECK(atomic_load(&norder) == 6);
+  CHECK(order[2] == 'b');
+
+  // weighted: 4, 2 and 1 turns a round (the held task took one of
+  // level 0's, and the next round gives it back)
+  attr.priority_levels = 3;
+  attr.prio_sched = TP_PRIO_WEIGHTED;
+  attr.aging = 0;
+  tp = held_pool(&attr);
+  for (i = 0; i < 7; i++) {
+    CHECK(dispatch_prio(tp, 0, record, (void *) 0) == TP_OK);
+    CHECK(dispatch_prio(tp, 1, record, (void *) 1) == TP_OK);
+    CHECK(dispatch_prio(tp, 2, record, (void *) 2) == TP_OK);
+  }
+  release_pool(tp);
+  CHECK(atomic_load(&norder) == 21);
+  count[0] = count[1] = count[2] = 0;
+  for (i = 0; i < 7; i++)
+    count[order[i]]++;
+  CHECK(count[0] == 4 && count[1] == 2 && count[2] == 1);
+}
+
+static pthread_t ran_on;
+static atomic_long dropped_arg;
+
+void note_thread(void *arg) {
+  ran_on = pthread_self();
+}
+
+void note_drop(void *arg) {
+  atomic_store(&dropped_arg, (long) arg);
+}
+
+static threadpool busy_pool;
+static int busy_after;
+
+/* the pool's one worker is running this, so the dispatch runs in place */
+void nest_then_count(void *arg) {
+  tp_stats stats;
+
+  CHECK(dispatch(busy_pool, dispatch_to_me, (void *) 1) == TP_OK);
+  threadpool_get_stats(busy_pool, &stats);
+  busy_after = stats.busy;
+}
+
+/* each overload policy, against a full queue */
+void test_overload(void) {
+  threadpool_attr attr;
+  threadpool tp;
+  tp_stats stats;
+  struct timespec start;
+  dispatch_fn fns[8];
+  void *args[8];
+  int i;
+
+  fprintf(stdout, "**main** overload policies\n");
+  threadpool_attr_init(&attr);
+  attr.queue_capacity = 1;
+  attr.on_drop = note_drop;
+
+  attr.overload = TP_OVERLOAD_REJECT;
+  tp = held_pool(&attr);
+  CHECK(dispatch(tp, record, (void *) 1) == TP_OK);
+  CHECK(dispatch(tp, record, (void *) 2) == TP_EFULL);
+  release_pool(tp);
+  CHECK(atomic_load(&norder) == 1);
+
+  attr.overload = TP_OVERLOAD_BLOCK;
+  tp = held_pool(&attr);
+  CHECK(dispatch(tp, record, (void *) 1) == TP_OK);
+  CHECK(try_dispatch(tp, record, (void *) 2) == TP_EFULL);
+  release_pool(tp);
+
+  attr.overload = TP_OVERLOAD_TIMEOUT;
+  attr.block_timeout_ms = 50;
+  tp = held_pool(&attr);
+  CHECK(dispatch(tp, record, (void *) 1) == TP_OK);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  CHECK(dispatch(tp, record, (void *) 2) == TP_ETIMEDOUT);
+  CHECK(ms_since(&start) >= 45);
+  release_pool(tp);
+
+  attr.overload = TP_OVERLOAD_CALLER_RUNS;
+  tp = held_pool(&attr);
+  CHECK(dispatch(tp, record, (void *) 1) == TP_OK);
+  CHECK(dispatch(tp, note_thread, NULL) == TP_OK);
+  CHECK(pthread_equal(ran_on, pthread_self()));
+  release_pool(tp);
+
+  // a task run in place inside another leaves that one busy
+  busy_pool = create_threadpool(1);
+  CHECK(busy_pool != NULL);
+  CHECK(dispatch(busy_pool, nest_then_count, NULL) == TP_OK);
+  threadpool_wait_all(busy_pool);
+  CHECK(busy_after == 1);
+  CHECK(threadpool_shutdown(busy_pool, TP_SHUTDOWN_DRAIN, -1) == 0);
+
+  attr.overload = TP_OVERLOAD_DROP_OLDEST;
+  atomic_store(&dropped_arg, 0);
+  tp = held_pool(&attr);
+  CHECK(dispatch(tp, record, (void *) 1) == TP_OK);
+  CHECK(dispatch(tp, record, (void *) 2) == TP_OK);
+  CHECK(atomic_load(&dropped_arg) == 1);
+  threadpool_get_stats(tp, &stats);
+  CHECK(stats.dropped == 1);
+  release_pool(tp);
+  CHECK(atomic_load(&norder) == 1 && order[0] == 2);
+
+  // a batch stops at the first task that doesn't fit
+  attr.queue_capacity = 4;
+  attr.overload = TP_OVERLOAD_REJECT;
+  tp = held_pool(&attr);
+  for (i = 0; i < 8; i++) {
+    fns[i] = record;
+    args[i] = (void *) (long) i;
+  }
+  CHECK(dispatch_batch(tp, fns, args, 8) == 4);
+  release_pool(tp);
+  CHECK(atomic_load(&norder) == 4 && order[0] == 0 && order[3] == 3);
+}
+
+static atomic_int ticks;
+
+void tick(void *arg) {
+  atomic_fetch_add(&ticks, 1);
+}
+
+/* one-shot and periodic timers fire, and cancel stops them */
+void test_timers(void) {
+  threadpool tp;
+  tp_timer_id id;
+  struct timespec start;
+  int n;
+
+  fprintf(stdout, "**main** timers\n");
   tp = create_threadpool(2);
+  CHECK(tp != NULL);
+
+  // fires once, not early
+  atomic_store(&ticks, 0);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  CHECK((id = dispatch_after(tp, 20, tick, NULL)) != 0);
+  CHECK(wait_for(&ticks, 1));
+  CHECK(ms_since(&start) >= 20);
+  CHECK(timer_cancel(tp, id) == 0);
+
+  // cancelled in time, it never runs
+  atomic_store(&ticks, 0);
+  CHECK((id = dispatch_after(tp, 100, tick, NULL)) != 0);
+  CHECK(timer_cancel(tp, id) == 1);
+  CHECK(timer_cancel(tp, id) == 0);
+  usleep(200000);
+  CHECK(atomic_load(&ticks) == 0);
+
+  // periodic until cancelled
+  CHECK((id = dispatch_every(tp, 10, 10, tick, NULL)) != 0);
+  CHECK(wait_for(&ticks, 3));
+  CHECK(timer_cancel(tp, id) == 1);
+  threadpool_wait_all(tp);
+  n = atomic_load(&ticks);
+  usleep(50000);
+  CHECK(atomic_load(&ticks) == n);
+
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+}
+
+/* a diamond runs in dependency order, and cycles are refused */
+void test_dag(void) {
+  threadpool tp;
+  tp_dag *dag;
+  tp_dag_node *a, *b, *c, *d;
+  int round;
+
+  fprintf(stdout, "**main** task graphs\n");
+  tp = create_threadpool(4);
+  CHECK(tp != NULL);
+
+  CHECK((dag = dag_create(tp)) != NULL);
+  a = dag_add(dag, record, (void *) 'a');
+  b = dag_add(dag, record, (void *) 'b');
+  c = dag_add(dag, record, (void *) 'c');
+  d = dag_add(dag, record, (void *) 'd');
+  CHECK(a != NULL && b != NULL && c != NULL && d != NULL);
+  CHECK(dag_edge(dag, a, b) == TP_OK);
+  CHECK(dag_edge(dag, a, c) == TP_OK);
+  CHECK(dag_edge(dag, b, d) == TP_OK);
+  CHECK(dag_edge(dag, c, d) == TP_OK);
+  CHECK(dag_edge(dag, a, a) == TP_EINVAL);
+  for (round = 0; round < 2; round++) {
+    atomic_store(&norder, 0);
+    CHECK(dag_submit(dag) == TP_OK);
+    CHECK(dag_wait(dag) == 0);
+    CHECK(atomic_load(&norder) == 4);
+    CHECK(order[0] == 'a' && order[3] == 'd');
+  }
+  dag_destroy(dag);
+
+  atomic_store(&norder, 0);
+  CHECK((dag = dag_create(tp)) != NULL);
+  a = dag_add(dag, record, (void *) 'a');
+  b = dag_add(dag, record, (void *) 'b');
+  CHECK(dag_edge(dag, a, b) == TP_OK);
+  CHECK(dag_edge(dag, b, a) == TP_OK);
+  CHECK(dag_submit(dag) == TP_EINVAL);
+  dag_destroy(dag);
+  threadpool_wait_all(tp);
+  CHECK(atomic_load(&norder) == 0);
+
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+}
+
+/* an elastic pool grows under load and shrinks back when idle */
+void test_elastic(void) {
+  threadpool_attr attr;
+  threadpool tp;
+  tp_stats stats;
+  int i;
+
+  fprintf(stdout, "**main** elastic grow and shrink\n");
+  threadpool_attr_init(&attr);
+  attr.queue_capacity = 64;
+  attr.min_threads = 1;
+  attr.max_threads = 4;
+  attr.keepalive_ms = 50;
+  attr.grow_depth = 1;
+  close_gate();
+  tp = create_threadpool_attr(1, &attr);
+  CHECK(tp != NULL);
+  threadpool_get_stats(tp, &stats);
+  CHECK(stats.threads == 1);
+
+  // every held task leaves the next one queued, which adds a worker
+  for (i = 1; i <= 4; i++) {
+    CHECK(dispatch(tp, wait_at_gate, NULL) == TP_OK);
+    CHECK(wait_for(&gate_waiting, i));
+  }
+  threadpool_get_stats(tp, &stats);
+  CHECK(stats.threads == 4);
+
+  atomic_store(&gate_open, 1);
+  threadpool_wait_all(tp);
+  for (i = 0; i < 5000; i++) {
+    threadpool_get_stats(tp, &stats);
+    if (stats.threads == 1)
+      break;
+    usleep(1000);
+  }
+  CHECK(stats.threads == 1);
 
-  fprintf(stdout, "**main** dispatch 3\n");
-  dispatch(tp, dispatch_to_me, (void *) 3);
-  fprintf(stdout, "**main** dispatch 6\n");
-  dispatch(tp, dispatch_to_me, (void *) 6);
-  fprintf(stdout, "**main** dispatch 7\n");
-  dispatch(tp, dispatch_to_me, (void *) 7);
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+}
+
+static atomic_int running, most_running;
+
+void run_a_while(void *arg) {
+  int now = atomic_fetch_add(&running, 1) + 1, most;
+
+  most = atomic_load(&most_running);
+  while (now > most && !atomic_compare_exchange_weak(&most_running, &most, now))
+    ;
+  usleep(50000);
+  atomic_fetch_sub(&running, 1);
+}
+
+/**
+ * A spinning worker can take only one task: the dispatches it
+ * absorbs must still wake parked workers for the rest.  (Spinning
+ * is off on a single CPU, where this passes trivially.)
+ */
+void test_spinners(void) {
+  threadpool_attr attr;
+  threadpool tp;
+  long i;
+
+  fprintf(stdout, "**main** spinning workers don't hide work\n");
+  threadpool_attr_init(&attr);
+  attr.spin = 1000000;
+  tp = create_threadpool_attr(8, &attr);
+  CHECK(tp != NULL);
+
+  // let every worker give up its first spin and park, then leave
+  // one spinning (for half as long) after a task
+  usleep(300000);
+  atomic_store(&ran, 0);
+  CHECK(dispatch(tp, dispatch_to_me, (void *) 1) == TP_OK);
+  threadpool_wait_all(tp);
+  CHECK(atomic_load(&ran) == 1);
+
+  atomic_store(&most_running, 0);
+  for (i = 0; i < 8; i++)
+    CHECK(dispatch(tp, run_a_while, NULL) == TP_OK);
+  threadpool_wait_all(tp);
+  CHECK(atomic_load(&most_running) == 8);
+
+  CHECK(threadpool_shutdown(tp, TP_SHUTDOWN_DRAIN, -1) == 0);
+}
+
+static threadpool nested_pool;
+static atomic_int dispatchers, refused;
+
+void spawn_child(void *arg) {
+  CHECK(dispatch(nested_pool, dispatch_to_me, (void *) 1) == TP_OK);
+}
 
-  fprintf(stdout, "**main** done first\n");
-  sleep(20);
-  fprintf(stdout, "\n\n");
+void *open_gate_later(void *arg) {
+  usleep(50000);
+  atomic_store(&gate_open, 1);
+  return NULL;
+}
+
+void *dispatch_once(void *tp) {
+  atomic_fetch_add(&dispatchers, 1);
+  if (dispatch((threadpool) tp, record, (void *) 9) == TP_ESHUTDOWN)
+    atomic_fetch_add(&refused, 1);
+  return NULL;
+}
+
+/**
+ * Shut a pool down under dispatchers blocked on it: each must get
+ * TP_ESHUTDOWN, and the queued task must run (drain) or be dropped
+ * (abort).
+ */
+void shutdown_under_load(int mode) {
+  threadpool_attr attr;
+  threadpool tp;
+  pthread_t threads[4], opener;
+  int i;
+
+  threadpool_attr_init(&attr);
+  attr.queue_capacity = 1;
+  attr.overload = TP_OVERLOAD_BLOCK;
+  attr.on_drop = note_drop;
+  tp = held_pool(&attr);
+  CHECK(dispatch(tp, record, (void *) 1) == TP_OK);
+
+  atomic_store(&dispatchers, 0);
+  atomic_store(&refused, 0);
+  atomic_store(&dropped_arg, 0);
+  for (i = 0; i < 4; i++)
+    CHECK(pthread_create(&threads[i], NULL, dispatch_once, tp) == 0);
+  CHECK(wait_for(&dispatchers, 4));
+  usleep(50000);
 
-  fprintf(stdout, "**main** dispatch 3\n");
-  dispatch(tp, dispatch_to_me, (void *) 3);
-  fprintf(stdout, "**main** dispatch 6\n");
-  dispatch(tp, dispatch_to_me, (void *) 6);
-  fprintf(stdout, "**main** dispatch 7\n");
-  dispatch(tp, dispatch_to_me, (void *) 7);
+  CHECK(pthread_create(&opener, NULL, open_gate_later, NULL) == 0);
+  CHECK(threadpool_shutdown(tp, mode, -1) == (mode == TP_SHUTDOWN_ABORT));
+  for (i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+  pthread_join(opener, NULL);
 
-  fprintf(stdout, "**main done second\n");
-  sleep(20);
-  exit(-1);
+  CHECK(atomic_load(&refused) == 4);
+  if (mode == TP_SHUTDOWN_DRAIN)
+    CHECK(atomic_load(&norder) == 1 && order[0] == 1);
+  else
+    CHECK(atomic_load(&norder) == 0 && atomic_load(&dropped_arg) == 1);
 }
 
+void test_shutdown(void) {
+  long i;
+
+  fprintf(stdout, "**main** drain and abort shutdown\n");
+
+  // the pool's own tasks may still dispatch while it drains
+  nested_pool = create_threadpool(2);
+  CHECK(nested_pool != NULL);
+  atomic_store(&ran, 0);
+  for (i = 0; i < 100; i++)
+    CHECK(dispatch(nested_pool, spawn_child, NULL) == TP_OK);
+  CHECK(threadpool_shutdown(nested_pool, TP_SHUTDOWN_DRAIN, -1) == 0);
+  CHECK(atomic_load(&ran) == 100);
+
+  shutdown_under_load(TP_SHUTDOWN_DRAIN);
+  shutdown_under_load(TP_SHUTDOWN_ABORT);
+}
+
+int main(int argc, char **argv) {
+  test_pool("list/fifo", TP_QUEUE_LIST, TP_SCHED_FIFO);
+  test_pool("ring/fifo", TP_QUEUE_RING, TP_SCHED_FIFO);
+  test_pool("list/steal", TP_QUEUE_LIST, TP_SCHED_STEAL);
+  test_pool("ring/steal", TP_QUEUE_RING, TP_SCHED_STEAL);
+  test_priorities();
+  test_overload();
+  test_timers();
+  test_dag();
+  test_elastic();
+  test_spinners();
+  test_shutdown();
+  test_ev_drop("epoll", EV_EPOLL);
+  test_ev_drop("io_uring", EV_URING);
+
+  fprintf(stdout, "**main** %s\n", failures ? "FAILED" : "passed");
+  exit(failures ? -1 : 0);
+}
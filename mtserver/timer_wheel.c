@@ -0,0 +1,127 @@
+/**
+ * timer_wheel.c
+ *
+ * Slot i of level l holds the timers whose expiry, shifted
+ * right by l * TW_BITS, is i modulo TW_SLOTS.  Level 0 slots are
+ * a tick wide and are emptied as the clock reaches them; each
+ * time level l wraps to slot 0, the next slot of level l + 1 is
+ * re-sorted into the levels below ("cascaded").
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer_wheel.h"
+
+#define TW_MASK  (TW_SLOTS - 1)
+#define TW_SPAN  (1UL << (TW_BITS * TW_LEVELS))   // ticks the wheel covers
+
+void tw_init(timer_wheel *tw, unsigned long now) {
+  int l, i;
+
+  tw->now = now;
+  tw->count = 0;
+  for (l = 0; l < TW_LEVELS; l++)
+    for (i = 0; i < TW_SLOTS; i++)
+      tw->slots[l][i].next = tw->slots[l][i].prev = &tw->slots[l][i];
+}
+
+/* link "t" into the slot for its expiry, seen from tick tw->now */
+static void tw_place(timer_wheel *tw, tw_timer *t) {
+  unsigned long expires = t->expires, delta = t->expires - tw->now;
+  tw_timer *head;
+  int l = 0;
+
+  if (delta >= TW_SPAN) {
+    // too far off: wait in the last slot and be re-sorted later
+    delta = TW_SPAN - 1;
+    expires = tw->now + delta;
+  }
+  while (l < TW_LEVELS - 1 && delta >= 1UL << (TW_BITS * (l + 1)))
+    l++;
+  head = &tw->slots[l][(expires >> (TW_BITS * l)) & TW_MASK];
+
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+void tw_add(timer_wheel *tw, tw_timer *t) {
+  if ((long) (t->expires - tw->now) <= 0)
+    t->expires = tw->now + 1;
+  tw_place(tw, t);
+  tw->count++;
+}
+
+void tw_del(timer_wheel *tw, tw_timer *t) {
+  if (t->prev == NULL)
+    return;
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+  tw->count--;
+}
+
+/* re-sort one slot of a higher level into the levels below */
+static void tw_cascade(timer_wheel *tw, int l, int slot) {
+  tw_timer *head = &tw->slots[l][slot], *t, *next;
+
+  t = head->next;
+  head->next = head->prev = head;
+  for (; t != head; t = next) {
+    next = t->next;
+    tw_place(tw, t);
+  }
+}
+
+tw_timer *tw_advance(timer_wheel *tw, unsigned long now) {
+  tw_timer *expired = NULL, **tail = &expired, *head, *t;
+  unsigned long tick;
+  int l;
+
+  while ((long) (now - tw->now) > 0) {
+    if (tw->count == 0) {
+      // nothing to expire or cascade on the way
+      tw->now = now;
+      break;
+    }
+
+    tick = ++tw->now;
+    for (l = 1; l < TW_LEVELS; l++) {
+      if ((tick >> (TW_BITS * (l - 1))) & TW_MASK)
+        break;
+      tw_cascade(tw, l, (tick >> (TW_BITS * l)) & TW_MASK);
+    }
+
+    head = &tw->slots[0][tick & TW_MASK];
+    while ((t = head->next) != head) {
+      tw_del(tw, t);
+      *tail = t;
+      tail = &t->next;
+    }
+  }
+  *tail = NULL;
+  return expired;
+}
+
+unsigned long tw_next_tick(timer_wheel *tw) {
+  unsigned long tick, block;
+  int i;
+
+  // something a tick wide in the next lap of level 0?
+  for (i = 1; i <= TW_SLOTS; i++) {
+    tick = tw->now + i;
+    if (tw->slots[0][tick & TW_MASK].next != &tw->slots[0][tick & TW_MASK])
+      return tick;
+  }
+  // otherwise the first level 1 slot due to cascade, or the
+  // first wrap of level 1 (when the levels above may cascade)
+  block = tw->now >> TW_BITS;
+  for (i = 1; i <= TW_SLOTS; i++) {
+    if (tw->slots[1][(block + i) & TW_MASK].next != &tw->slots[1][(block + i) & TW_MASK] ||
+        ((block + i) & TW_MASK) == 0)
+      return (block + i) << TW_BITS;
+  }
+  return (block + TW_SLOTS) << TW_BITS;
+}
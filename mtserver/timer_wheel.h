@@ -0,0 +1,65 @@
+/**
+ * timer_wheel.h
+ *
+ * A hierarchical timing wheel (Varghese and Lauck) of intrusive
+ * timers.  Four levels of 64 slots cover 2^24 ticks; a timer
+ * lands in the level whose slot width fits how far off it is,
+ * and drops a level each time the wheel below it wraps around.
+ * Adding and cancelling are O(1), and advancing costs one slot
+ * visit per tick plus an occasional cascade, however many timers
+ * are pending.  The wheel does no locking of its own.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define TW_BITS   6
+#define TW_SLOTS  (1 << TW_BITS)
+#define TW_LEVELS 4
+
+typedef struct tw_timer_st {
+  struct tw_timer_st *next;
+  struct tw_timer_st *prev;    // NULL while not on the wheel
+  unsigned long expires;       // absolute tick
+} tw_timer;
+
+typedef struct timer_wheel_st {
+  unsigned long now;           // last tick advanced through
+  long count;                  // timers on the wheel
+  tw_timer slots[TW_LEVELS][TW_SLOTS];   // list heads
+} timer_wheel;
+
+/* tw_init sets up an empty wheel whose clock reads "now" */
+void tw_init(timer_wheel *tw, unsigned long now);
+
+/**
+ * tw_add puts "t" on the wheel to expire at tick t->expires; a
+ * tick already past expires on the next tw_advance.  Timers
+ * further off than the wheel spans are parked in its last slot
+ * and re-sorted when they come round.
+ */
+void tw_add(timer_wheel *tw, tw_timer *t);
+
+/* tw_del takes "t" off the wheel, if it is on it */
+void tw_del(timer_wheel *tw, tw_timer *t);
+
+static inline int tw_pending(const tw_timer *t) {
+  return t->prev != NULL;
+}
+
+/**
+ * tw_advance moves the clock forward to "now" and returns the
+ * timers that expired on the way, chained through "next" in
+ * expiry order, or NULL.  They are no longer on the wheel.
+ */
+tw_timer *tw_advance(timer_wheel *tw, unsigned long now);
+
+/**
+ * tw_next_tick returns a tick by which the wheel must next be
+ * advanced: the earliest expiry if it is in the lowest level,
+ * otherwise the next cascade that could bring one down.  Only
+ * meaningful when count > 0.
+ */
+unsigned long tw_next_tick(timer_wheel *tw);
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * uring.c
+ *
+ * The rings are shared with the kernel, which moves the SQ head
+ * and the CQ tail while we move the SQ tail and the CQ head; the
+ * kernel's side isn't _Atomic, so the loads and stores across
+ * that line are the compiler's __atomic builtins.  The SQ index
+ * array is filled in once, as the identity, so an SQE's slot is
+ * just the tail.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+                     void *arg, size_t argsz) {
+  return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n) {
+  return (int) syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int ur_init(uring *r, unsigned entries) {
+  struct io_uring_params p;
+  char *sq, *cq;
+  unsigned i;
+  int err;
+
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE |
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  p.cq_entries = 4 * entries;
+  if ((r->fd = sys_setup(entries, &p)) < 0 && errno == EINVAL) {
+    // older than 6.1: no single issuer; completion work runs
+    // whenever the kernel likes
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * entries;
+    r->fd = sys_setup(entries, &p);
+  }
+  if (r->fd < 0)
+    return -errno;
+  r->features = p.features;
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size)
+      r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = r->sq_ring_size;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, r->fd,
+                                         IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+
+  sq = (char *) r->sq_ring;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sqe_tail = *r->sq_tail;
+  for (i = 0; i < p.sq_entries; i++)
+    r->sq_array[i] = i;
+  cq = (char *) r->cq_ring;
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  return 0;
+
+ fail:
+  err = errno;
+  if (r->sq_ring == MAP_FAILED)
+    r->sq_ring = NULL;
+  ur_exit(r);
+  return -err;
+}
+
+int ur_enable(uring *r) {
+  return sys_register(r->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0 ? -errno : 0;
+}
+
+unsigned ur_room(uring *r) {
+  return r->sq_entries - (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+int ur_submit(uring *r) {
+  unsigned queued = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  if (queued == 0)
+    return 0;
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  return sys_enter(r->fd, queued, 0, 0, NULL, 0);
+}
+
+struct io_uring_sqe *ur_sqe(uring *r) {
+  struct io_uring_sqe *sqe;
+
+  if (ur_room(r) == 0 && (ur_submit(r) < 0 || ur_room(r) == 0))
+    return NULL;
+  sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sqe_tail++;
+  return sqe;
+}
+
+int ur_enter(uring *r, long timeout_ms) {
+  unsigned queued = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+
+  __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+  if (timeout_ms < 0)
+    return sys_enter(r->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (unsigned long) &ts;
+  return sys_enter(r->fd, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg));
+}
+
+struct io_uring_cqe *ur_peek(uring *r) {
+  unsigned head = *r->cq_head;
+
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &r->cqes[head & r->cq_mask];
+}
+
+void ur_seen(uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void ur_exit(uring *r) {
+  if (r->sqes != NULL)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring != NULL)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  r->fd = -1;
+  r->sqes = NULL;
+  r->sq_ring = r->cq_ring = NULL;
+}
+
+int ur_bufs_init(uring *r, ur_bufs *b, int bgid, unsigned n, unsigned size) {
+  struct io_uring_buf_reg reg;
+  size_t ring_size = n * sizeof(struct io_uring_buf);
+  unsigned i;
+
+  b->n = n;
+  b->size = size;
+  b->bgid = bgid;
+  b->tail = 0;
+  // the kernel wants the ring page-aligned
+  b->ring = (struct io_uring_buf_ring *) mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (b->ring == MAP_FAILED) {
+    b->ring = NULL;
+    return -errno;
+  }
+  if ((b->base = (char *) malloc((size_t) n * size)) == NULL) {
+    ur_bufs_free(b);
+    return -ENOMEM;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) b->ring;
+  reg.ring_entries = n;
+  reg.bgid = bgid;
+  if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    // older than 5.19
+    int err = errno;
+
+    ur_bufs_free(b);
+    return -err;
+  }
+  for (i = 0; i < n; i++)
+    ur_buf_put(b, i);
+  return 0;
+}
+
+char *ur_buf(ur_bufs *b, int bid) {
+  return b->base + (size_t) bid * b->size;
+}
+
+void ur_buf_put(ur_bufs *b, int bid) {
+  struct io_uring_buf *buf = &b->ring->bufs[b->tail & (b->n - 1)];
+
+  buf->addr = (unsigned long) ur_buf(b, bid);
+  buf->len = b->size;
+  buf->bid = (unsigned short) bid;
+  b->tail++;
+  __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+void ur_bufs_free(ur_bufs *b) {
+  if (b->ring != NULL)
+    munmap(b->ring, b->n * sizeof(struct io_uring_buf));
+  free(b->base);
+  b->ring = NULL;
+  b->base = NULL;
+}
@@ -0,0 +1,91 @@
+/**
+ * uring.h
+ *
+ * Just enough io_uring for the event loop, straight on the system
+ * calls: a submission and a completion ring, and a ring of
+ * provided buffers for the kernel to read into.  SQEs are queued
+ * with ur_sqe and go to the kernel only at ur_submit or ur_enter,
+ * however many there are, and completions are taken straight off
+ * the shared ring with ur_peek and ur_seen.
+ *
+ * A ring starts disabled, so it can be set up on one thread and
+ * driven from another: the thread that calls ur_enable is then
+ * the only one that may submit, which lets the kernel run
+ * completion work at ur_enter rather than interrupting us.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+typedef struct uring_st {
+  int fd;
+  unsigned features;            // IORING_FEAT_*
+  unsigned *sq_head, *sq_tail, *sq_array;
+  unsigned sq_mask, sq_entries;
+  unsigned sqe_tail;            // ours, published at submission
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head, *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring;
+
+/**
+ * ur_init sets up a ring of "entries" SQEs (a power of two), with
+ * room for four times as many completions.  Returns 0, or -errno:
+ * -ENOSYS or -EPERM mean no io_uring here at all.
+ */
+int ur_init(uring *r, unsigned entries);
+
+/* ur_enable lets the calling thread, and only it, submit */
+int ur_enable(uring *r);
+
+/**
+ * ur_sqe returns a cleared SQE to fill in, submitting what is
+ * queued to make room if it must, or NULL if there is none.
+ * ur_room says how many more may be had without that.
+ */
+struct io_uring_sqe *ur_sqe(uring *r);
+unsigned ur_room(uring *r);
+
+/* ur_submit hands the kernel every queued SQE without waiting */
+int ur_submit(uring *r);
+
+/**
+ * ur_enter submits every queued SQE and then waits until there is
+ * at least one completion, or timeout_ms have passed (-1: no
+ * limit).  Returns what io_uring_enter did, or -1 with errno set;
+ * ETIME means the time ran out.
+ */
+int ur_enter(uring *r, long timeout_ms);
+
+/* the oldest completion not yet seen, or NULL; ur_seen consumes it */
+struct io_uring_cqe *ur_peek(uring *r);
+void ur_seen(uring *r);
+
+void ur_exit(uring *r);
+
+/**
+ * A ring of "n" provided buffers (a power of two, at most 32768)
+ * of "size" bytes each, registered as buffer group "bgid".  A read
+ * SQE flagged IOSQE_BUFFER_SELECT takes whichever is free when
+ * data arrives, and its completion says which; give it back with
+ * ur_buf_put once the data has been used.
+ */
+typedef struct ur_bufs_st {
+  struct io_uring_buf_ring *ring;
+  char *base;
+  unsigned n, size;
+  unsigned short tail;
+  int bgid;
+} ur_bufs;
+
+int   ur_bufs_init(uring *r, ur_bufs *b, int bgid, unsigned n, unsigned size);
+char *ur_buf(ur_bufs *b, int bid);
+void  ur_buf_put(ur_bufs *b, int bid);
+void  ur_bufs_free(ur_bufs *b);   // after the ring has gone
+
+#endif
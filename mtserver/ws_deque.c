@@ -0,0 +1,148 @@
+/**
+ * ws_deque.c
+ *
+ * Chase-Lev deque, following the C11 formulation of Le, Pop,
+ * Cohen and Zappa Nardelli ("Correct and Efficient
+ * Work-Stealing for Weak Memory Models").  Arrays replaced by a
+ * grow are kept on a chain and only freed in deque_destroy, since
+ * a thief may still be reading the old one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ws_deque.h"
+
+static ws_array *array_new(long size) {
+  ws_array *a;
+  long i;
+
+  a = (ws_array *) malloc(sizeof(ws_array) + size * sizeof(void *));
+  if (a == NULL)
+    return NULL;
+  a->size = size;
+  a->next = NULL;
+  for (i = 0; i < size; i++)
+    atomic_init(&a->buf[i], NULL);
+  return a;
+}
+
+int deque_init(ws_deque *dq, long size) {
+  ws_array *a;
+  long s = 2;
+
+  while (s < size)
+    s <<= 1;
+  if ((a = array_new(s)) == NULL)
+    return -1;
+  atomic_init(&dq->top, 0);
+  atomic_init(&dq->bottom, 0);
+  atomic_init(&dq->array, a);
+  return 0;
+}
+
+void deque_init_empty(ws_deque *dq) {
+  atomic_init(&dq->top, 0);
+  atomic_init(&dq->bottom, 0);
+  atomic_init(&dq->array, NULL);
+}
+
+/* copy the live range into an array twice the size */
+static ws_array *array_grow(ws_deque *dq, ws_array *a, long top, long bottom) {
+  ws_array *na;
+  long i;
+
+  if ((na = array_new(a->size * 2)) == NULL)
+    return NULL;
+  for (i = top; i < bottom; i++)
+    atomic_store_explicit(&na->buf[i & (na->size - 1)],
+                          atomic_load_explicit(&a->buf[i & (a->size - 1)],
+                                               memory_order_relaxed),
+                          memory_order_relaxed);
+  na->next = a;
+  atomic_store_explicit(&dq->array, na, memory_order_release);
+  return na;
+}
+
+int deque_push(ws_deque *dq, void *data) {
+  long b, t;
+  ws_array *a;
+
+  b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+  t = atomic_load_explicit(&dq->top, memory_order_acquire);
+  a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+  if (b - t > a->size - 1) {
+    if ((a = array_grow(dq, a, t, b)) == NULL)
+      return -1;
+  }
+  atomic_store_explicit(&a->buf[b & (a->size - 1)], data, memory_order_relaxed);
+  atomic_store_explicit(&dq->bottom, b + 1, memory_order_release);
+  return 0;
+}
+
+void *deque_take(ws_deque *dq) {
+  long b, t;
+  ws_array *a;
+  void *data;
+
+  b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+  a = atomic_load_explicit(&dq->array, memory_order_relaxed);
+  atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+  if (t > b) {
+    // empty
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  data = atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+  if (t == b) {
+    // last element: race the thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+      data = NULL;
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+  }
+  return data;
+}
+
+void *deque_steal(ws_deque *dq) {
+  long b, t;
+  ws_array *a;
+  void *data;
+
+  t = atomic_load_explicit(&dq->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+  if (t >= b)
+    return NULL;
+
+  a = atomic_load_explicit(&dq->array, memory_order_acquire);
+  data = atomic_load_explicit(&a->buf[t & (a->size - 1)], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&dq->top, &t, t + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed))
+    return NULL;
+  return data;
+}
+
+long deque_count(ws_deque *dq) {
+  long b, t;
+
+  t = atomic_load_explicit(&dq->top, memory_order_relaxed);
+  b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+  return (b > t) ? b - t : 0;
+}
+
+void deque_destroy(ws_deque *dq) {
+  ws_array *a, *next;
+
+  for (a = atomic_load(&dq->array); a != NULL; a = next) {
+    next = a->next;
+    free(a);
+  }
+  atomic_store(&dq->array, NULL);
+}
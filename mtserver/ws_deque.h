@@ -0,0 +1,62 @@
+/**
+ * ws_deque.h
+ *
+ * A Chase-Lev work-stealing deque of pointers.  The owning
+ * thread pushes and takes at the bottom (LIFO, so it keeps
+ * working on whatever is still warm in its cache); any other
+ * thread may steal from the top (FIFO, the oldest and usually
+ * biggest piece of work).  Only deque_push and deque_take may be
+ * called by the owner, and only the owner.
+ */
+
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stdatomic.h>
+
+typedef struct ws_array_st {
+  long size;                   // always a power of two
+  struct ws_array_st *next;    // older arrays, freed with the deque
+  _Atomic(void *) buf[];
+} ws_array;
+
+typedef struct ws_deque_st {
+  _Alignas(64) atomic_long top;       // thieves steal here
+  _Alignas(64) atomic_long bottom;    // the owner works here
+  _Atomic(ws_array *) array;
+} ws_deque;
+
+/**
+ * deque_init sets up an empty deque with room for
+ * "size" pointers; it grows on demand.  Returns 0, or -1
+ * if out of memory.
+ */
+int deque_init(ws_deque *dq, long size);
+
+/**
+ * deque_init_empty gives a deque no storage at all.  Thieves
+ * can already look at it (and find nothing), while the owner
+ * calls deque_init before its first push; that way the array
+ * is allocated, and first touched, by the thread that uses it.
+ */
+void deque_init_empty(ws_deque *dq);
+
+/* owner only: push "data" (non-NULL) on the bottom; -1 if out of memory */
+int deque_push(ws_deque *dq, void *data);
+
+/* owner only: pop the most recently pushed pointer, or NULL */
+void *deque_take(ws_deque *dq);
+
+/**
+ * deque_steal takes the oldest pointer from the top.  Returns
+ * NULL if the deque is empty or another thread won the race
+ * for the same element.
+ */
+void *deque_steal(ws_deque *dq);
+
+/* a racy snapshot of how many pointers are queued */
+long deque_count(ws_deque *dq);
+
+void deque_destroy(ws_deque *dq);
+
+#endif